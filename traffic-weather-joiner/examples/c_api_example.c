@@ -0,0 +1,92 @@
+/*
+ * the pipeline through the C interface, run from a directory laid out like the
+ * executable expects (./csv inputs, ./output; `joiner generate` writes one).
+ * every call is checked, so a non-zero exit means some part of the interface
+ * misbehaved
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "joiner.h"
+
+#define CHECK(call)                                                         \
+    do{                                                                     \
+        if((call) != JOINER_OK){                                            \
+            fprintf(stderr, "%s failed: %s\n", #call, joiner_last_error()); \
+            return 1;                                                       \
+        }                                                                   \
+    }while(0)
+
+static int printTable(const char *path){
+    joiner_table *table = joiner_table_read_csv(path);
+    if(table == NULL){
+        fprintf(stderr, "joiner_table_read_csv(%s) failed: %s\n", path, joiner_last_error());
+        return 1;
+    }
+
+    size_t rows = joiner_table_rows(table);
+    size_t columns = joiner_table_columns(table);
+    printf("%s: %zu rows, %zu columns\n", path, rows, columns);
+
+    for(size_t i = 0; i < columns; i++){
+        joiner_column column;
+        if(joiner_table_column(table, i, &column) != JOINER_OK || column.length != rows){
+            fprintf(stderr, "column %zu is inconsistent\n", i);
+            joiner_table_free(table);
+            return 1;
+        }
+
+        if(column.type == JOINER_COLUMN_DOUBLE){
+            const double *values = (const double *)column.data;
+            double sum = 0.0;
+            size_t present = 0;
+            for(size_t row = 0; row < column.length; row++){
+                if(isnan(values[row])) continue;
+                sum += values[row];
+                present++;
+            }
+            printf("  %-32s double  mean %.4f over %zu values\n", column.name, present > 0 ? sum / (double)present : 0.0, present);
+        }else{
+            const char *const *values = (const char *const *)column.data;
+            printf("  %-32s string  first \"%s\"\n", column.name, column.length > 0 ? values[0] : "");
+        }
+    }
+
+    joiner_column missing;
+    if(joiner_table_column(table, columns, &missing) != JOINER_ERROR){
+        fprintf(stderr, "a column past the end was handed out\n");
+        joiner_table_free(table);
+        return 1;
+    }
+
+    joiner_table_free(table);
+    return 0;
+}
+
+int main(void){
+    printf("joiner %s\n", joiner_version());
+
+    CHECK(joiner_split("./csv/traffic_data_with_coords.csv", "./output/c_traffic.seg", "./output/c_segments.csv", 0, 1));
+    CHECK(joiner_sort("./output/c_traffic.seg", "./output/c_traffic_sorted.seg"));
+    CHECK(joiner_merge_weather(
+        "./csv/open-meteo-no-cords.csv", "./output/weather.idx", "./output/c_segments.csv",
+        "./output/c_traffic_sorted.seg", "./output/c_merged.seg"
+    ));
+    CHECK(joiner_merge("./output/c_merged.seg", "./output/c_merged.csv", 0));
+    CHECK(joiner_add_time_features("./output/c_merged.csv", "./output/c_features.csv"));
+
+    const char *predicates[] = {"volume>=100", "timestamp>=2019-01-01"};
+    CHECK(joiner_query("./output/c_merged.seg", predicates, 2, "./output/c_query.csv"));
+
+    /* the sorted container of the first sort is still there, it must not pass for this one */
+    if(joiner_sort("./output/does_not_exist.seg", "./output/c_traffic_sorted.seg") != JOINER_ERROR){
+        fprintf(stderr, "sorting a missing container did not fail\n");
+        return 1;
+    }
+    printf("expected failure: %s\n", joiner_last_error());
+
+    if(printTable("./output/c_features.csv") != 0) return 1;
+    return printTable("./output/c_query.csv");
+}
@@ -1,14 +1,16 @@
 #pragma once
 
 #include "constants.hpp"
+#include "csv_tokenizer.hpp"
+#include "compressed_io.hpp"
 #include "utilities.hpp"
 
 #include "time_features.hpp"
 
 #include <string>
 #include <vector>
-#include <csv2/reader.hpp>
 #include <filesystem>
+#include <memory_resource>
 #include <fstream>
 #include <fmt/core.h>
 
@@ -18,14 +20,9 @@ inline void addTimeFeatures(
 ){
     fmt::println("loading {}...", inputCsvPath);
 
-    csv2::Reader<
-        csv2::delimiter<','>, 
-        csv2::quote_character<'"'>, 
-        csv2::first_row_is_header<true>,
-        csv2::trim_policy::trim_whitespace
-    > csv;
+    tokenizer::Reader csv;
 
-    csv.mmap(inputCsvPath);
+    auto input{compression::open(csv, inputCsvPath)};
 
     std::vector<std::string> header;
     for(const auto &cell : csv.header()){
@@ -40,7 +37,7 @@ inline void addTimeFeatures(
     size_t hourIndex    {utilities::findColumn(header, constants::column_names::Hour)};
     size_t minuteIndex  {utilities::findColumn(header, constants::column_names::Minute)};
 
-    std::ofstream out{outputCsvPath};
+    compression::OutputFile out{outputCsvPath};
 
     for(size_t i{0}; i < header.size(); i++){
         if(i > 0) out << ',';
@@ -48,6 +45,8 @@ inline void addTimeFeatures(
     }
     out << ",is_holiday,is_weekend,month_cos,month_sin,hour_cos,hour_sin,minute_cos,minute_sin\n";
 
+    // one row is the whole working set here, the arena is reset before each
+    utilities::Arena arena{64 << 10};
     size_t rowCount{0};
     for(const auto &row : csv){
         rowCount++;
@@ -55,11 +54,11 @@ inline void addTimeFeatures(
             fmt::println("processed {} rows", rowCount);
         }
 
-        std::vector<std::string> fields;
+        arena.reset();
+        std::pmr::vector<std::pmr::string> fields{arena.resource()};
+        fields.reserve(row.size());
         for(const auto &cell : row){
-            std::string value;
-            cell.read_value(value);
-            fields.push_back(value);
+            cell.read_value(fields.emplace_back());
         }
 
         if(fields.empty()) continue;
@@ -68,11 +67,11 @@ inline void addTimeFeatures(
         if(fields.size() < requiredSize) continue;
 
         units::Timestamp timestamp;
-        timestamp.year      = std::stoi(fields[yearIndex]);
-        timestamp.month     = std::stoi(fields[monthIndex]);
-        timestamp.day       = std::stoi(fields[dayIndex]);
-        timestamp.hour      = std::stoi(fields[hourIndex]);
-        timestamp.minute    = std::stoi(fields[minuteIndex]);
+        timestamp.year      = utilities::toInt(fields[yearIndex]);
+        timestamp.month     = utilities::toInt(fields[monthIndex]);
+        timestamp.day       = utilities::toInt(fields[dayIndex]);
+        timestamp.hour      = utilities::toInt(fields[hourIndex]);
+        timestamp.minute    = utilities::toInt(fields[minuteIndex]);
 
         auto timeFeatures   {feature_engineering::encodeTime(timestamp)};
         bool isHoliday      {feature_engineering::isHoliday(timestamp)};
@@ -96,5 +95,6 @@ inline void addTimeFeatures(
         out << '\n';
     }
 
+    if(!out.close()) return;
     fmt::println("done: {} rows written to {}", rowCount, outputCsvPath);
 }
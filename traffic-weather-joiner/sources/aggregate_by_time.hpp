@@ -0,0 +1,209 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include <sstream>
+#include <fmt/core.h>
+
+#include "constants.hpp"
+#include "csv_tokenizer.hpp"
+#include "segment_container.hpp"
+#include "units.hpp"
+#include "rolling_features.hpp"
+#include "utilities.hpp"
+
+namespace _{
+
+    // running volume statistics of the bucket being filled
+    struct VolumeBucket{
+        double sum{0.0};
+        double min{std::numeric_limits<double>::max()};
+        double max{std::numeric_limits<double>::lowest()};
+        size_t count{0};
+
+        void add(double value){
+            sum += value;
+            min = std::min(min, value);
+            max = std::max(max, value);
+            count++;
+        }
+    };
+
+} // namespace _
+
+// resamples every time sorted segment onto a regular BucketMinutes grid in
+// one streaming pass: volume becomes the bucket sum next to its observation
+// count, min and max, other columns keep the bucket's first row. only the open
+// bucket is held in memory
+inline void aggregateByTime(
+    const std::string &inputContainerPath,
+    const std::string &outputContainerPath
+){
+    auto input{container::Reader::open(inputContainerPath)};
+    if(!input) return;
+    const auto &segments{input->entries()};
+
+    fmt::println("found {} segments to aggregate into {} minute buckets", segments.size(), constants::aggregation::BucketMinutes);
+
+    const auto &droppedColumns{constants::aggregation::droppedColumns()};
+    container::Writer writer{outputContainerPath};
+
+    std::atomic<size_t> inputRowCount{0};
+    std::atomic<size_t> outputRowCount{0};
+    std::atomic<size_t> segmentCount{0};
+    utilities::parallelFor(segments.size(), constants::system::ThreadCount, [&](size_t segment){
+        const container::Entry &entry{segments[segment]};
+
+        if(++segmentCount % constants::system::FileProgressInterval == 0){
+            fmt::println("aggregating segment {}/{}", segmentCount.load(), segments.size());
+        }
+
+        tokenizer::Reader csv;
+
+        csv.parse(input->block(entry));
+
+        std::vector<std::string> header;
+        for(const auto &cell : csv.header()){
+            std::string value;
+            cell.read_value(value);
+            header.push_back(value);
+        }
+
+        size_t yearIndex{0};
+        size_t monthIndex{0};
+        size_t dayIndex{0};
+        size_t hourIndex{0};
+        size_t minuteIndex{0};
+        size_t volumeIndex{header.size()};
+
+        for(size_t i{0}; i < header.size(); i++){
+            if(header[i] == constants::column_names::Year)  yearIndex = i;
+            if(header[i] == constants::column_names::Month) monthIndex = i;
+            if(header[i] == constants::column_names::Day)   dayIndex = i;
+            if(header[i] == constants::column_names::Hour)  hourIndex = i;
+            if(header[i] == constants::column_names::Minute)minuteIndex = i;
+            if(header[i] == constants::column_names::Volume)volumeIndex = i;
+        }
+
+        if(volumeIndex == header.size()){
+            fmt::println("[!!! no {} column in segment {}, skipping... !!!]", constants::column_names::Volume, entry.segmentId);
+            return;
+        }
+
+        std::vector<size_t> keptColumns;
+        for(size_t i{0}; i < header.size(); i++){
+            if(std::find(droppedColumns.begin(), droppedColumns.end(), header[i]) != droppedColumns.end()) continue;
+            keptColumns.push_back(i);
+        }
+
+        // sortByTime leaves lag features to this stage, so they describe buckets rather than raw intervals
+        bool addLagFeatures{constants::flags::LagFeatures};
+
+        std::ostringstream out;
+
+        for(size_t i{0}; i < keptColumns.size(); i++){
+            if(i > 0) out << ',';
+            out << header[keptColumns[i]];
+        }
+        out << ",volume_count,volume_bucket_min,volume_bucket_max";
+        if(addLagFeatures) feature_engineering::LagFeatures::writeHeader(out);
+        out << '\n';
+
+        int bucketMinutes{constants::aggregation::BucketMinutes};
+        int bucketStart{std::numeric_limits<int>::min()};
+        _::VolumeBucket bucket;
+        std::vector<std::string> bucketFields;
+        feature_engineering::LagFeatures lagFeatures;
+        size_t rowCount{0};
+        size_t bucketCount{0};
+        int firstBucket{0};
+        int lastBucket{0};
+
+        auto writeBucket{[&](int start, const _::VolumeBucket &volumes){
+            units::Timestamp timestamp{units::Timestamp::fromEpochMinutes(start)};
+            std::string volume{volumes.count > 0 ? fmt::format("{}", volumes.sum) : ""};
+
+            for(size_t i{0}; i < keptColumns.size(); i++){
+                if(i > 0) out << ',';
+                size_t column{keptColumns[i]};
+                if(column == yearIndex)         out << timestamp.year;
+                else if(column == monthIndex)   out << timestamp.month;
+                else if(column == dayIndex)     out << timestamp.day;
+                else if(column == hourIndex)    out << timestamp.hour;
+                else if(column == minuteIndex)  out << timestamp.minute;
+                else if(column == volumeIndex)  out << volume;
+                else                            out << bucketFields[column];
+            }
+            out << ',' << volumes.count;
+            if(volumes.count > 0) out << ',' << volumes.min << ',' << volumes.max;
+            else out << ",,";
+            if(addLagFeatures) lagFeatures.writeRow(out, start, volume.c_str());
+            out << '\n';
+            if(bucketCount++ == 0) firstBucket = start;
+            lastBucket = start;
+        }};
+
+        for(const auto &row : csv){
+            std::vector<std::string> fields;
+            for(const auto &cell : row){
+                std::string value;
+                cell.read_value(value);
+                fields.push_back(value);
+            }
+
+            size_t requiredSize{std::max({yearIndex, monthIndex, dayIndex, hourIndex, minuteIndex, volumeIndex}) + 1};
+            if(fields.size() < requiredSize) continue;
+            // a short row may open a bucket, whose other columns are all written
+            if(fields.size() < header.size()) fields.resize(header.size());
+            rowCount++;
+
+            units::Timestamp timestamp{
+                utilities::toInt(fields[yearIndex]),
+                utilities::toInt(fields[monthIndex]),
+                utilities::toInt(fields[dayIndex]),
+                utilities::toInt(fields[hourIndex]),
+                utilities::toInt(fields[minuteIndex])
+            };
+            int minute{timestamp.toEpochMinutes()};
+            int start{minute - ((minute % bucketMinutes) + bucketMinutes) % bucketMinutes};
+
+            char *end{nullptr};
+            double volume{std::strtod(fields[volumeIndex].c_str(), &end)};
+            bool hasVolume{end != fields[volumeIndex].c_str()};
+
+            // input is time sorted, so a bucket is complete as soon as a later one starts
+            if(start > bucketStart){
+                if(bucketStart != std::numeric_limits<int>::min()){
+                    writeBucket(bucketStart, bucket);
+                    if(constants::aggregation::FillGaps){
+                        for(int gap{bucketStart + bucketMinutes}; gap < start; gap += bucketMinutes){
+                            writeBucket(gap, {});
+                        }
+                    }
+                }
+                bucketStart = start;
+                bucket = {};
+                bucketFields = std::move(fields);
+            }
+
+            if(hasVolume) bucket.add(volume);
+        }
+        if(bucketStart != std::numeric_limits<int>::min()){
+            writeBucket(bucketStart, bucket);
+        }
+
+        if(bucketCount == 0) writer.append(entry.segmentId, out.str(), 0);
+        else writer.append(entry.segmentId, out.str(), bucketCount, firstBucket, lastBucket);
+        inputRowCount += rowCount;
+        outputRowCount += bucketCount;
+    });
+    if(!writer.finish()) return;
+
+    fmt::println(
+        "done: aggregated {} rows into {} buckets in {}",
+        inputRowCount.load(), outputRowCount.load(), outputContainerPath
+    );
+}
@@ -0,0 +1,206 @@
+#pragma once
+
+#include "constants.hpp"
+#include "csv_tokenizer.hpp"
+#include "compressed_io.hpp"
+#include "time_columns.hpp"
+#include "utilities.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <fmt/core.h>
+
+namespace _{
+
+    struct SplitLabel{
+        bool test;
+        uint32_t fold;      // train rows only
+    };
+
+    // a group's key depends only on its stratum, its name and the seed, never
+    // on where its rows are in the input
+    inline uint64_t groupKey(std::string_view stratum, std::string_view group){
+        uint64_t stratumHash{utilities::hashBytes(stratum.data(), stratum.size(), constants::splits::Seed)};
+        return utilities::hashBytes(group.data(), group.size(), stratumHash);
+    }
+
+    // labels of one stratum's groups: ranked by key, the first TestFraction of
+    // them are test and the rest take the folds in turn, so the stratum splits
+    // in the configured proportions
+    inline void labelGroups(std::vector<uint64_t> keys, std::unordered_map<uint64_t, SplitLabel> &labels){
+        std::sort(keys.begin(), keys.end());
+        size_t testGroups{static_cast<size_t>(std::lround(constants::splits::TestFraction * static_cast<double>(keys.size())))};
+        size_t folds{std::max<size_t>(1, constants::splits::Folds)};
+        for(size_t rank{0}; rank < keys.size(); rank++){
+            labels[keys[rank]] = rank < testGroups ? SplitLabel{true, 0} : SplitLabel{false, static_cast<uint32_t>((rank - testGroups) % folds)};
+        }
+    }
+
+    // ./output/name.csv -> ./output/name.test.csv
+    inline std::string splitFilePath(const std::string &path, const std::string &label){
+        size_t name{path.find_last_of('/')};
+        name = name == std::string::npos ? 0 : name + 1;
+        size_t extension{path.find('.', name + 1)};
+        if(extension == std::string::npos) extension = path.size();
+        return fmt::format("{}.{}{}", path.substr(0, extension), label, path.substr(extension));
+    }
+
+} // namespace _
+
+// gives every row a train/test label and, for train rows, a cross validation
+// fold, so modelling can load just the rows it needs. rows are assigned by
+// group (the row, its segment or its time block) so a group never straddles
+// train and test, and with StratifyByRoadGroup each road group is split in the
+// configured proportions. time blocks are labelled across road groups, a week
+// is test for all of them or for none. labels come from the groups' keys, so
+// the same rows and seed give the same labels in any order. a first pass
+// collects the groups, the second writes the rows with split and fold
+// columns, or one file for the test rows and one per training fold
+inline void assignSplits(
+    const std::string &inputCsvPath,
+    const std::string &outputCsvPath
+){
+    fmt::println("loading {}...", inputCsvPath);
+
+    tokenizer::Reader csv;
+
+    auto input{compression::open(csv, inputCsvPath)};
+    if(!input) return;
+
+    std::vector<std::string> header;
+    for(const auto &cell : csv.header()){
+        std::string value;
+        cell.read_value(value);
+        header.push_back(value);
+    }
+
+    auto findColumn{[&](const char *name){
+        return static_cast<size_t>(std::find(header.begin(), header.end(), name) - header.begin());
+    }};
+    size_t segmentIndex{findColumn(constants::column_names::SegmentId)};
+    size_t roadGroupIndex{findColumn(constants::column_names::RoadGroup)};
+    auto timeColumns{units::TimeColumns::find(header)};
+
+    bool stratify{constants::splits::StratifyByRoadGroup};
+    if(stratify && roadGroupIndex == header.size()){
+        fmt::println("[!!! no {} column, rows are not stratified !!!]", constants::column_names::RoadGroup);
+        stratify = false;
+    }
+    auto grouping{constants::splits::GroupBy};
+    if((grouping == constants::splits::Grouping::Segment && segmentIndex == header.size())
+        || (grouping == constants::splits::Grouping::TimeBlock && !timeColumns)){
+        fmt::println("[!!! the configured grouping needs columns {} does not have, rows are assigned one by one !!!]", inputCsvPath);
+        grouping = constants::splits::Grouping::Row;
+    }
+
+    std::string headerLine{header.empty() ? std::string_view{} : csv.header().text()};
+
+    // split columns, or the test file and one file per training fold
+    size_t folds{std::max<size_t>(1, constants::splits::Folds)};
+    bool separateFiles{constants::splits::OutputMode == constants::splits::Output::Files};
+    std::unique_ptr<compression::OutputFile> columnsOut;
+    std::unique_ptr<compression::OutputFile> testOut;
+    std::vector<std::unique_ptr<compression::OutputFile>> foldOuts;
+    if(separateFiles){
+        testOut = std::make_unique<compression::OutputFile>(_::splitFilePath(outputCsvPath, "test"));
+        *testOut << headerLine << '\n';
+        for(size_t fold{0}; fold < folds; fold++){
+            foldOuts.push_back(std::make_unique<compression::OutputFile>(_::splitFilePath(outputCsvPath, fmt::format("train-fold-{}", fold))));
+            *foldOuts.back() << headerLine << '\n';
+        }
+    }else{
+        columnsOut = std::make_unique<compression::OutputFile>(outputCsvPath);
+        *columnsOut << headerLine << ',' << constants::column_names::Split << ',' << constants::column_names::Fold << '\n';
+    }
+
+    struct StratumState{
+        std::unordered_set<uint64_t> groups;
+        size_t testRows{0};
+        size_t trainRows{0};
+    };
+    // strata report the proportions, labels are ranked within each labelling
+    // stratum: the road group, or everything when time blocks are labelled
+    std::map<std::string, StratumState, std::less<>> strata;
+    std::map<std::string, std::unordered_set<uint64_t>, std::less<>> labellingStrata;
+    bool labelAcrossStrata{grouping == constants::splits::Grouping::TimeBlock};
+
+    std::string group;
+    auto stratumOf{[&](const tokenizer::Row &row){
+        return stratify && roadGroupIndex < row.size() ? row[roadGroupIndex].view() : std::string_view{};
+    }};
+    auto keyOf{[&](const tokenizer::Row &row, std::string_view stratum){
+        if(grouping == constants::splits::Grouping::Row){
+            group.assign(row.text());
+        }else if(grouping == constants::splits::Grouping::Segment){
+            group.assign(segmentIndex < row.size() ? row[segmentIndex].view() : std::string_view{});
+        }else{
+            int32_t minute{timeColumns->minuteOf(row, units::NoMinute)};
+            int32_t blockMinutes{std::max(1, constants::splits::TimeBlockMinutes)};
+            group = minute == units::NoMinute ? std::string{} : fmt::format("{}", minute >= 0 ? minute / blockMinutes : (minute + 1) / blockMinutes - 1);
+        }
+        return _::groupKey(labelAcrossStrata ? std::string_view{} : stratum, group);
+    }};
+
+    for(const auto &row : csv){
+        std::string_view stratum{stratumOf(row)};
+        uint64_t key{keyOf(row, stratum)};
+
+        auto found{strata.find(stratum)};
+        if(found == strata.end()) found = strata.emplace(std::string{stratum}, StratumState{}).first;
+        found->second.groups.insert(key);
+
+        std::string_view labellingStratum{labelAcrossStrata ? std::string_view{} : stratum};
+        auto labelling{labellingStrata.find(labellingStratum)};
+        if(labelling == labellingStrata.end()) labelling = labellingStrata.emplace(std::string{labellingStratum}, std::unordered_set<uint64_t>{}).first;
+        labelling->second.insert(key);
+    }
+
+    std::unordered_map<uint64_t, _::SplitLabel> labels;
+    for(const auto &[stratum, keys] : labellingStrata){
+        _::labelGroups({keys.begin(), keys.end()}, labels);
+    }
+    labellingStrata.clear();
+
+    size_t rowCount{0};
+    for(const auto &row : csv){
+        rowCount++;
+        if(rowCount % constants::system::RowProgressInterval == 0){
+            fmt::println("assigned {} rows", rowCount);
+        }
+
+        std::string_view stratum{stratumOf(row)};
+        const _::SplitLabel &label{labels.at(keyOf(row, stratum))};
+        StratumState &state{strata.find(stratum)->second};
+        (label.test ? state.testRows : state.trainRows)++;
+
+        if(separateFiles){
+            *(label.test ? testOut : foldOuts[label.fold]) << row.text() << '\n';
+        }else if(label.test){
+            *columnsOut << row.text() << ",test,\n";
+        }else{
+            *columnsOut << row.text() << ",train," << label.fold << '\n';
+        }
+    }
+
+    bool closed{separateFiles ? testOut->close() : columnsOut->close()};
+    for(auto &foldOut : foldOuts) closed = foldOut->close() && closed;
+    if(!closed) return;
+
+    for(const auto &[stratum, state] : strata){
+        size_t rows{state.testRows + state.trainRows};
+        fmt::println(
+            "{}: {} rows, {:.1f}% test{}",
+            stratum.empty() ? "all" : stratum, rows,
+            rows > 0 ? 100.0 * static_cast<double>(state.testRows) / static_cast<double>(rows) : 0.0,
+            grouping == constants::splits::Grouping::Row ? std::string{} : fmt::format(" ({} groups)", state.groups.size())
+        );
+    }
+    fmt::println("done: {} rows assigned to test and {} training folds in {}", rowCount, folds,
+        separateFiles ? _::splitFilePath(outputCsvPath, "*") : outputCsvPath);
+}
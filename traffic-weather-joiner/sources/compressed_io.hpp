@@ -0,0 +1,341 @@
+#pragma once
+
+#include <algorithm>
+#include <climits>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <memory>
+#include <optional>
+#include <ostream>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <fmt/core.h>
+#include <zlib.h>
+#include <zstd.h>
+
+#include "constants.hpp"
+#include "csv_tokenizer.hpp"
+#include "utilities.hpp"
+
+namespace compression{
+
+    enum class Codec{ None, Gzip, Zstd };
+
+    inline Codec codecOf(std::string_view path){
+        if(path.ends_with(".gz")) return Codec::Gzip;
+        if(path.ends_with(".zst")) return Codec::Zstd;
+        return Codec::None;
+    }
+
+    namespace _{
+
+        constexpr size_t OutputChunk{1 << 20};    // decompressed bytes per read of a source
+
+        // concatenated members (as written by OutputFile) are inflated back to back
+        class GzipSource : public tokenizer::TextSource{
+        public:
+            GzipSource(utilities::MappedFile file, const std::string &path)
+                : file_{std::move(file)}
+                , path_{path}
+            {
+                if(inflateInit2(&stream_, 15 + 32) != Z_OK) throw std::runtime_error{fmt::format("could not decompress {}", path_)};
+            }
+
+            GzipSource(const GzipSource &) = delete;
+            GzipSource &operator=(const GzipSource &) = delete;
+
+            ~GzipSource() override{
+                inflateEnd(&stream_);
+            }
+
+            bool read(std::string &text) override{
+                size_t start{text.size()};
+                text.resize(start + OutputChunk);
+                size_t produced{0};
+                while(!finished_ && produced < OutputChunk){
+                    stream_.next_in     = reinterpret_cast<Bytef *>(const_cast<char *>(file_.data() + consumed_));
+                    stream_.avail_in    = static_cast<uInt>(std::min<size_t>(file_.size() - consumed_, UINT_MAX));
+                    stream_.next_out    = reinterpret_cast<Bytef *>(text.data() + start + produced);
+                    stream_.avail_out   = static_cast<uInt>(OutputChunk - produced);
+                    uInt availableIn{stream_.avail_in};
+                    uInt availableOut{stream_.avail_out};
+
+                    int status{inflate(&stream_, Z_NO_FLUSH)};
+                    consumed_ += availableIn - stream_.avail_in;
+                    produced += availableOut - stream_.avail_out;
+
+                    if(status == Z_STREAM_END){
+                        if(consumed_ == file_.size()) finished_ = true;
+                        else if(inflateReset(&stream_) != Z_OK) fail("is corrupt");
+                    }else if(status != Z_OK && status != Z_BUF_ERROR){
+                        fail("is corrupt");
+                    }else if(consumed_ == file_.size() && stream_.avail_out > 0){
+                        // every byte went in and there was room, yet the member did not end
+                        fail("is truncated");
+                    }
+                }
+                text.resize(start + produced);
+                return produced > 0;
+            }
+
+            void rewind() override{
+                inflateReset(&stream_);
+                consumed_ = 0;
+                finished_ = false;
+            }
+
+        private:
+            [[noreturn]] void fail(const char *reason){
+                throw std::runtime_error{fmt::format("could not decompress {}, it {}", path_, reason)};
+            }
+
+            utilities::MappedFile file_;
+            std::string path_;
+            z_stream stream_{};
+            size_t consumed_{0};
+            bool finished_{false};
+        };
+
+        class ZstdSource : public tokenizer::TextSource{
+        public:
+            ZstdSource(utilities::MappedFile file, const std::string &path)
+                : file_{std::move(file)}
+                , path_{path}
+                , context_{ZSTD_createDCtx(), ZSTD_freeDCtx}
+            {
+                if(!context_) throw std::runtime_error{fmt::format("could not decompress {}", path_)};
+            }
+
+            bool read(std::string &text) override{
+                size_t start{text.size()};
+                text.resize(start + OutputChunk);
+                ZSTD_outBuffer output{text.data() + start, OutputChunk, 0};
+                while(!finished_ && output.pos < output.size){
+                    ZSTD_inBuffer input{file_.data(), file_.size(), consumed_};
+                    size_t remaining{ZSTD_decompressStream(context_.get(), &output, &input)};
+                    consumed_ = input.pos;
+                    if(ZSTD_isError(remaining)) fail("is corrupt");
+                    if(consumed_ == file_.size()){
+                        if(remaining == 0) finished_ = true;
+                        // every byte went in and there was room, yet the frame did not end
+                        else if(output.pos < output.size) fail("is truncated");
+                    }
+                }
+                text.resize(start + output.pos);
+                return output.pos > 0;
+            }
+
+            void rewind() override{
+                ZSTD_DCtx_reset(context_.get(), ZSTD_reset_session_only);
+                consumed_ = 0;
+                finished_ = false;
+            }
+
+        private:
+            [[noreturn]] void fail(const char *reason){
+                throw std::runtime_error{fmt::format("could not decompress {}, it {}", path_, reason)};
+            }
+
+            utilities::MappedFile file_;
+            std::string path_;
+            std::unique_ptr<ZSTD_DCtx, size_t (*)(ZSTD_DCtx *)> context_;
+            size_t consumed_{0};
+            bool finished_{false};
+        };
+
+        // one self contained gzip member or zstd frame, nullopt when the codec fails
+        inline std::optional<std::string> compressBlock(Codec codec, const std::string &block){
+            std::string out;
+            if(codec == Codec::Zstd){
+                out.resize(ZSTD_compressBound(block.size()));
+                size_t written{ZSTD_compress(out.data(), out.size(), block.data(), block.size(), constants::compression::ZstdLevel)};
+                if(ZSTD_isError(written)) return std::nullopt;
+                out.resize(written);
+                return out;
+            }
+
+            z_stream stream{};
+            if(deflateInit2(&stream, constants::compression::GzipLevel, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK){
+                return std::nullopt;
+            }
+            out.resize(deflateBound(&stream, static_cast<uLong>(block.size())));
+            stream.next_in      = reinterpret_cast<Bytef *>(const_cast<char *>(block.data()));
+            stream.avail_in     = static_cast<uInt>(block.size());
+            stream.next_out     = reinterpret_cast<Bytef *>(out.data());
+            stream.avail_out    = static_cast<uInt>(out.size());
+            // deflateBound leaves room for the whole member, so one call has to finish it
+            int status{deflate(&stream, Z_FINISH)};
+            out.resize(stream.total_out);
+            deflateEnd(&stream);
+            if(status != Z_STREAM_END) return std::nullopt;
+            return out;
+        }
+
+        // cuts the stream into BlockBytes blocks, compresses up to two blocks per
+        // worker in flight and appends the results in submission order. a block
+        // that fails to compress or write fails the buffer: it says so once, and
+        // every later write fails, which sets badbit on the stream
+        class BlockBuffer : public std::streambuf{
+        public:
+            BlockBuffer(const std::string &path, Codec codec)
+                : path_{path}
+                , file_{path, std::ios::binary}
+                , codec_{codec}
+                , block_(constants::compression::BlockBytes)
+                , maxPending_{2 * utilities::resolveThreadCount(constants::compression::ThreadCount)}
+            {
+                setp(block_.data(), block_.data() + block_.size());
+            }
+
+            bool isOpen() const{ return file_.is_open(); }
+            bool failed() const{ return failed_; }
+
+            // false when some block did not reach the file
+            bool finish(){
+                if(finished_) return !failed_;
+                finished_ = true;
+                submit();
+                while(!pending_.empty()) writeFront();
+                if(!file_.is_open()){
+                    fail("could not be opened");
+                    return false;
+                }
+                file_.close();
+                if(file_.fail()) fail("could not be closed");
+                // nothing should take a truncated file for a result
+                if(failed_){
+                    std::error_code error;
+                    std::filesystem::remove(path_, error);
+                }
+                return !failed_;
+            }
+
+        protected:
+            int_type overflow(int_type character) override{
+                submit();
+                if(failed_) return traits_type::eof();
+                if(!traits_type::eq_int_type(character, traits_type::eof())){
+                    *pptr() = traits_type::to_char_type(character);
+                    pbump(1);
+                }
+                return traits_type::not_eof(character);
+            }
+
+            // blocks are only cut when full, flushing the stream does not shrink them
+            int sync() override{ return failed_ ? -1 : 0; }
+
+        private:
+            void fail(const char *reason){
+                if(!failed_) fmt::println("[!!! {} {}, the incomplete file is removed !!!]", path_, reason);
+                failed_ = true;
+            }
+
+            void submit(){
+                size_t used{static_cast<size_t>(pptr() - pbase())};
+                if(used > 0 && !failed_){
+                    if(codec_ == Codec::None){
+                        if(!file_.write(pbase(), static_cast<std::streamsize>(used))) fail("could not be written");
+                    }else{
+                        pending_.push_back(std::async(std::launch::async, [codec{codec_}, block{std::string(pbase(), used)}](){
+                            return compressBlock(codec, block);
+                        }));
+                        if(pending_.size() >= maxPending_) writeFront();
+                    }
+                }
+                setp(block_.data(), block_.data() + block_.size());
+            }
+
+            void writeFront(){
+                std::optional<std::string> compressed{pending_.front().get()};
+                pending_.pop_front();
+                if(failed_) return;
+                if(!compressed) fail(codec_ == Codec::Zstd ? "could not be compressed with zstd" : "could not be compressed with gzip");
+                else if(!file_.write(compressed->data(), static_cast<std::streamsize>(compressed->size()))) fail("could not be written");
+            }
+
+            std::string path_;
+            std::ofstream file_;
+            Codec codec_;
+            std::vector<char> block_;
+            size_t maxPending_;
+            std::deque<std::future<std::optional<std::string>>> pending_;
+            bool failed_{false};
+            bool finished_{false};
+        };
+
+    } // namespace _
+
+    // whether compression::open found the input
+    class Input{
+    public:
+        explicit operator bool() const{ return open_; }
+
+    private:
+        template<typename Reader>
+        friend Input open(Reader &csv, const std::string &path);
+
+        bool open_{false};
+    };
+
+    // csv.mmap(path), or csv.stream() through a decompressor when the
+    // extension is .gz or .zst: the compressed file is mapped and inflated a
+    // window at a time as the rows are iterated, so a compressed input costs
+    // about two tokenizer blocks of memory rather than its decompressed size.
+    // iterating again decompresses again. a file that cannot even give its
+    // header does not open, corruption further on throws while iterating
+    template<typename Reader>
+    Input open(Reader &csv, const std::string &path){
+        Input input;
+        Codec codec{codecOf(path)};
+        if(codec == Codec::None){
+            input.open_ = csv.mmap(path);
+            return input;
+        }
+
+        auto file{utilities::MappedFile::open(path)};
+        if(!file) return input;
+
+        try{
+            std::unique_ptr<tokenizer::TextSource> source;
+            if(codec == Codec::Gzip) source = std::make_unique<_::GzipSource>(std::move(*file), path);
+            else source = std::make_unique<_::ZstdSource>(std::move(*file), path);
+            input.open_ = csv.stream(std::move(source));
+        }catch(const std::runtime_error &error){
+            fmt::println("[!!! {} !!!]", error.what());
+        }
+        return input;
+    }
+
+    // drop-in for std::ofstream on final outputs: paths ending in .gz or .zst are
+    // written as independently compressed blocks (gzip members / zstd frames),
+    // which standard tools read back as a single stream
+    class OutputFile : public std::ostream{
+    public:
+        explicit OutputFile(const std::string &path)
+            : std::ostream{nullptr}
+            , buffer_{path, codecOf(path)}
+        {
+            rdbuf(&buffer_);
+            if(!buffer_.isOpen()) setstate(std::ios::failbit);
+        }
+
+        ~OutputFile(){
+            buffer_.finish();
+        }
+
+        // writes what is left, false (and badbit) when any of the file is missing
+        bool close(){
+            if(!buffer_.finish()) setstate(std::ios::badbit);
+            return good();
+        }
+
+    private:
+        _::BlockBuffer buffer_;
+    };
+
+} // namespace compression
@@ -1,5 +1,8 @@
 #pragma once
 
+#include <array>
+#include <cstdint>
+#include <string>
 #include <vector>
 
 namespace constants{
@@ -19,6 +22,15 @@ namespace constants{
         constexpr const char *WeatherStationId  {"weather_station_id"};
         constexpr const char *LocationId        {"location_id"};
         constexpr const char *Time              {"time"};
+        constexpr const char *Volume            {"volume"};
+        constexpr const char *Street            {"street"};
+        constexpr const char *RoadGroup         {"road_group"};
+        constexpr const char *Borough           {"Boro"};
+        constexpr const char *Direction         {"direction"};
+        constexpr const char *BlendStationIds   {"blend_station_ids"};
+        constexpr const char *BlendWeights      {"blend_weights"};
+        constexpr const char *Split             {"split"};
+        constexpr const char *Fold              {"fold"};
 
     } // namespace column_names
 
@@ -27,14 +39,54 @@ namespace constants{
         constexpr size_t RowProgressInterval            {100000};
         constexpr size_t FileProgressInterval           {10};
         constexpr size_t SegmentProgressInterval        {100};
+        constexpr size_t ThreadCount                    {0};    // 0 uses every hardware thread
+        constexpr size_t NearlySortedMaxRuns            {16};   // up to this many sorted runs are merged instead of radix sorted
 
         constexpr int    MaxWeatherTimeDifferenceMinutes{120};
         constexpr size_t MaxSkippedRowWarnings          {5};
 
     } // namespace system
 
+    namespace lag_features{
+
+        // trailing volume windows, one mean/min/max triple per entry
+        constexpr std::array<int, 3> WindowHours    {1, 3, 24};
+        constexpr int SameSlotLagDays               {7};
+        constexpr int SlotMinutes                   {15};
+
+    } // namespace lag_features
+
+    namespace aggregation{
+
+        // regular grid the sorted segments are resampled onto: 15, 60 or 1440 minutes
+        constexpr int BucketMinutes {60};
+        // write empty buckets between a segment's first and last observation
+        constexpr bool FillGaps     {false};
+
+        // per row identifiers that mean nothing once rows are summed
+        inline const std::vector<std::string> &droppedColumns(){
+            static const std::vector<std::string> columns{
+                "RequestID",
+                column_names::Direction
+            };
+            return columns;
+        }
+
+    } // namespace aggregation
+
     namespace weather{
 
+        // keep a typed binary copy of the weather csv and map it on later runs
+        constexpr bool PersistIndex{true};
+
+        // weather of a segment as the inverse distance weighted mean of its
+        // BlendStationCount nearest stations, 1 takes the nearest station only
+        constexpr size_t BlendStationCount  {1};
+        constexpr double BlendPower         {2.0};
+
+        // join one station's segments back to back instead of in segment id order
+        constexpr bool StationLocalSchedule {true};
+
         struct WeatherStation{
             int id;
             double latitude;
@@ -63,25 +115,267 @@ namespace constants{
 
     } // namespace weather
 
+    namespace road_groups{
+
+        struct RoadGroup{
+            const char *name;
+            std::vector<const char *> patterns;
+        };
+
+        // matched case-insensitively against the street name, first group wins
+        inline const std::vector<RoadGroup> &roadGroups(){
+            static const std::vector<RoadGroup> groups{
+                {"Belt Parkway",            {"BELT", "SHORE"}},
+                {"BQE",                     {"BQE", "BROOKLYN QUEENS"}},
+                {"Cross Bronx Expressway",  {"CROSS BRONX"}},
+                {"Major Deegan",            {"DEEGAN"}}
+            };
+            return groups;
+        }
+
+        constexpr const char *UnmatchedName {"Other"};
+        constexpr bool DropUnmatched        {true};
+
+    } // namespace road_groups
+
+    namespace selection{
+
+        // applied while parsing, an empty list keeps everything. columns the
+        // pipeline itself needs (ids, coordinates, time, volume) are always kept
+        inline const std::vector<std::string> &trafficColumns(){
+            static const std::vector<std::string> columns{};
+            return columns;
+        }
+
+        inline const std::vector<std::string> &weatherColumns(){
+            static const std::vector<std::string> columns{};
+            return columns;
+        }
+
+        inline const std::vector<std::string> &segmentIds(){
+            static const std::vector<std::string> segments{};
+            return segments;
+        }
+
+        inline const std::vector<std::string> &boroughs(){
+            static const std::vector<std::string> boroughs{};
+            return boroughs;
+        }
+
+        // inclusive YYYYMMDD bounds, 0 leaves that end open
+        constexpr int FirstDate {0};
+        constexpr int LastDate  {0};
+
+    } // namespace selection
+
+    namespace splits{
+
+        // what is kept on one side of the split: single rows, whole segments, or
+        // every row of a time block (TimeBlockMinutes, aligned to the epoch).
+        // time blocks are labelled across road groups, so StratifyByRoadGroup
+        // only reports their proportions
+        enum class Grouping{ Row, Segment, TimeBlock };
+        // split and fold columns on every row, or a test file and a file per training fold
+        enum class Output{ Columns, Files };
+
+        constexpr double   TestFraction         {0.2};
+        constexpr size_t   Folds                {5};
+        constexpr uint64_t Seed                 {123};
+        constexpr bool     StratifyByRoadGroup  {true};
+        constexpr Grouping GroupBy              {Grouping::Segment};
+        constexpr int      TimeBlockMinutes     {7 * 1440};
+        constexpr Output   OutputMode           {Output::Columns};
+
+    } // namespace splits
+
+    namespace matrix_export{
+
+        enum class Format{ Dense, LibSvm };
+
+        struct CategoricalColumn{
+            const char *name;
+            std::vector<const char *> levels;
+        };
+
+        constexpr Format OutputFormat       {Format::Dense};
+        constexpr const char *LabelColumn   {column_names::Volume};
+        // partition of a test row in <base>.partitions.bin, training rows have their fold
+        constexpr int32_t TestPartition     {-1};
+
+        // one-hot encoded, one matrix column per level
+        inline const std::vector<CategoricalColumn> &categoricalColumns(){
+            static const std::vector<CategoricalColumn> columns{
+                {column_names::RoadGroup,   {"Belt Parkway", "BQE", "Cross Bronx Expressway", "Major Deegan", "Other"}},
+                {column_names::Direction,   {"NB", "SB", "EB", "WB"}},
+                {column_names::Borough,     {"Manhattan", "Bronx", "Brooklyn", "Queens", "Staten Island"}}
+            };
+            return columns;
+        }
+
+        // identifiers and free text, everything else is parsed as a number
+        inline const std::vector<std::string> &excludedColumns(){
+            static const std::vector<std::string> columns{
+                "RequestID", "WktGeom", "fromSt", "toSt",
+                column_names::SegmentId,
+                column_names::Street,
+                column_names::Time,
+                column_names::LocationId,
+                column_names::WeatherStationId,
+                column_names::Split,
+                column_names::Fold
+            };
+            return columns;
+        }
+
+    } // namespace matrix_export
+
+    namespace compression{
+
+        // inputs and final outputs ending in .gz or .zst are (de)compressed on the fly
+        constexpr size_t BlockBytes     {4 << 20};  // uncompressed bytes per independently compressed block
+        constexpr int    GzipLevel      {6};
+        constexpr int    ZstdLevel      {3};
+        constexpr size_t ThreadCount    {0};        // 0 uses every hardware thread
+
+    } // namespace compression
+
+    namespace inference{
+
+        constexpr size_t BatchRows      {4096};
+        constexpr size_t ThreadCount    {0};    // 0 uses every hardware thread
+        // xgb.dump() output carries no base score, saved JSON models do
+        constexpr float DumpBaseScore   {0.5f};
+
+    } // namespace inference
+
+    namespace training{
+
+        // grid ranges mirror the tune_grid() parameters of pipeline.R
+        constexpr int    Trees              {150};
+        constexpr size_t GridSize           {20};
+        constexpr size_t Folds              {5};
+        constexpr size_t ResidualFolds      {3};
+        constexpr int    MinDepth           {3};
+        constexpr int    MaxDepth           {6};
+        constexpr double MinChildWeight     {5.0};
+        constexpr double MaxChildWeight     {15.0};
+        constexpr double MinLearningRate    {0.01};
+        constexpr double MaxLearningRate    {0.1};
+        constexpr double MinLossReduction   {0.001};
+        constexpr double MaxLossReduction   {1.0};
+        constexpr double MinColumnFraction  {0.5};
+        constexpr double MaxColumnFraction  {1.0};
+        constexpr double Lambda             {1.0};
+
+        constexpr size_t MaxBins            {255};
+        constexpr size_t QuantileSampleRows {200000};
+        constexpr uint64_t Seed             {123};
+        constexpr size_t ThreadCount        {0};    // 0 uses every hardware thread
+
+    } // namespace training
+
+    namespace tokenizer{
+
+        constexpr size_t BlockBytes             {1 << 20};  // rows indexed per structural pass
+        constexpr bool   ForceScalar            {false};    // ignore avx2/sse4.2 even when the cpu has them
+        constexpr size_t BenchmarkRepetitions   {5};
+
+    } // namespace tokenizer
+
+    namespace merge{
+
+        // only used with flags::TimeOrderedMerge
+        constexpr size_t TimePartitions     {0};            // 0 makes one per worker
+        constexpr size_t ReadAheadBytes     {64 << 10};     // rows each segment input indexes (and prefetches) at a time
+        constexpr size_t WriteBufferBytes   {4 << 20};      // merged bytes a partition collects per write
+        constexpr size_t SamplesPerSegment  {64};           // row times sampled to place the partition bounds
+
+    } // namespace merge
+
+    namespace zone_maps{
+
+        // blocks of the joined container carry min/max statistics per this many rows, 0 writes
+        // none and queries then scan every block
+        constexpr size_t RowsPerZone        {4096};
+        // query predicate on the epoch minute of the traffic time columns, e.g. "timestamp>=2019-01-01"
+        constexpr const char *TimestampColumn{"timestamp"};
+        constexpr size_t QueryWindowUnits   {64};   // zones scanned in parallel before their rows are written in order
+
+    } // namespace zone_maps
+
+    namespace serving{
+
+        constexpr size_t ReadBufferBytes    {1 << 16};
+        constexpr size_t ClientBatchSize    {64};   // requests the client pipelines per round trip
+        constexpr size_t MaxRequestBytes    {1 << 16};  // a longer line drops the connection
+        // responses a client has not read yet. past this its requests are not
+        // answered or read until it catches up
+        constexpr size_t MaxPendingBytes    {4 << 20};
+
+    } // namespace serving
+
+    namespace regression{
+
+        // dataset `joiner perf` generates, fixed so its outputs have golden checksums
+        constexpr uint32_t Segments             {240};
+        constexpr int      Days                 {14};
+        constexpr int      ObservationMinutes   {15};
+        constexpr int      StartYear            {2019};
+        constexpr uint64_t Seed                 {123};
+
+        constexpr size_t Repetitions            {5};    // stage times are the best of this many runs
+        // every worker pool of a measured run, so its times and peak memory do
+        // not depend on how many cores the machine has
+        constexpr size_t ThreadCount            {1};
+        // slowdown and peak memory growth over the baseline that fail the run
+        constexpr double TimeTolerance          {0.25};
+        constexpr double MemoryTolerance        {0.20};
+        // shorter stages are held to this time instead: their run to run noise
+        // exceeds the tolerance, and the total still covers them
+        constexpr double MinimumSeconds         {1.0};
+
+    } // namespace regression
+
     namespace paths{
 
         constexpr const char *TrafficInput              {"./csv/traffic_data_with_coords.csv"};
         constexpr const char *WeatherInput              {"./csv/open-meteo-no-cords.csv"};
-        constexpr const char *TrafficByLocation         {"./output/traffic_by_location"};
-        constexpr const char *TrafficByLocationSorted   {"./output/traffic_by_location_sorted"};
-        constexpr const char *MergedTrafficWeather      {"./output/merged_traffic_weather"};
+        constexpr const char *WeatherIndex              {"./output/weather.idx"};
+        constexpr const char *TrafficByLocation         {"./output/traffic_by_location.seg"};
+        constexpr const char *SegmentIndex              {"./output/segments.csv"};
+        constexpr const char *TrafficByLocationSorted   {"./output/traffic_by_location_sorted.seg"};
+        constexpr const char *TrafficAggregated         {"./output/traffic_by_location_aggregated.seg"};
+        constexpr const char *MergedTrafficWeather      {"./output/merged_traffic_weather.seg"};
         constexpr const char *FinalOutput               {"./output/final_merged_dataset.csv"};
         constexpr const char *FinalOutputWithFeatures   {"./output/final_merged_dataset_with_features.csv"};
+        constexpr const char *FinalOutputWithSplits     {"./output/final_merged_dataset_with_splits.csv"};
+        constexpr const char *FeatureMatrix             {"./output/feature_matrix"};
+        constexpr const char *PrimaryModel              {"./models/primary.json"};
+        constexpr const char *ResidualModels            {"./models/residual"};
+        constexpr const char *Predictions               {"./output/predictions.csv"};
+        constexpr const char *TuningResults             {"./output/tuning_results.csv"};
+        constexpr const char *PredictionSocket          {"./output/joiner.sock"};
+        constexpr const char *PerfBaseline              {"./perf/baseline.txt"};
+        constexpr const char *PerfWorkDirectory         {"./perf/work"};
 
     } // namespace paths
 
     namespace flags{
 
         constexpr bool SplitData            {true};
+        constexpr bool ClassifyRoadGroups   {true};
         constexpr bool SortByTime           {true};
+        constexpr bool LagFeatures          {true};
+        constexpr bool AggregateByTime      {false};
         constexpr bool MergeWeather         {true};
         constexpr bool FeatureEngineering   {true};
+        constexpr bool AssignSplits         {true};
         constexpr bool MergeAll             {true};
+        constexpr bool ValidateMerge        {false};    // re-parse segments while merging instead of copying bytes
+        constexpr bool TimeOrderedMerge     {false};    // order the merged file by time instead of by segment
+        constexpr bool ExportMatrix         {true};
+        constexpr bool TrainModels          {false};
+        constexpr bool ScoreModels          {false};
 
     } // namespace flags
 
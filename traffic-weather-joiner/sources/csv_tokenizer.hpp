@@ -0,0 +1,462 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "constants.hpp"
+#include "utilities.hpp"
+
+namespace tokenizer{
+
+    enum class Isa{ Scalar, Sse42, Avx2 };
+
+    inline const char *isaName(Isa isa){
+        switch(isa){
+            case Isa::Avx2:     return "avx2";
+            case Isa::Sse42:    return "sse4.2";
+            default:            return "scalar";
+        }
+    }
+
+    inline bool isSupported(Isa isa){
+#if defined(__x86_64__) || defined(__i386__)
+        if(isa == Isa::Avx2) return __builtin_cpu_supports("avx2");
+        if(isa == Isa::Sse42) return __builtin_cpu_supports("sse4.2");
+#else
+        if(isa != Isa::Scalar) return false;
+#endif
+        return true;
+    }
+
+    // widest instruction set this cpu runs, picked once
+    inline Isa activeIsa(){
+        static const Isa isa{[](){
+            if(constants::tokenizer::ForceScalar) return Isa::Scalar;
+            if(isSupported(Isa::Avx2)) return Isa::Avx2;
+            if(isSupported(Isa::Sse42)) return Isa::Sse42;
+            return Isa::Scalar;
+        }()};
+        return isa;
+    }
+
+    namespace _{
+
+        constexpr size_t ChunkBytes{64};
+
+        // bit i is set when byte i of the 64 byte chunk is that character
+        struct ChunkMasks{
+            uint64_t quotes;
+            uint64_t delimiters;
+            uint64_t newlines;
+        };
+
+        using ScanFunction = ChunkMasks (*)(const char *);
+
+        inline ChunkMasks scanScalar(const char *chunk){
+            ChunkMasks masks{0, 0, 0};
+            for(size_t i{0}; i < ChunkBytes; i++){
+                uint64_t bit{uint64_t{1} << i};
+                if(chunk[i] == '"')         masks.quotes |= bit;
+                else if(chunk[i] == ',')    masks.delimiters |= bit;
+                else if(chunk[i] == '\n')   masks.newlines |= bit;
+            }
+            return masks;
+        }
+
+#if defined(__x86_64__) || defined(__i386__)
+        __attribute__((target("sse4.2")))
+        inline ChunkMasks scanSse42(const char *chunk){
+            const __m128i quote{_mm_set1_epi8('"')};
+            const __m128i delimiter{_mm_set1_epi8(',')};
+            const __m128i newline{_mm_set1_epi8('\n')};
+
+            ChunkMasks masks{0, 0, 0};
+            for(size_t i{0}; i < ChunkBytes; i += 16){
+                __m128i bytes{_mm_loadu_si128(reinterpret_cast<const __m128i *>(chunk + i))};
+                masks.quotes      |= static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, quote)))) << i;
+                masks.delimiters  |= static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, delimiter)))) << i;
+                masks.newlines    |= static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, newline)))) << i;
+            }
+            return masks;
+        }
+
+        __attribute__((target("avx2")))
+        inline uint64_t equalMaskAvx2(__m256i low, __m256i high, char character){
+            const __m256i wanted{_mm256_set1_epi8(character)};
+            return static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(low, wanted))))
+                | static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(high, wanted)))) << 32;
+        }
+
+        __attribute__((target("avx2")))
+        inline ChunkMasks scanAvx2(const char *chunk){
+            __m256i low{_mm256_loadu_si256(reinterpret_cast<const __m256i *>(chunk))};
+            __m256i high{_mm256_loadu_si256(reinterpret_cast<const __m256i *>(chunk + 32))};
+            return {
+                equalMaskAvx2(low, high, '"'),
+                equalMaskAvx2(low, high, ','),
+                equalMaskAvx2(low, high, '\n')
+            };
+        }
+#endif
+
+        inline ScanFunction scanFor(Isa isa){
+#if defined(__x86_64__) || defined(__i386__)
+            if(isa == Isa::Avx2) return scanAvx2;
+            if(isa == Isa::Sse42) return scanSse42;
+#endif
+            return scanScalar;
+        }
+
+        // bit i set when an odd number of quotes is at or before i, i.e. byte i is
+        // inside a quoted span (the opening quote included, the closing one not)
+        inline uint64_t prefixXor(uint64_t bits){
+            bits ^= bits << 1;
+            bits ^= bits << 2;
+            bits ^= bits << 4;
+            bits ^= bits << 8;
+            bits ^= bits << 16;
+            bits ^= bits << 32;
+            return bits;
+        }
+
+        // structural index of one block of rows: ends[f] is the offset of the ',' or
+        // '\n' closing field f, rows[r]..rows[r + 1] are the fields of row r. ends[0]
+        // is a sentinel so a field always starts one past the previous end
+        struct BlockIndex{
+            static constexpr uint32_t Sentinel{0xffffffffu};
+
+            const char *base{nullptr};
+            std::vector<uint32_t> ends;
+            std::vector<uint32_t> rows;
+
+            size_t rowCount() const{ return rows.size() - 1; }
+        };
+
+        // indexes rows from data until the row crossing blockBytes is complete (or
+        // data ends) and returns the bytes consumed. blocks always end on a row
+        // boundary, so no quote state carries over to the next one
+        inline size_t indexBlock(const char *data, size_t size, size_t blockBytes, ScanFunction scan, BlockIndex &index){
+            index.base = data;
+            index.ends.assign(1, BlockIndex::Sentinel);
+            index.rows.assign(1, 1);
+
+            uint64_t insideQuotes{0};
+            for(size_t position{0}; position < size; position += ChunkBytes){
+                ChunkMasks masks;
+                if(size - position >= ChunkBytes){
+                    masks = scan(data + position);
+                }else{
+                    char tail[ChunkBytes]{};
+                    std::memcpy(tail, data + position, size - position);
+                    masks = scan(tail);
+                }
+
+                uint64_t quoted{prefixXor(masks.quotes) ^ insideQuotes};
+                insideQuotes = static_cast<uint64_t>(static_cast<int64_t>(quoted) >> 63);
+
+                uint64_t structural{(masks.delimiters | masks.newlines) & ~quoted};
+                while(structural != 0){
+                    unsigned bit{static_cast<unsigned>(__builtin_ctzll(structural))};
+                    structural &= structural - 1;
+
+                    size_t offset{position + bit};
+                    index.ends.push_back(static_cast<uint32_t>(offset));
+                    if(masks.newlines >> bit & 1){
+                        index.rows.push_back(static_cast<uint32_t>(index.ends.size()));
+                        if(offset + 1 >= blockBytes) return offset + 1;
+                    }
+                }
+            }
+
+            // last row without a trailing newline
+            size_t lastEnd{index.ends.back() == BlockIndex::Sentinel ? 0 : size_t{index.ends.back()} + 1};
+            if(lastEnd < size || index.rows.back() != index.ends.size()){
+                index.ends.push_back(static_cast<uint32_t>(size));
+                index.rows.push_back(static_cast<uint32_t>(index.ends.size()));
+            }
+            return size;
+        }
+
+    } // namespace _
+
+    // one field, spaces and tabs around it (and a '\r' before the newline) trimmed
+    class Cell{
+    public:
+        Cell(const char *begin, const char *end)
+            : begin_{begin}
+            , end_{end}
+        {
+            while(end_ > begin_ && (end_[-1] == ' ' || end_[-1] == '\t' || end_[-1] == '\r')) end_--;
+            while(begin_ < end_ && (*begin_ == ' ' || *begin_ == '\t')) begin_++;
+        }
+
+        std::string_view view() const{ return {begin_, static_cast<size_t>(end_ - begin_)}; }
+
+        // same text csv2 gives: the field as written, enclosing and doubled
+        // quotes kept, so a stage that writes it back out keeps the csv valid.
+        // any std::basic_string, so arena backed std::pmr::string works too
+        template<typename String>
+        void read_value(String &value) const{ value.assign(view()); }
+
+        void read_raw_value(std::string &value) const{ value.assign(view()); }
+
+    private:
+        const char *begin_;
+        const char *end_;
+    };
+
+    // the fields of one row as views into the parsed text
+    class Row{
+    public:
+        class Iterator{
+        public:
+            Iterator(const Row *row, size_t field) : row_{row}, field_{field}{}
+            Cell operator*() const{ return (*row_)[field_]; }
+            Iterator &operator++(){ field_++; return *this; }
+            bool operator!=(const Iterator &other) const{ return field_ != other.field_; }
+
+        private:
+            const Row *row_;
+            size_t field_;
+        };
+
+        Row() = default;
+        Row(const char *base, const uint32_t *ends, size_t fieldCount)
+            : base_{base}
+            , ends_{ends}
+            , fieldCount_{fieldCount}
+        {}
+
+        size_t size() const{ return fieldCount_; }
+        size_t length() const{ return fieldCount_; }
+
+        Cell operator[](size_t field) const{
+            // ends_[-1] is the previous row's newline or the block sentinel, both wrap to one before the start
+            uint32_t start{ends_[static_cast<ptrdiff_t>(field) - 1] + 1};
+            return {base_ + start, base_ + ends_[field]};
+        }
+
+        Iterator begin() const{ return {this, 0}; }
+        Iterator end() const{ return {this, fieldCount_}; }
+
+        bool isBlank() const{ return fieldCount_ == 1 && (*this)[0].view().empty(); }
+
+        // the whole line as it is in the text, without its newline
+        std::string_view text() const{
+            uint32_t start{ends_[-1] + 1};
+            std::string_view line{base_ + start, ends_[fieldCount_ - 1] - start};
+            if(!line.empty() && line.back() == '\r') line.remove_suffix(1);
+            return line;
+        }
+
+    private:
+        const char *base_{nullptr};
+        const uint32_t *ends_{nullptr};
+        size_t fieldCount_{0};
+    };
+
+    // text produced a piece at a time, a decompressor for instance. read()
+    // appends the next piece and is false once nothing is left, rewind()
+    // starts over from the beginning. failures throw
+    class TextSource{
+    public:
+        virtual ~TextSource() = default;
+        virtual bool read(std::string &text) = 0;
+        virtual void rewind() = 0;
+    };
+
+    // drop-in for the csv2 reader the stages use (',' delimiter, '"' quotes, header
+    // row, whitespace trimmed). rows are found 64 bytes at a time: the chunk's
+    // quote, comma and newline bytes become bitmasks, a prefix xor of the quote
+    // mask blanks out quoted bytes and the remaining bits are the field ends.
+    // the index covers one block of rows at a time, so memory stays bounded and
+    // a row is only valid until the iterator moves on. text passed to parse()
+    // must outlive iteration, a streamed source is read through a window of
+    // about two blocks instead of being held whole. blank lines are skipped
+    class Reader{
+    public:
+        class Iterator{
+        public:
+            Iterator() = default;
+            explicit Iterator(const Reader *reader) : reader_{reader}{ skipBlank(); }
+
+            Row operator*() const{ return reader_->row(row_); }
+            Iterator &operator++(){
+                row_++;
+                skipBlank();
+                return *this;
+            }
+            bool operator!=(const Iterator &other) const{ return reader_ != other.reader_; }
+
+        private:
+            void skipBlank(){
+                while(reader_ != nullptr){
+                    if(row_ >= reader_->index_.rowCount()){
+                        if(!reader_->nextBlock()){
+                            reader_ = nullptr;
+                            return;
+                        }
+                        row_ = 0;
+                    }
+                    if(!reader_->row(row_).isBlank()) return;
+                    row_++;
+                }
+            }
+
+            const Reader *reader_{nullptr};
+            size_t row_{0};
+        };
+
+        // blockBytes is how much text one structural pass indexes ahead
+        explicit Reader(Isa isa = activeIsa(), size_t blockBytes = constants::tokenizer::BlockBytes)
+            : scan_{_::scanFor(isSupported(isa) ? isa : Isa::Scalar)}
+            , blockBytes_{std::max<size_t>(blockBytes, 1)}
+        {}
+
+        // header_ points into headerIndex_
+        Reader(const Reader &) = delete;
+        Reader &operator=(const Reader &) = delete;
+
+        bool mmap(const std::string &path){
+            auto file{utilities::MappedFile::open(path)};
+            if(!file) return false;
+            file_ = std::move(*file);
+            return parse(std::string_view{file_.data(), file_.size()});
+        }
+
+        bool parse(std::string_view text){
+            source_.reset();
+            text_ = text;
+            bodyOffset_ = 0;
+            header_ = {};
+            while(bodyOffset_ < text_.size()){
+                bodyOffset_ += _::indexBlock(text_.data() + bodyOffset_, text_.size() - bodyOffset_, 1, scan_, headerIndex_);
+                Row row{rowOf(headerIndex_, 0)};
+                if(!row.isBlank()){
+                    header_ = row;
+                    break;
+                }
+            }
+            return true;
+        }
+
+        // rows only, for a slice that starts past the header. header() stays empty
+        bool parseBody(std::string_view text){
+            source_.reset();
+            text_ = text;
+            bodyOffset_ = 0;
+            header_ = {};
+            return true;
+        }
+
+        // reads the header, iterating reads the rest. the header is copied out
+        // of the window so it stays valid while the window moves
+        bool stream(std::unique_ptr<TextSource> source){
+            source_ = std::move(source);
+            text_ = {};
+            bodyOffset_ = 0;
+            header_ = {};
+            window_.clear();
+            sourceDone_ = false;
+            while(true){
+                size_t remaining{window_.size() - bodyOffset_};
+                size_t consumed{remaining == 0 ? 0 : _::indexBlock(window_.data() + bodyOffset_, remaining, 1, scan_, headerIndex_)};
+                // a row reaching the end of the window may go on in the next piece
+                if(consumed == remaining && !sourceDone_){
+                    if(!source_->read(window_)) sourceDone_ = true;
+                    continue;
+                }
+                if(consumed == 0) break;
+                if(!rowOf(headerIndex_, 0).isBlank()){
+                    headerText_.assign(window_, bodyOffset_, consumed);
+                    _::indexBlock(headerText_.data(), headerText_.size(), 1, scan_, headerIndex_);
+                    header_ = rowOf(headerIndex_, 0);
+                    bodyOffset_ += consumed;
+                    break;
+                }
+                bodyOffset_ += consumed;
+            }
+            return true;
+        }
+
+        Row header() const{ return header_; }
+
+        // iteration restarts from the first row after the header
+        Iterator begin() const{
+            offset_ = bodyOffset_;
+            if(source_){
+                source_->rewind();
+                window_.clear();
+                sourceDone_ = false;
+                while(window_.size() < bodyOffset_ && source_->read(window_)){}
+            }
+            index_.rows.assign(1, 1);
+            return Iterator{this};
+        }
+        Iterator end() const{ return {}; }
+
+    private:
+        static Row rowOf(const _::BlockIndex &index, size_t row){
+            uint32_t first{index.rows[row]};
+            return {index.base, index.ends.data() + first, index.rows[row + 1] - first};
+        }
+
+        Row row(size_t row) const{ return rowOf(index_, row); }
+
+        bool nextBlock() const{
+            if(source_) return nextStreamedBlock();
+            if(offset_ >= text_.size()) return false;
+            offset_ += _::indexBlock(
+                text_.data() + offset_, text_.size() - offset_, blockBytes_, scan_, index_
+            );
+            return true;
+        }
+
+        // drops the rows iterated so far and indexes the next block, reading
+        // until the window holds two blocks or the row crossing a block is whole
+        bool nextStreamedBlock() const{
+            window_.erase(0, std::min(offset_, window_.size()));
+            offset_ = 0;
+            while(window_.size() < 2 * blockBytes_ && !sourceDone_){
+                if(!source_->read(window_)) sourceDone_ = true;
+            }
+            while(true){
+                if(window_.empty()) return false;
+                size_t consumed{_::indexBlock(window_.data(), window_.size(), blockBytes_, scan_, index_)};
+                if(consumed < window_.size() || sourceDone_){
+                    offset_ = consumed;
+                    return true;
+                }
+                if(!source_->read(window_)) sourceDone_ = true;
+            }
+        }
+
+        _::ScanFunction scan_;
+        size_t blockBytes_;
+        utilities::MappedFile file_;
+        std::string_view text_;
+        size_t bodyOffset_{0};
+        _::BlockIndex headerIndex_;
+        Row header_;
+
+        std::unique_ptr<TextSource> source_;
+        std::string headerText_;
+
+        // iteration state, a reader is iterated by one thread at a time
+        mutable _::BlockIndex index_;
+        mutable size_t offset_{0};
+        mutable std::string window_;            // streamed text from offset 0, rows before offset_ are done
+        mutable bool sourceDone_{false};
+    };
+
+} // namespace tokenizer
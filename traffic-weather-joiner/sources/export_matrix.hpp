@@ -0,0 +1,210 @@
+#pragma once
+
+#include "constants.hpp"
+#include "csv_tokenizer.hpp"
+#include "compressed_io.hpp"
+
+#include <string>
+#include <vector>
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <fmt/core.h>
+
+namespace _{
+
+    enum class MatrixColumnKind{ Numeric, Categorical, Label, Skipped };
+
+    struct MatrixColumn{
+        MatrixColumnKind kind;
+        size_t offset;  // first matrix column this input column writes to
+        const constants::matrix_export::CategoricalColumn *categorical;
+    };
+
+    inline float parseFloat(const std::string &value){
+        char *end{nullptr};
+        float parsed{std::strtof(value.c_str(), &end)};
+        if(end == value.c_str()) return std::numeric_limits<float>::quiet_NaN();
+        return parsed;
+    }
+
+} // namespace _
+
+// writes <base>.bin (float32 row-major), <base>.labels.bin (float32) and
+// <base>.columns.txt, or <base>.libsvm when the LibSVM format is configured.
+// when the input carries assignSplits' columns, <base>.partitions.bin holds an
+// int32 per written row: its training fold, or TestPartition for test rows
+inline void exportFeatureMatrix(
+    const std::string &inputCsvPath,
+    const std::string &outputBasePath
+){
+    fmt::println("loading {}...", inputCsvPath);
+
+    tokenizer::Reader csv;
+
+    auto input{compression::open(csv, inputCsvPath)};
+
+    std::vector<std::string> header;
+    for(const auto &cell : csv.header()){
+        std::string value;
+        cell.read_value(value);
+        header.push_back(value);
+    }
+
+    const auto &categoricalColumns{constants::matrix_export::categoricalColumns()};
+    const auto &excludedColumns{constants::matrix_export::excludedColumns()};
+
+    // lay out matrix columns: numeric inputs map 1:1, categoricals expand to one column per level
+    std::vector<_::MatrixColumn> layout(header.size(), {_::MatrixColumnKind::Skipped, 0, nullptr});
+    std::vector<std::string> matrixColumnNames;
+    bool hasLabel{false};
+
+    size_t splitIndex{static_cast<size_t>(std::find(header.begin(), header.end(), constants::column_names::Split) - header.begin())};
+    size_t foldIndex{static_cast<size_t>(std::find(header.begin(), header.end(), constants::column_names::Fold) - header.begin())};
+    bool hasPartitions{splitIndex < header.size() && foldIndex < header.size()};
+
+    for(size_t i{0}; i < header.size(); i++){
+        if(header[i] == constants::matrix_export::LabelColumn){
+            layout[i].kind = _::MatrixColumnKind::Label;
+            hasLabel = true;
+            continue;
+        }
+        if(std::find(excludedColumns.begin(), excludedColumns.end(), header[i]) != excludedColumns.end()){
+            continue;
+        }
+
+        auto categorical{std::find_if(categoricalColumns.begin(), categoricalColumns.end(), [&](const auto &column){
+            return header[i] == column.name;
+        })};
+
+        layout[i].offset = matrixColumnNames.size();
+        if(categorical != categoricalColumns.end()){
+            layout[i].kind = _::MatrixColumnKind::Categorical;
+            layout[i].categorical = &*categorical;
+            for(const char *level : categorical->levels){
+                matrixColumnNames.push_back(fmt::format("{}_{}", header[i], level));
+            }
+        }else{
+            layout[i].kind = _::MatrixColumnKind::Numeric;
+            matrixColumnNames.push_back(header[i]);
+        }
+    }
+
+    if(!hasLabel){
+        fmt::println("[!!! label column {} not found, skipping export !!!]", constants::matrix_export::LabelColumn);
+        return;
+    }
+
+    bool libSvm{constants::matrix_export::OutputFormat == constants::matrix_export::Format::LibSvm};
+
+    std::filesystem::path basePath{outputBasePath};
+    if(basePath.has_parent_path()){
+        std::filesystem::create_directories(basePath.parent_path());
+    }
+
+    std::ofstream columnsOut{outputBasePath + ".columns.txt"};
+    for(const auto &name : matrixColumnNames){
+        columnsOut << name << '\n';
+    }
+
+    std::ofstream matrixOut;
+    std::ofstream labelsOut;
+    std::ofstream libSvmOut;
+    std::ofstream partitionsOut;
+    if(hasPartitions){
+        partitionsOut.open(outputBasePath + ".partitions.bin", std::ios::binary);
+    }else{
+        // a partitions file of an earlier export would no longer line up with the rows
+        std::error_code error;
+        std::filesystem::remove(outputBasePath + ".partitions.bin", error);
+    }
+    if(libSvm){
+        libSvmOut.open(outputBasePath + ".libsvm");
+        libSvmOut.precision(std::numeric_limits<float>::max_digits10);
+    }else{
+        matrixOut.open(outputBasePath + ".bin", std::ios::binary);
+        labelsOut.open(outputBasePath + ".labels.bin", std::ios::binary);
+    }
+
+    std::vector<float> values(matrixColumnNames.size());
+    size_t rowCount{0};
+    size_t writtenCount{0};
+
+    for(const auto &row : csv){
+        rowCount++;
+        if(rowCount % constants::system::RowProgressInterval == 0){
+            fmt::println("processed {} rows", rowCount);
+        }
+
+        std::fill(values.begin(), values.end(), std::numeric_limits<float>::quiet_NaN());
+        float label{std::numeric_limits<float>::quiet_NaN()};
+
+        size_t column{0};
+        for(const auto &cell : row){
+            if(column >= layout.size()) break;
+            const _::MatrixColumn &target{layout[column++]};
+            if(target.kind == _::MatrixColumnKind::Skipped) continue;
+
+            std::string value;
+            cell.read_value(value);
+
+            switch(target.kind){
+                case _::MatrixColumnKind::Label:
+                    label = _::parseFloat(value);
+                    break;
+                case _::MatrixColumnKind::Numeric:
+                    values[target.offset] = _::parseFloat(value);
+                    break;
+                case _::MatrixColumnKind::Categorical: {
+                    // unknown levels encode as all zeros, like step_novel + step_dummy
+                    const auto &levels{target.categorical->levels};
+                    for(size_t level{0}; level < levels.size(); level++){
+                        if(value == levels[level])  values[target.offset + level] = 1.0f;
+                        else if(!libSvm)            values[target.offset + level] = 0.0f;
+                    }
+                    break;
+                }
+                case _::MatrixColumnKind::Skipped:
+                    break;
+            }
+        }
+
+        if(std::isnan(label)) continue;
+        writtenCount++;
+
+        if(hasPartitions){
+            int32_t partition{constants::matrix_export::TestPartition};
+            if(splitIndex < row.size() && row[splitIndex].view() != "test"){
+                std::string_view fold{foldIndex < row.size() ? row[foldIndex].view() : std::string_view{}};
+                partition = 0;
+                std::from_chars(fold.data(), fold.data() + fold.size(), partition);
+            }
+            partitionsOut.write(reinterpret_cast<const char *>(&partition), sizeof(partition));
+        }
+
+        if(libSvm){
+            // missing values and unset one-hot cells are left out of the sparse row
+            libSvmOut << label;
+            for(size_t i{0}; i < values.size(); i++){
+                if(std::isnan(values[i])) continue;
+                libSvmOut << ' ' << i << ':' << values[i];
+            }
+            libSvmOut << '\n';
+            continue;
+        }
+
+        matrixOut.write(reinterpret_cast<const char *>(values.data()), values.size() * sizeof(float));
+        labelsOut.write(reinterpret_cast<const char *>(&label), sizeof(float));
+    }
+
+    fmt::println(
+        "done: {} rows x {} columns written to {}{}{}",
+        writtenCount, matrixColumnNames.size(), outputBasePath, libSvm ? ".libsvm" : ".bin",
+        hasPartitions ? ", train/test partitions with them" : ""
+    );
+}
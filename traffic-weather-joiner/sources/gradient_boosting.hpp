@@ -0,0 +1,407 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+#include <fmt/core.h>
+#include <nlohmann/json.hpp>
+
+#include "utilities.hpp"
+
+namespace training{
+
+    constexpr uint8_t MissingBin{255};
+
+    // features quantised once into at most 255 bins, stored column-major so a
+    // histogram pass over one feature reads a single contiguous array
+    struct BinnedMatrix{
+        size_t rowCount{0};
+        size_t featureCount{0};
+        std::vector<uint8_t> bins;
+        std::vector<std::vector<float>> cuts;   // exclusive upper bound of each bin, last is +inf
+
+        uint8_t at(size_t row, size_t feature) const{ return bins[feature * rowCount + row]; }
+        size_t binCount(size_t feature) const{ return cuts[feature].size(); }
+    };
+
+    inline BinnedMatrix quantise(
+        const std::vector<float> &values,
+        size_t rowCount,
+        size_t featureCount,
+        size_t maxBins,
+        size_t sampleRows,
+        size_t threadCount
+    ){
+        BinnedMatrix matrix;
+        matrix.rowCount = rowCount;
+        matrix.featureCount = featureCount;
+        matrix.bins.resize(rowCount * featureCount);
+        matrix.cuts.resize(featureCount);
+
+        maxBins = std::clamp<size_t>(maxBins, 2, MissingBin);
+        size_t sampleStep{std::max<size_t>(1, rowCount / std::max<size_t>(1, sampleRows))};
+
+        utilities::parallelFor(featureCount, threadCount, [&](size_t feature){
+            std::vector<float> sample;
+            for(size_t row{0}; row < rowCount; row += sampleStep){
+                float value{values[row * featureCount + feature]};
+                if(!std::isnan(value)) sample.push_back(value);
+            }
+            std::sort(sample.begin(), sample.end());
+
+            std::vector<float> distinct(sample);
+            distinct.erase(std::unique(distinct.begin(), distinct.end()), distinct.end());
+
+            // each bin holds values in [previous cut, cut): one bin per distinct value
+            // for low cardinality features, quantiles otherwise
+            std::vector<float> &cuts{matrix.cuts[feature]};
+            if(distinct.size() <= maxBins){
+                if(!distinct.empty()) cuts.assign(distinct.begin() + 1, distinct.end());
+            }else{
+                for(size_t bin{1}; bin < maxBins; bin++){
+                    float cut{sample[bin * sample.size() / maxBins]};
+                    if(cut > sample.front() && (cuts.empty() || cut > cuts.back())) cuts.push_back(cut);
+                }
+            }
+            cuts.push_back(std::numeric_limits<float>::infinity());
+
+            uint8_t *bins{matrix.bins.data() + feature * rowCount};
+            for(size_t row{0}; row < rowCount; row++){
+                float value{values[row * featureCount + feature]};
+                if(std::isnan(value)){
+                    bins[row] = MissingBin;
+                    continue;
+                }
+                auto upper{std::upper_bound(cuts.begin(), cuts.end() - 1, value)};
+                bins[row] = static_cast<uint8_t>(upper - cuts.begin());
+            }
+        });
+
+        return matrix;
+    }
+
+    struct BoostingParameters{
+        int trees;
+        int maxDepth;
+        double minChildWeight;
+        double learningRate;
+        double lossReduction;
+        double columnFraction;
+        double lambda;
+    };
+
+    struct TreeNode{
+        int feature{-1};
+        int splitBin{0};
+        float threshold{0.0f};
+        int left{-1};
+        int right{-1};
+        int parent{-1};
+        bool defaultLeft{false};
+        float value{0.0f};      // leaf weight, already scaled by the learning rate
+        float lossChange{0.0f};
+        float hessian{0.0f};
+    };
+
+    struct Tree{
+        std::vector<TreeNode> nodes;
+
+        float predict(const BinnedMatrix &matrix, size_t row) const{
+            const TreeNode *node{&nodes[0]};
+            while(node->feature >= 0){
+                uint8_t bin{matrix.at(row, node->feature)};
+                bool left{bin == MissingBin ? node->defaultLeft : bin <= node->splitBin};
+                node = &nodes[left ? node->left : node->right];
+            }
+            return node->value;
+        }
+    };
+
+    struct Booster{
+        float baseScore{0.0f};
+        std::vector<Tree> trees;
+
+        float predict(const BinnedMatrix &matrix, size_t row) const{
+            float prediction{baseScore};
+            for(const auto &tree : trees){
+                prediction += tree.predict(matrix, row);
+            }
+            return prediction;
+        }
+    };
+
+    namespace _{
+
+        struct GradientPair{
+            double gradient{0.0};
+            double hessian{0.0};
+        };
+
+        struct Split{
+            double lossChange{0.0};
+            int feature{-1};
+            int bin{0};
+            bool defaultLeft{false};
+        };
+
+        inline double leafScore(double gradient, double hessian, double lambda){
+            return gradient * gradient / (hessian + lambda);
+        }
+
+    } // namespace _
+
+    // squared error boosting over the given rows of the binned matrix, depth-wise growth
+    inline Booster fit(
+        const BinnedMatrix &matrix,
+        const std::vector<float> &labels,
+        const std::vector<uint32_t> &rows,
+        const BoostingParameters &parameters,
+        uint64_t seed
+    ){
+        Booster booster;
+        if(rows.empty()) return booster;
+
+        double labelSum{0.0};
+        for(uint32_t row : rows) labelSum += labels[row];
+        booster.baseScore = static_cast<float>(labelSum / rows.size());
+
+        std::vector<float> predictions(matrix.rowCount, booster.baseScore);
+        std::vector<float> gradients(matrix.rowCount, 0.0f);
+        std::vector<uint32_t> order(rows);
+
+        std::vector<int> features(matrix.featureCount);
+        for(size_t i{0}; i < features.size(); i++) features[i] = static_cast<int>(i);
+        size_t sampledFeatureCount{std::clamp<size_t>(
+            static_cast<size_t>(std::lround(parameters.columnFraction * matrix.featureCount)), 1, matrix.featureCount
+        )};
+
+        std::mt19937_64 random{seed};
+        std::array<_::GradientPair, 256> histogram;
+
+        struct Pending{
+            int node;
+            size_t begin;
+            size_t end;
+            int depth;
+            double gradient;
+            double hessian;
+        };
+
+        for(int treeIndex{0}; treeIndex < parameters.trees; treeIndex++){
+            std::shuffle(features.begin(), features.end(), random);
+
+            double gradientSum{0.0};
+            for(uint32_t row : rows){
+                gradients[row] = predictions[row] - labels[row];
+                gradientSum += gradients[row];
+            }
+
+            Tree tree;
+            tree.nodes.push_back({});
+            std::vector<Pending> pending{{0, 0, order.size(), 0, gradientSum, static_cast<double>(order.size())}};
+
+            while(!pending.empty()){
+                Pending current{pending.back()};
+                pending.pop_back();
+
+                _::Split best;
+                if(current.depth < parameters.maxDepth && current.hessian >= 2.0 * parameters.minChildWeight){
+                    double parentScore{_::leafScore(current.gradient, current.hessian, parameters.lambda)};
+
+                    for(size_t sampled{0}; sampled < sampledFeatureCount; sampled++){
+                        int feature{features[sampled]};
+                        size_t binCount{matrix.binCount(feature)};
+                        if(binCount < 2) continue;
+
+                        std::fill(histogram.begin(), histogram.end(), _::GradientPair{});
+                        const uint8_t *bins{matrix.bins.data() + feature * matrix.rowCount};
+                        for(size_t i{current.begin}; i < current.end; i++){
+                            uint32_t row{order[i]};
+                            _::GradientPair &slot{histogram[bins[row]]};
+                            slot.gradient += gradients[row];
+                            slot.hessian += 1.0;
+                        }
+
+                        const _::GradientPair &missing{histogram[MissingBin]};
+                        double leftGradient{0.0};
+                        double leftHessian{0.0};
+
+                        for(size_t bin{0}; bin + 1 < binCount; bin++){
+                            leftGradient += histogram[bin].gradient;
+                            leftHessian += histogram[bin].hessian;
+
+                            // try sending missing values right, then left
+                            for(bool missingLeft : {false, true}){
+                                double gradientLeft{leftGradient + (missingLeft ? missing.gradient : 0.0)};
+                                double hessianLeft{leftHessian + (missingLeft ? missing.hessian : 0.0)};
+                                double gradientRight{current.gradient - gradientLeft};
+                                double hessianRight{current.hessian - hessianLeft};
+                                if(hessianLeft < parameters.minChildWeight || hessianRight < parameters.minChildWeight) continue;
+
+                                double lossChange{
+                                    _::leafScore(gradientLeft, hessianLeft, parameters.lambda)
+                                    + _::leafScore(gradientRight, hessianRight, parameters.lambda)
+                                    - parentScore
+                                };
+                                if(lossChange > best.lossChange){
+                                    best = {lossChange, feature, static_cast<int>(bin), missingLeft};
+                                }
+                            }
+                        }
+                    }
+                }
+
+                TreeNode &node{tree.nodes[current.node]};
+                node.hessian = static_cast<float>(current.hessian);
+
+                if(best.feature < 0 || best.lossChange <= parameters.lossReduction){
+                    float weight{static_cast<float>(-current.gradient / (current.hessian + parameters.lambda) * parameters.learningRate)};
+                    node.value = weight;
+                    for(size_t i{current.begin}; i < current.end; i++){
+                        predictions[order[i]] += weight;
+                    }
+                    continue;
+                }
+
+                const uint8_t *bins{matrix.bins.data() + best.feature * matrix.rowCount};
+                auto goesLeft{[&](uint32_t row){
+                    uint8_t bin{bins[row]};
+                    return bin == MissingBin ? best.defaultLeft : bin <= best.bin;
+                }};
+                auto middle{std::partition(order.begin() + current.begin, order.begin() + current.end, goesLeft)};
+                size_t split{static_cast<size_t>(middle - order.begin())};
+
+                double leftGradient{0.0};
+                for(size_t i{current.begin}; i < split; i++) leftGradient += gradients[order[i]];
+                double leftHessian{static_cast<double>(split - current.begin)};
+
+                int left{static_cast<int>(tree.nodes.size())};
+                int right{left + 1};
+                node.feature = best.feature;
+                node.splitBin = best.bin;
+                node.threshold = matrix.cuts[best.feature][best.bin];
+                node.defaultLeft = best.defaultLeft;
+                node.lossChange = static_cast<float>(best.lossChange);
+                node.left = left;
+                node.right = right;
+
+                int parent{current.node};
+                tree.nodes.push_back({});
+                tree.nodes.push_back({});
+                tree.nodes[left].parent = parent;
+                tree.nodes[right].parent = parent;
+
+                pending.push_back({right, split, current.end, current.depth + 1, current.gradient - leftGradient, current.hessian - leftHessian});
+                pending.push_back({left, current.begin, split, current.depth + 1, leftGradient, leftHessian});
+            }
+
+            booster.trees.push_back(std::move(tree));
+        }
+
+        return booster;
+    }
+
+    inline double rootMeanSquaredError(
+        const Booster &booster,
+        const BinnedMatrix &matrix,
+        const std::vector<float> &labels,
+        const std::vector<uint32_t> &rows
+    ){
+        if(rows.empty()) return 0.0;
+        double squaredSum{0.0};
+        for(uint32_t row : rows){
+            double error{booster.predict(matrix, row) - labels[row]};
+            squaredSum += error * error;
+        }
+        return std::sqrt(squaredSum / rows.size());
+    }
+
+    // xgboost's saved JSON model layout, loadable by xgb.load() and inference::TreeEnsemble
+    inline nlohmann::json toXgboostJson(const Booster &booster, const std::vector<std::string> &featureNames){
+        std::vector<int> iterationOffsets(booster.trees.size() + 1);
+        for(size_t i{0}; i < iterationOffsets.size(); i++) iterationOffsets[i] = static_cast<int>(i);
+
+        nlohmann::json trees = nlohmann::json::array();
+        for(size_t treeIndex{0}; treeIndex < booster.trees.size(); treeIndex++){
+            const auto &nodes{booster.trees[treeIndex].nodes};
+            std::vector<int> leftChildren, rightChildren, parents, splitIndices, defaultLeft, splitTypes;
+            std::vector<float> splitConditions, baseWeights, lossChanges, sumHessian;
+
+            for(const auto &node : nodes){
+                bool leaf{node.feature < 0};
+                leftChildren.push_back(node.left);
+                rightChildren.push_back(node.right);
+                parents.push_back(node.parent < 0 ? std::numeric_limits<int32_t>::max() : node.parent);
+                splitIndices.push_back(leaf ? 0 : node.feature);
+                defaultLeft.push_back(node.defaultLeft ? 1 : 0);
+                splitTypes.push_back(0);
+                splitConditions.push_back(leaf ? node.value : node.threshold);
+                baseWeights.push_back(node.value);
+                lossChanges.push_back(node.lossChange);
+                sumHessian.push_back(node.hessian);
+            }
+
+            trees.push_back({
+                {"id", treeIndex},
+                {"left_children", leftChildren},
+                {"right_children", rightChildren},
+                {"parents", parents},
+                {"split_indices", splitIndices},
+                {"split_conditions", splitConditions},
+                {"split_type", splitTypes},
+                {"default_left", defaultLeft},
+                {"base_weights", baseWeights},
+                {"loss_changes", lossChanges},
+                {"sum_hessian", sumHessian},
+                {"categories", nlohmann::json::array()},
+                {"categories_nodes", nlohmann::json::array()},
+                {"categories_segments", nlohmann::json::array()},
+                {"categories_sizes", nlohmann::json::array()},
+                {"tree_param", {
+                    {"num_deleted", "0"},
+                    {"num_feature", std::to_string(featureNames.size())},
+                    {"num_nodes", std::to_string(nodes.size())},
+                    {"size_leaf_vector", "1"}
+                }}
+            });
+        }
+
+        return {
+            {"version", {2, 0, 0}},
+            {"learner", {
+                {"attributes", nlohmann::json::object()},
+                {"feature_names", featureNames},
+                {"feature_types", std::vector<std::string>(featureNames.size(), "float")},
+                {"gradient_booster", {
+                    {"name", "gbtree"},
+                    {"model", {
+                        {"gbtree_model_param", {
+                            {"num_parallel_tree", "1"},
+                            {"num_trees", std::to_string(booster.trees.size())}
+                        }},
+                        {"iteration_indptr", iterationOffsets},
+                        {"tree_info", std::vector<int>(booster.trees.size(), 0)},
+                        {"trees", trees}
+                    }}
+                }},
+                {"learner_model_param", {
+                    {"base_score", fmt::format("{:E}", booster.baseScore)},
+                    {"boost_from_average", "1"},
+                    {"num_class", "0"},
+                    {"num_feature", std::to_string(featureNames.size())},
+                    {"num_target", "1"}
+                }},
+                {"objective", {
+                    {"name", "reg:squarederror"},
+                    {"reg_loss_param", {{"scale_pos_weight", "1"}}}
+                }}
+            }}
+        };
+    }
+
+} // namespace training
@@ -0,0 +1,85 @@
+#ifndef JOINER_H
+#define JOINER_H
+
+/*
+ * C interface of the joiner library, for R's .Call, Python's ctypes or any
+ * other FFI. every stage takes its input and output paths explicitly and
+ * returns JOINER_OK or JOINER_ERROR, joiner_last_error() says why. tables hand
+ * out column buffers owned by the table: doubles (NaN where a value is
+ * missing) or NUL terminated strings, valid until joiner_table_free().
+ * nothing here throws, and no C++ type crosses the boundary
+ */
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(__GNUC__)
+#define JOINER_API __attribute__((visibility("default")))
+#else
+#define JOINER_API
+#endif
+
+#define JOINER_OK       0
+#define JOINER_ERROR    1
+
+typedef enum joiner_column_type{
+    JOINER_COLUMN_DOUBLE = 0,   /* const double *, every value parsed as a number or empty */
+    JOINER_COLUMN_STRING = 1    /* const char *const *, one string per row */
+} joiner_column_type;
+
+typedef struct joiner_column{
+    const char *name;
+    joiner_column_type type;
+    size_t length;              /* rows */
+    const void *data;
+} joiner_column;
+
+typedef struct joiner_table joiner_table;
+
+JOINER_API const char *joiner_version(void);
+
+/* message of the last failed call on this thread, "" after a success */
+JOINER_API const char *joiner_last_error(void);
+
+/* the command line of the joiner executable, argv[0] included. "shards N"
+   starts the joiner executable again for every shard, so it is refused here:
+   called from another host it would start that host instead */
+JOINER_API int joiner_run_command(int argc, char **argv);
+
+/* joiner_run_command where "shards N" starts executable (the joiner driver,
+   "/proc/self/exe" from inside it) with --shard i/N */
+JOINER_API int joiner_run_executable(const char *executable, int argc, char **argv);
+
+/* stages, configured by constants.hpp like the pipeline. the output of a call
+   is removed before the stage runs, and an output that is also an input is
+   refused. shard_count 0 or 1 splits every segment, otherwise only those of
+   shard shard_index */
+JOINER_API int joiner_split(const char *traffic_csv, const char *container_out, const char *segment_index_out, size_t shard_index, size_t shard_count);
+JOINER_API int joiner_sort(const char *container_in, const char *container_out);
+JOINER_API int joiner_aggregate(const char *container_in, const char *container_out);
+JOINER_API int joiner_merge_weather(const char *weather_csv, const char *weather_index, const char *segment_index, const char *container_in, const char *container_out);
+JOINER_API int joiner_merge(const char *container_in, const char *csv_out, int by_time);
+JOINER_API int joiner_add_time_features(const char *csv_in, const char *csv_out);
+JOINER_API int joiner_assign_splits(const char *csv_in, const char *csv_out);
+JOINER_API int joiner_export_matrix(const char *csv_in, const char *matrix_base_out);
+
+/* rows of a segment container matching every predicate ("column<op>value"),
+   written as csv, or as a container when csv_out ends in .seg */
+JOINER_API int joiner_query(const char *container_in, const char *const *predicates, size_t predicate_count, const char *csv_out);
+
+/* a whole csv (.gz/.zst too) as typed columns, NULL on failure */
+JOINER_API joiner_table *joiner_table_read_csv(const char *csv_in);
+JOINER_API void joiner_table_free(joiner_table *table);
+JOINER_API size_t joiner_table_rows(const joiner_table *table);
+JOINER_API size_t joiner_table_columns(const joiner_table *table);
+/* JOINER_ERROR when column is out of range */
+JOINER_API int joiner_table_column(const joiner_table *table, size_t column, joiner_column *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
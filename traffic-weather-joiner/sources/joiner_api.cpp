@@ -0,0 +1,285 @@
+#include "joiner.h"
+
+#include "split_traffic.hpp"
+#include "sort_by_time.hpp"
+#include "aggregate_by_time.hpp"
+#include "merge_weather.hpp"
+#include "add_time_features.hpp"
+#include "assign_splits.hpp"
+#include "merge_split_data.hpp"
+#include "merge_by_time.hpp"
+#include "export_matrix.hpp"
+#include "segment_query.hpp"
+#include "sharding.hpp"
+
+#include "constants.hpp"
+#include "compressed_io.hpp"
+#include "csv_tokenizer.hpp"
+
+#include <charconv>
+#include <cmath>
+#include <exception>
+#include <filesystem>
+#include <limits>
+#include <string>
+#include <vector>
+#include <fmt/core.h>
+
+#ifndef PROJECT_VERSION
+#define PROJECT_VERSION "unknown"
+#endif
+
+// columns of a loaded csv. string columns keep all their text in one buffer,
+// the row pointers point into it
+struct joiner_table{
+    size_t rows{0};
+    std::vector<std::string> names;
+    std::vector<joiner_column_type> types;
+    std::vector<std::vector<double>> numbers;
+    std::vector<std::string> text;
+    std::vector<std::vector<const char *>> strings;
+};
+
+namespace _{
+
+    thread_local std::string lastError;
+
+    inline bool missingArgument(std::initializer_list<const char *> arguments){
+        for(const char *argument : arguments){
+            if(argument == nullptr){
+                lastError = "a path argument is NULL";
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // the stages report problems on stdout and return, so a stage counts as
+    // failed when it throws (from any of its workers) or does not write its
+    // output. an output left by an earlier run is removed first, so it can not
+    // pass for this one, and refused when it is one of the stage's inputs
+    template<typename Stage>
+    int runStage(const std::string &expectedOutput, std::initializer_list<const char *> inputs, Stage &&stage){
+        std::error_code error;
+        if(!expectedOutput.empty()){
+            std::filesystem::path output{std::filesystem::weakly_canonical(expectedOutput, error)};
+            for(const char *input : inputs){
+                std::error_code inputError;
+                if(!error && output == std::filesystem::weakly_canonical(input, inputError)){
+                    lastError = fmt::format("{} is both input and output", input);
+                    return JOINER_ERROR;
+                }
+            }
+            std::filesystem::remove(expectedOutput, error);
+        }
+
+        bool failed{true};
+        try{
+            stage();
+            failed = false;
+        }catch(const std::exception &exception){
+            lastError = exception.what();
+        }catch(...){
+            lastError = "unknown error";
+        }
+        if(failed){
+            // whatever the stage wrote before it threw is incomplete
+            if(!expectedOutput.empty()) std::filesystem::remove(expectedOutput, error);
+            return JOINER_ERROR;
+        }
+        if(!expectedOutput.empty() && !std::filesystem::exists(expectedOutput, error)){
+            lastError = fmt::format("{} was not written", expectedOutput);
+            return JOINER_ERROR;
+        }
+        lastError.clear();
+        return JOINER_OK;
+    }
+
+    inline bool isNumber(std::string_view value, double &number){
+        if(value.empty()){
+            number = std::numeric_limits<double>::quiet_NaN();
+            return true;
+        }
+        auto [end, error]{std::from_chars(value.data(), value.data() + value.size(), number)};
+        return error == std::errc{} && end == value.data() + value.size();
+    }
+
+} // namespace _
+
+const char *joiner_version(void){
+    return PROJECT_VERSION;
+}
+
+const char *joiner_last_error(void){
+    return _::lastError.c_str();
+}
+
+int joiner_split(const char *traffic_csv, const char *container_out, const char *segment_index_out, size_t shard_index, size_t shard_count){
+    if(_::missingArgument({traffic_csv, container_out, segment_index_out})) return JOINER_ERROR;
+    sharding::Shard shard{shard_count > 1 ? shard_index : 0, shard_count > 1 ? shard_count : 1};
+    if(shard.index >= shard.count){
+        _::lastError = fmt::format("shard {} of {} does not exist", shard_index, shard_count);
+        return JOINER_ERROR;
+    }
+    return _::runStage(container_out, {traffic_csv}, [&](){ splitBySegmentId(traffic_csv, container_out, segment_index_out, shard); });
+}
+
+int joiner_sort(const char *container_in, const char *container_out){
+    if(_::missingArgument({container_in, container_out})) return JOINER_ERROR;
+    return _::runStage(container_out, {container_in}, [&](){ sortByTime(container_in, container_out); });
+}
+
+int joiner_aggregate(const char *container_in, const char *container_out){
+    if(_::missingArgument({container_in, container_out})) return JOINER_ERROR;
+    return _::runStage(container_out, {container_in}, [&](){ aggregateByTime(container_in, container_out); });
+}
+
+int joiner_merge_weather(const char *weather_csv, const char *weather_index, const char *segment_index, const char *container_in, const char *container_out){
+    if(_::missingArgument({weather_csv, weather_index, segment_index, container_in, container_out})) return JOINER_ERROR;
+    return _::runStage(container_out, {weather_csv, segment_index, container_in}, [&](){
+        mergeWeather(weather_csv, weather_index, segment_index, container_in, container_out);
+    });
+}
+
+int joiner_merge(const char *container_in, const char *csv_out, int by_time){
+    if(_::missingArgument({container_in, csv_out})) return JOINER_ERROR;
+    return _::runStage(csv_out, {container_in}, [&](){
+        if(by_time) mergeSplitDataByTime(container_in, csv_out);
+        else mergeSplitData(container_in, csv_out);
+    });
+}
+
+int joiner_add_time_features(const char *csv_in, const char *csv_out){
+    if(_::missingArgument({csv_in, csv_out})) return JOINER_ERROR;
+    return _::runStage(csv_out, {csv_in}, [&](){ addTimeFeatures(csv_in, csv_out); });
+}
+
+int joiner_assign_splits(const char *csv_in, const char *csv_out){
+    if(_::missingArgument({csv_in, csv_out})) return JOINER_ERROR;
+    // with separate files the test file always exists, the base path never does
+    std::string expected{constants::splits::OutputMode == constants::splits::Output::Files
+        ? _::splitFilePath(csv_out, "test")
+        : std::string{csv_out}};
+    return _::runStage(expected, {csv_in}, [&](){ assignSplits(csv_in, csv_out); });
+}
+
+int joiner_export_matrix(const char *csv_in, const char *matrix_base_out){
+    if(_::missingArgument({csv_in, matrix_base_out})) return JOINER_ERROR;
+    std::string expected{fmt::format("{}.{}", matrix_base_out,
+        constants::matrix_export::OutputFormat == constants::matrix_export::Format::LibSvm ? "libsvm" : "bin")};
+    return _::runStage(expected, {csv_in}, [&](){ exportFeatureMatrix(csv_in, matrix_base_out); });
+}
+
+int joiner_query(const char *container_in, const char *const *predicates, size_t predicate_count, const char *csv_out){
+    if(_::missingArgument({container_in, csv_out})) return JOINER_ERROR;
+    std::vector<std::string> arguments{"--input", container_in, "--output", csv_out};
+    for(size_t i{0}; i < predicate_count; i++){
+        if(_::missingArgument({predicates[i]})) return JOINER_ERROR;
+        arguments.push_back(predicates[i]);
+    }
+    int status{JOINER_OK};
+    int result{_::runStage(csv_out, {container_in}, [&](){ status = query::runQuery(arguments); })};
+    if(result == JOINER_OK && status != 0){
+        _::lastError = "the query failed, see its messages";
+        return JOINER_ERROR;
+    }
+    return result;
+}
+
+// two passes over the parsed text: the first finds the row count and which
+// columns are all numbers, the second fills the columns at their final size
+joiner_table *joiner_table_read_csv(const char *csv_in){
+    if(_::missingArgument({csv_in})) return nullptr;
+    try{
+        tokenizer::Reader csv;
+        auto input{compression::open(csv, csv_in)};
+        if(!input){
+            _::lastError = fmt::format("could not open {}", csv_in);
+            return nullptr;
+        }
+
+        auto table{std::make_unique<joiner_table>()};
+        for(const auto &cell : csv.header()){
+            std::string value;
+            cell.read_value(value);
+            table->names.push_back(value);
+        }
+        size_t columnCount{table->names.size()};
+
+        std::vector<bool> numeric(columnCount, true);
+        std::vector<size_t> textBytes(columnCount, 0);
+        double number{0.0};
+        for(const auto &row : csv){
+            table->rows++;
+            for(size_t column{0}; column < columnCount && column < row.size(); column++){
+                std::string_view value{row[column].view()};
+                textBytes[column] += value.size() + 1;
+                if(numeric[column] && !_::isNumber(value, number)) numeric[column] = false;
+            }
+        }
+
+        table->types.resize(columnCount);
+        table->numbers.resize(columnCount);
+        table->text.resize(columnCount);
+        table->strings.resize(columnCount);
+        for(size_t column{0}; column < columnCount; column++){
+            table->types[column] = numeric[column] ? JOINER_COLUMN_DOUBLE : JOINER_COLUMN_STRING;
+            if(numeric[column]) table->numbers[column].reserve(table->rows);
+            else table->text[column].reserve(textBytes[column] + table->rows);
+        }
+
+        // offsets first, pointers once the buffers stop growing
+        std::vector<std::vector<size_t>> offsets(columnCount);
+        std::string value;
+        for(const auto &row : csv){
+            for(size_t column{0}; column < columnCount; column++){
+                std::string_view cell{column < row.size() ? row[column].view() : std::string_view{}};
+                if(numeric[column]){
+                    _::isNumber(cell, number);
+                    table->numbers[column].push_back(number);
+                    continue;
+                }
+                offsets[column].push_back(table->text[column].size());
+                if(column < row.size()) row[column].read_value(value);
+                else value.clear();
+                table->text[column] += value;
+                table->text[column] += '\0';
+            }
+        }
+        for(size_t column{0}; column < columnCount; column++){
+            for(size_t offset : offsets[column]) table->strings[column].push_back(table->text[column].data() + offset);
+        }
+
+        _::lastError.clear();
+        return table.release();
+    }catch(const std::exception &error){
+        _::lastError = error.what();
+        return nullptr;
+    }
+}
+
+void joiner_table_free(joiner_table *table){
+    delete table;
+}
+
+size_t joiner_table_rows(const joiner_table *table){
+    return table == nullptr ? 0 : table->rows;
+}
+
+size_t joiner_table_columns(const joiner_table *table){
+    return table == nullptr ? 0 : table->names.size();
+}
+
+int joiner_table_column(const joiner_table *table, size_t column, joiner_column *out){
+    if(table == nullptr || out == nullptr || column >= table->names.size()){
+        _::lastError = "no such column";
+        return JOINER_ERROR;
+    }
+    out->name = table->names[column].c_str();
+    out->type = table->types[column];
+    out->length = table->rows;
+    out->data = table->types[column] == JOINER_COLUMN_DOUBLE
+        ? static_cast<const void *>(table->numbers[column].data())
+        : static_cast<const void *>(table->strings[column].data());
+    return JOINER_OK;
+}
@@ -0,0 +1,355 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <fmt/core.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "constants.hpp"
+#include "compressed_io.hpp"
+#include "csv_tokenizer.hpp"
+#include "segment_container.hpp"
+#include "time_columns.hpp"
+#include "units.hpp"
+#include "utilities.hpp"
+
+namespace _{
+
+    // tournament tree over k sorted inputs. internal nodes keep the loser of
+    // their match, so replacing the winner's key replays one leaf to root path:
+    // log2(k) comparisons per row. ties go to the lower input
+    class LoserTree{
+    public:
+        static constexpr int64_t Exhausted{std::numeric_limits<int64_t>::max()};
+
+        explicit LoserTree(std::vector<int64_t> keys)
+            : keys_{std::move(keys)}
+            , losers_(keys_.size(), 0)
+        {
+            if(!keys_.empty()) winner_ = build(1);
+        }
+
+        size_t winner() const{ return winner_; }
+        int64_t winnerKey() const{ return keys_.empty() ? Exhausted : keys_[winner_]; }
+
+        void replaceWinner(int64_t key){
+            keys_[winner_] = key;
+            for(size_t node{(keys_.size() + winner_) / 2}; node >= 1; node /= 2){
+                if(beats(losers_[node], winner_)) std::swap(losers_[node], winner_);
+            }
+        }
+
+    private:
+        bool beats(size_t left, size_t right) const{
+            return keys_[left] < keys_[right] || (keys_[left] == keys_[right] && left < right);
+        }
+
+        // leaves sit at k..2k-1, so every node below k has two children
+        size_t build(size_t node){
+            if(node >= keys_.size()) return node - keys_.size();
+            size_t left{build(2 * node)};
+            size_t right{build(2 * node + 1)};
+            bool leftWins{beats(left, right)};
+            losers_[node] = leftWins ? right : left;
+            return leftWins ? left : right;
+        }
+
+        std::vector<int64_t> keys_;
+        std::vector<size_t> losers_;
+        size_t winner_{0};
+    };
+
+    // the rows of one segment that fall into one time partition, offsets in the container
+    struct TimeSlice{
+        uint64_t begin{0};
+        uint64_t end{0};
+        uint64_t bytes{0};      // merged bytes, every row with a '\n'
+        uint64_t rows{0};
+    };
+
+    struct TimeSegment{
+        std::optional<units::TimeColumns> columns;
+        std::vector<TimeSlice> slices;
+    };
+
+    // one slice being merged. the reader indexes ReadAheadBytes of rows at a
+    // time and the mapping is asked to page in the window after it
+    struct TimeCursor{
+        tokenizer::Reader csv{tokenizer::activeIsa(), constants::merge::ReadAheadBytes};
+        tokenizer::Reader::Iterator row;
+        const units::TimeColumns *columns{nullptr};
+        int32_t minute{units::NoMinute};
+        const char *advisedUntil{nullptr};
+        const char *end{nullptr};
+
+        int64_t key(){
+            if(!(row != tokenizer::Reader::Iterator{})) return LoserTree::Exhausted;
+            tokenizer::Row current{*row};
+            minute = columns->minuteOf(current, minute);
+
+            const char *position{current.text().data()};
+            if(position + constants::merge::ReadAheadBytes / 2 >= advisedUntil && advisedUntil < end){
+                const char *windowEnd{std::min(advisedUntil + constants::merge::ReadAheadBytes, end)};
+                uintptr_t pageSize{static_cast<uintptr_t>(::sysconf(_SC_PAGESIZE))};
+                uintptr_t aligned{reinterpret_cast<uintptr_t>(advisedUntil) & ~(pageSize - 1)};
+                ::madvise(reinterpret_cast<void *>(aligned), static_cast<size_t>(reinterpret_cast<uintptr_t>(windowEnd) - aligned), MADV_WILLNEED);
+                advisedUntil = windowEnd;
+            }
+            return minute;
+        }
+    };
+
+    // every row of a segment in order, with its minute, from the row after the header
+    template<typename Visit>
+    void forEachTimedRow(std::string_view block, const units::TimeColumns &columns, Visit &&visit){
+        tokenizer::Reader csv;
+        csv.parse(block);
+        int32_t minute{units::NoMinute};
+        for(const auto &row : csv){
+            minute = columns.minuteOf(row, minute);
+            visit(row, minute);
+        }
+    }
+
+    // partition bounds at weighted quantiles of the sampled row minutes: partition
+    // p takes minutes in [bounds[p - 1], bounds[p]), so one minute never spans two
+    inline std::vector<int32_t> timePartitionBounds(std::vector<std::pair<int32_t, uint64_t>> samples, size_t partitionCount){
+        std::sort(samples.begin(), samples.end());
+        uint64_t totalWeight{0};
+        for(const auto &sample : samples) totalWeight += sample.second;
+
+        std::vector<int32_t> bounds;
+        uint64_t weight{0};
+        size_t sample{0};
+        for(size_t partition{1}; partition < partitionCount; partition++){
+            uint64_t target{totalWeight * partition / partitionCount};
+            while(sample < samples.size() && weight + samples[sample].second <= target){
+                weight += samples[sample].second;
+                sample++;
+            }
+            bounds.push_back(sample < samples.size() ? samples[sample].first : std::numeric_limits<int32_t>::max());
+        }
+        return bounds;
+    }
+
+} // namespace _
+
+// mergeSplitData for a globally time ordered file. the segments are already
+// time sorted, so the rows of every segment are k-way merged by minute instead
+// of being concatenated; equal minutes keep segment id order. the time range
+// is cut into partitions of about equal row counts that are merged in parallel
+// straight into their place in the output, nothing holds more than one
+// partition's read-ahead windows and write buffer
+inline void mergeSplitDataByTime(
+    const std::string &inputContainerPath,
+    const std::string &outputFilePath
+){
+    fmt::println("opening {}...", inputContainerPath);
+
+    auto input{container::Reader::open(inputContainerPath)};
+    if(!input) return;
+    const auto &entries{input->entries()};
+
+    fmt::println("found {} segments", entries.size());
+
+    size_t workerCount{utilities::resolveThreadCount(constants::system::ThreadCount)};
+    size_t partitionCount{std::max<size_t>(1, constants::merge::TimePartitions != 0 ? constants::merge::TimePartitions : workerCount)};
+
+    // first pass: headers, time columns and a sample of row minutes per segment
+    std::vector<_::TimeSegment> segments(entries.size());
+    std::vector<std::vector<std::pair<int32_t, uint64_t>>> segmentSamples(entries.size());
+    std::atomic<size_t> unorderedRows{0};
+    utilities::parallelFor(entries.size(), constants::system::ThreadCount, [&](size_t segment){
+        std::string_view block{input->block(entries[segment])};
+        tokenizer::Reader csv;
+        csv.parse(block);
+        std::vector<std::string> header;
+        for(const auto &cell : csv.header()){
+            std::string value;
+            cell.read_value(value);
+            header.push_back(value);
+        }
+        segments[segment].columns = units::TimeColumns::find(header);
+        if(!segments[segment].columns) return;
+
+        uint64_t stride{std::max<uint64_t>(1, entries[segment].rowCount / constants::merge::SamplesPerSegment)};
+        uint64_t row{0};
+        int32_t previous{units::NoMinute};
+        _::forEachTimedRow(block, *segments[segment].columns, [&](const tokenizer::Row &, int32_t minute){
+            if(minute < previous) unorderedRows++;
+            previous = minute;
+            if(row++ % stride == 0) segmentSamples[segment].push_back({minute, stride});
+        });
+    });
+
+    std::string header;
+    std::vector<std::pair<int32_t, uint64_t>> samples;
+    for(size_t segment{0}; segment < entries.size(); segment++){
+        std::string_view block{input->block(entries[segment])};
+        if(block.empty()) continue;
+        if(!segments[segment].columns){
+            fmt::println("[!!! segment {} has no {}/{}/{}/{}/{} columns, its rows are left out !!!]",
+                entries[segment].segmentId,
+                constants::column_names::Year, constants::column_names::Month, constants::column_names::Day,
+                constants::column_names::Hour, constants::column_names::Minute);
+            continue;
+        }
+
+        std::string_view blockHeader{block.substr(0, std::min(block.find('\n'), block.size()))};
+        if(!blockHeader.empty() && blockHeader.back() == '\r') blockHeader.remove_suffix(1);
+        if(header.empty()){
+            header.assign(blockHeader);
+            header += '\n';
+        }else if(blockHeader != std::string_view{header}.substr(0, header.size() - 1)){
+            // its columns would not line up with the first header
+            fmt::println("[!!! segment {} has a different header than the first segment, nothing is merged !!!]", entries[segment].segmentId);
+            return;
+        }
+        samples.insert(samples.end(), segmentSamples[segment].begin(), segmentSamples[segment].end());
+    }
+    segmentSamples.clear();
+    if(unorderedRows > 0){
+        fmt::println("[!!! {} rows are earlier than the row before them, those segments are not time sorted !!!]", unorderedRows.load());
+    }
+
+    std::vector<int32_t> bounds{_::timePartitionBounds(std::move(samples), partitionCount)};
+
+    // second pass: where each segment's rows cross the partition bounds, so
+    // every partition knows its inputs and its offset in the output up front
+    utilities::parallelFor(entries.size(), constants::system::ThreadCount, [&](size_t segment){
+        _::TimeSegment &timeSegment{segments[segment]};
+        if(!timeSegment.columns) return;
+        timeSegment.slices.assign(partitionCount, {});
+
+        std::string_view block{input->block(entries[segment])};
+        size_t partition{0};
+        _::forEachTimedRow(block, *timeSegment.columns, [&](const tokenizer::Row &row, int32_t minute){
+            // never back to an earlier partition, an unsorted segment still has one slice per partition
+            size_t rowPartition{static_cast<size_t>(std::upper_bound(bounds.begin(), bounds.end(), minute) - bounds.begin())};
+            partition = std::max(partition, rowPartition);
+
+            std::string_view text{row.text()};
+            _::TimeSlice &slice{timeSegment.slices[partition]};
+            if(slice.rows == 0) slice.begin = entries[segment].offset + static_cast<uint64_t>(text.data() - block.data());
+            slice.bytes += text.size() + 1;
+            slice.rows++;
+        });
+
+        uint64_t next{entries[segment].offset + entries[segment].length};
+        for(size_t slice{partitionCount}; slice-- > 0;){
+            if(timeSegment.slices[slice].rows == 0) continue;
+            timeSegment.slices[slice].end = next;
+            next = timeSegment.slices[slice].begin;
+        }
+    });
+
+    std::vector<uint64_t> partitionOffsets(partitionCount + 1, header.size());
+    uint64_t totalRows{0};
+    for(size_t partition{0}; partition < partitionCount; partition++){
+        uint64_t bytes{0};
+        for(const auto &segment : segments){
+            if(segment.slices.empty()) continue;
+            bytes += segment.slices[partition].bytes;
+            totalRows += segment.slices[partition].rows;
+        }
+        partitionOffsets[partition + 1] = partitionOffsets[partition] + bytes;
+    }
+    uint64_t outputSize{partitionOffsets.back()};
+
+    fmt::println("merging {} rows by time in {} partitions", totalRows, partitionCount);
+
+    // merges one partition, handing the merged bytes to flush in write sized pieces
+    auto mergePartition{[&](size_t partition, auto &&flush){
+        std::vector<std::unique_ptr<_::TimeCursor>> cursors;
+        std::vector<int64_t> keys;
+        for(const auto &segment : segments){
+            if(segment.slices.empty() || segment.slices[partition].rows == 0) continue;
+            const _::TimeSlice &slice{segment.slices[partition]};
+
+            auto cursor{std::make_unique<_::TimeCursor>()};
+            cursor->csv.parseBody({input->data() + slice.begin, static_cast<size_t>(slice.end - slice.begin)});
+            cursor->columns = &*segment.columns;
+            cursor->advisedUntil = input->data() + slice.begin;
+            cursor->end = input->data() + slice.end;
+            cursor->row = cursor->csv.begin();
+            keys.push_back(cursor->key());
+            cursors.push_back(std::move(cursor));
+        }
+
+        _::LoserTree tree{std::move(keys)};
+        std::string buffer;
+        buffer.reserve(constants::merge::WriteBufferBytes + (1 << 16));
+        while(tree.winnerKey() != _::LoserTree::Exhausted){
+            _::TimeCursor &cursor{*cursors[tree.winner()]};
+            buffer += (*cursor.row).text();
+            buffer += '\n';
+            if(buffer.size() >= constants::merge::WriteBufferBytes){
+                flush(std::string_view{buffer});
+                buffer.clear();
+            }
+            ++cursor.row;
+            tree.replaceWinner(cursor.key());
+        }
+        if(!buffer.empty()) flush(std::string_view{buffer});
+    }};
+
+    if(compression::codecOf(outputFilePath) != compression::Codec::None){
+        // the compressor takes the bytes in order, so partitions are merged one after another
+        compression::OutputFile out{outputFilePath};
+        out << header;
+        for(size_t partition{0}; partition < partitionCount; partition++){
+            mergePartition(partition, [&](std::string_view bytes){
+                out.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+            });
+        }
+        if(!out.close()) return;
+        fmt::println("done:  {} segments, {} total rows in {}", entries.size(), totalRows, outputFilePath);
+        return;
+    }
+
+    int output{::open(outputFilePath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)};
+    if(output < 0){
+        fmt::println("[!!! could not open {} !!!]", outputFilePath);
+        return;
+    }
+    // a preallocated file with holes must not pass for a merge
+    auto removeOutput{[&](){
+        std::error_code error;
+        std::filesystem::remove(outputFilePath, error);
+    }};
+    if(::posix_fallocate(output, 0, static_cast<off_t>(outputSize)) != 0 && ::ftruncate(output, static_cast<off_t>(outputSize)) != 0){
+        fmt::println("[!!! could not size {} to {} bytes, nothing is merged !!!]", outputFilePath, outputSize);
+        ::close(output);
+        removeOutput();
+        return;
+    }
+
+    std::atomic<size_t> failedWrites{0};
+    if(!container::_::writeAll(output, header.data(), header.size(), 0)) failedWrites++;
+    utilities::parallelFor(partitionCount, constants::system::ThreadCount, [&](size_t partition){
+        uint64_t offset{partitionOffsets[partition]};
+        mergePartition(partition, [&](std::string_view bytes){
+            if(!container::_::writeAll(output, bytes.data(), bytes.size(), offset)) failedWrites++;
+            offset += bytes.size();
+        });
+    });
+    if(::close(output) != 0) failedWrites++;
+
+    if(failedWrites > 0){
+        fmt::println("[!!! {} writes to {} failed, the incomplete file is removed !!!]", failedWrites.load(), outputFilePath);
+        removeOutput();
+        return;
+    }
+    fmt::println("done:  {} segments, {} total rows, {} bytes in {}", entries.size(), totalRows, outputSize, outputFilePath);
+}
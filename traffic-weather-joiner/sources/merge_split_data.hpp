@@ -1,83 +1,236 @@
 #pragma once
 
-#include <csv2/reader.hpp>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <algorithm>
+#include <atomic>
 #include <filesystem>
 #include <fmt/core.h>
-#include <fstream>
 
-#include "constants.hpp"
-
-inline void mergeSplitData(
-    const std::string &inputDirectory, 
-    const std::string &outputFilePath
-){
-    fmt::println("scanning {}...", inputDirectory);
+#include <fcntl.h>
+#include <unistd.h>
 
-    std::vector<std::filesystem::path> csvFiles;
-    for(const auto &entry : std::filesystem::directory_iterator(inputDirectory)){
-        if(entry.is_regular_file() && entry.path().extension() == ".csv"){
-            csvFiles.push_back(entry.path());
-        }
+#include "constants.hpp"
+#include "csv_tokenizer.hpp"
+#include "compressed_io.hpp"
+#include "segment_container.hpp"
+#include "utilities.hpp"
+
+namespace _{
+
+    // a segment block without its header line
+    struct MergeRange{
+        uint64_t source;        // offset in the container
+        uint64_t length;
+        uint64_t destination;   // offset in the merged file
+        bool addNewline;        // block did not end in '\n'
+    };
+
+    // header line of a block without its '\n'
+    inline std::string_view headerLine(std::string_view block){
+        return block.substr(0, std::min(block.find('\n'), block.size()));
     }
 
-    std::sort(csvFiles.begin(), csvFiles.end());
+    // copy_file_range keeps the bytes in the kernel (and shares extents where the
+    // filesystem can), pwrite from the mapping covers filesystems that refuse it
+    inline bool copyRange(int input, int output, const char *mapped, const MergeRange &range){
+        loff_t source{static_cast<loff_t>(range.source)};
+        loff_t destination{static_cast<loff_t>(range.destination)};
+        uint64_t remaining{range.length};
+        while(remaining > 0){
+            ssize_t copied{::copy_file_range(input, &source, output, &destination, remaining, 0)};
+            if(copied <= 0) break;
+            remaining -= static_cast<uint64_t>(copied);
+        }
 
-    fmt::println("found {} files", csvFiles.size());
+        while(remaining > 0){
+            uint64_t done{range.length - remaining};
+            ssize_t written{::pwrite(output, mapped + range.source + done, remaining, static_cast<off_t>(range.destination + done))};
+            if(written <= 0) return false;
+            remaining -= static_cast<uint64_t>(written);
+        }
 
-    std::ofstream out{outputFilePath};
+        if(range.addNewline){
+            return ::pwrite(output, "\n", 1, static_cast<off_t>(range.destination + range.length)) == 1;
+        }
+        return true;
+    }
 
-    bool headerWritten{false};
-    size_t totalRows{0};
-    size_t filesProcessed{0};
+    // parses every block and writes the cells back out, which normalises
+    // whitespace and reports rows the block index does not account for.
+    // false when a block's header differs from the first block's
+    inline bool mergeValidated(const container::Reader &input, std::ostream &out, size_t &totalRows){
+        std::vector<std::string> header;
+        size_t filesProcessed{0};
 
-    for(const auto &csvFile : csvFiles){
-        filesProcessed++;
+        for(const auto &entry : input.entries()){
+            std::string_view block{input.block(entry)};
+            if(block.empty()) continue;
+            filesProcessed++;
 
-        csv2::Reader<
-            csv2::delimiter<','>, 
-            csv2::quote_character<'"'>, 
-            csv2::first_row_is_header<true>,
-            csv2::trim_policy::trim_whitespace
-        > csv;
+            tokenizer::Reader csv;
 
-        csv.mmap(csvFile.string());
+            csv.parse(block);
 
-        if(!headerWritten){
-            bool firstCell{true};
+            std::vector<std::string> blockHeader;
             for(const auto &cell : csv.header()){
                 std::string value;
                 cell.read_value(value);
-                if(!firstCell) out << ',';
-                out << value;
-                firstCell = false;
+                blockHeader.push_back(std::move(value));
             }
-            out << '\n';
-            headerWritten = true;
-        }
 
-        size_t rowCount{0};
-        for(const auto &row : csv){
-            bool firstCell{true};
-            for(const auto &cell : row){
-                std::string value;
-                cell.read_value(value);
-                if(!firstCell) out << ',';
-                out << value;
-                firstCell = false;
+            if(header.empty()){
+                header = std::move(blockHeader);
+                for(size_t i{0}; i < header.size(); i++){
+                    if(i > 0) out << ',';
+                    out << header[i];
+                }
+                out << '\n';
+            }else if(blockHeader != header){
+                fmt::println("[!!! segment {} has a different header than the first segment, nothing is merged !!!]", entry.segmentId);
+                return false;
+            }
+
+            size_t rowCount{0};
+            for(const auto &row : csv){
+                bool firstCell{true};
+                for(const auto &cell : row){
+                    std::string value;
+                    cell.read_value(value);
+                    if(!firstCell) out << ',';
+                    out << value;
+                    firstCell = false;
+                }
+                out << '\n';
+                rowCount++;
             }
-            out << '\n';
-            rowCount++;
+
+            if(rowCount != entry.rowCount){
+                fmt::println("[!!! segment {} has {} rows, its index entry says {} !!!]", entry.segmentId, rowCount, entry.rowCount);
+            }
+            totalRows += rowCount;
+
+            if(filesProcessed % constants::system::FileProgressInterval == 0){
+                fmt::println("validated {} segments ({} rows)", filesProcessed, totalRows);
+            }
+        }
+        return true;
+    }
+
+} // namespace _
+
+inline void mergeSplitData(
+    const std::string &inputContainerPath,
+    const std::string &outputFilePath
+){
+    fmt::println("opening {}...", inputContainerPath);
+
+    // the container index is sorted by segment id
+    auto input{container::Reader::open(inputContainerPath)};
+    if(!input) return;
+    const auto &segments{input->entries()};
+
+    fmt::println("found {} segments", segments.size());
+
+    size_t totalRows{0};
+    if(constants::flags::ValidateMerge){
+        compression::OutputFile out{outputFilePath};
+        bool merged{_::mergeValidated(*input, out, totalRows)};
+        if(!out.close() || !merged){
+            // rows under the wrong header must not pass for a merge
+            std::error_code error;
+            std::filesystem::remove(outputFilePath, error);
+            return;
+        }
+        fmt::println("done:  {} segments, {} total rows in {}", segments.size(), totalRows, outputFilePath);
+        return;
+    }
+
+    // every block has to carry the same header, the merged file keeps the first
+    // one. the rest is plain concatenation at offsets known up front
+    std::string header;
+    std::vector<_::MergeRange> ranges;
+    ranges.reserve(segments.size());
+    uint64_t outputSize{0};
+    for(const auto &entry : segments){
+        std::string_view block{input->block(entry)};
+        if(block.empty()) continue;
+        std::string_view blockHeader{_::headerLine(block)};
+
+        if(header.empty()){
+            header.assign(blockHeader);
+            header += '\n';
+            outputSize = header.size();
+        }else if(blockHeader != std::string_view{header}.substr(0, header.size() - 1)){
+            // its columns would not line up with the first header
+            fmt::println("[!!! segment {} has a different header than the first segment, nothing is merged !!!]", entry.segmentId);
+            return;
         }
 
-        totalRows += rowCount;
+        uint64_t skipped{std::min<uint64_t>(blockHeader.size() + 1, block.size())};
+        uint64_t length{block.size() - skipped};
+        if(length == 0) continue;
+        bool addNewline{block.back() != '\n'};
+        ranges.push_back({entry.offset + skipped, length, outputSize, addNewline});
+        outputSize += length + (addNewline ? 1 : 0);
+        totalRows += entry.rowCount;
+    }
 
-        if(filesProcessed % constants::system::FileProgressInterval == 0){
-            fmt::println("merged {} files ({} rows)", filesProcessed, totalRows);
+    if(compression::codecOf(outputFilePath) != compression::Codec::None){
+        // compressed output goes through the block compressor, still without parsing
+        compression::OutputFile out{outputFilePath};
+        out << header;
+        for(const auto &range : ranges){
+            out.write(input->data() + range.source, static_cast<std::streamsize>(range.length));
+            if(range.addNewline) out << '\n';
         }
+        if(!out.close()) return;
+        fmt::println("done:  {} segments, {} total rows in {}", segments.size(), totalRows, outputFilePath);
+        return;
     }
 
-    fmt::println("done:  {} files, {} total rows in {}", filesProcessed, totalRows, outputFilePath);
+    int source{::open(inputContainerPath.c_str(), O_RDONLY | O_CLOEXEC)};
+    int output{::open(outputFilePath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)};
+    if(source < 0 || output < 0){
+        fmt::println("[!!! could not open {} or {} !!!]", inputContainerPath, outputFilePath);
+        if(source >= 0) ::close(source);
+        if(output >= 0) ::close(output);
+        return;
+    }
+
+    // a preallocated file with holes must not pass for a merge
+    auto removeOutput{[&](){
+        std::error_code error;
+        std::filesystem::remove(outputFilePath, error);
+    }};
+
+    // reserve the whole file so workers write into disjoint preallocated ranges
+    if(::posix_fallocate(output, 0, static_cast<off_t>(outputSize)) != 0 && ::ftruncate(output, static_cast<off_t>(outputSize)) != 0){
+        fmt::println("[!!! could not size {} to {} bytes, nothing is merged !!!]", outputFilePath, outputSize);
+        ::close(source);
+        ::close(output);
+        removeOutput();
+        return;
+    }
+
+    bool headerCopied{::pwrite(output, header.data(), header.size(), 0) == static_cast<ssize_t>(header.size())};
+    std::atomic<size_t> failedRanges{headerCopied ? 0u : 1u};
+    std::atomic<size_t> rangesCopied{0};
+    utilities::parallelFor(ranges.size(), constants::system::ThreadCount, [&](size_t i){
+        if(!_::copyRange(source, output, input->data(), ranges[i])) failedRanges++;
+        if(++rangesCopied % constants::system::SegmentProgressInterval == 0){
+            fmt::println("merged {} segments", rangesCopied.load());
+        }
+    });
+
+    ::close(source);
+    if(::close(output) != 0 && failedRanges == 0) failedRanges++;
+
+    if(failedRanges > 0){
+        fmt::println("[!!! {} segments could not be written to {}, the incomplete file is removed !!!]", failedRanges.load(), outputFilePath);
+        removeOutput();
+        return;
+    }
+    fmt::println("done:  {} segments, {} total rows, {} bytes in {}", segments.size(), totalRows, outputSize, outputFilePath);
 }
@@ -1,116 +1,139 @@
 #pragma once
 
-#include <csv2/reader.hpp>
 #include <string>
 #include <vector>
 #include <algorithm>
-#include <filesystem>
-#include <fstream>
-#include <fmt/core.h>
+#include <atomic>
+#include <cstdlib>
+#include <map>
+#include <memory_resource>
+#include <sstream>
 #include <unordered_map>
+#include <fmt/core.h>
 
 #include "constants.hpp"
+#include "compressed_io.hpp"
+#include "csv_tokenizer.hpp"
+#include "perf_counters.hpp"
+#include "segment_container.hpp"
+#include "station_blend.hpp"
 #include "utilities.hpp"
+#include "weather_store.hpp"
 
 namespace _{
 
-    struct WeatherRecord{
-        units::Timestamp timestamp;
-        std::vector<std::string> fields;
+    // what the split stage decided per segment, read back from the segment index
+    struct SegmentWeather{
+        int stationId;
+        weather::Blend blend;
     };
 
-} // namespace _
-
-inline void mergeWeather(
-    const std::string &weatherCsvPath,
-    const std::string &trafficLocationDirectory,
-    const std::string &outputDirectory
-){
-    fmt::println("loading weather: {}", weatherCsvPath);
-
-    csv2::Reader<
-        csv2::delimiter<','>, 
-        csv2::quote_character<'"'>, 
-        csv2::first_row_is_header<true>,
-        csv2::trim_policy::trim_whitespace
-    > weatherCsv;
-
-    weatherCsv.mmap(weatherCsvPath);
-
-    std::vector<std::string> weatherHeader;
-    for(const auto &cell : weatherCsv.header()){
-        std::string value;
-        cell.read_value(value);
-        weatherHeader.push_back(value);
-    }
-
-    size_t locationIdIndex{utilities::findColumn(weatherHeader, constants::column_names::LocationId)};
-    size_t timeIndex{utilities::findColumn(weatherHeader, constants::column_names::Time)};
+    inline std::unordered_map<std::string, SegmentWeather> loadSegmentWeather(const std::string &segmentIndexPath){
+        std::unordered_map<std::string, SegmentWeather> segments;
+        tokenizer::Reader csv;
+        auto input{compression::open(csv, segmentIndexPath)};
+        if(!input) return segments;
 
-    // group weather by station ID
-    std::unordered_map<int, std::vector<_::WeatherRecord>> weatherByStation;
-    size_t weatherRowCount{0};
-
-    for(const auto &row : weatherCsv){
-        weatherRowCount++;
-        if(weatherRowCount % constants::system::RowProgressInterval == 0){
-            fmt::println("loaded {} weather records", weatherRowCount);
-        }
-
-        std::vector<std::string> fields;
-        for(const auto &cell : row){
+        std::vector<std::string> header;
+        for(const auto &cell : csv.header()){
             std::string value;
             cell.read_value(value);
-            fields.push_back(value);
+            header.push_back(value);
         }
 
-        size_t requiredSize{std::max(locationIdIndex, timeIndex) + 1};
-        if(fields.size() < requiredSize){
-            fmt::println(
-                "[!!! row {} has only {} columns when it should have {}, skipping... !!!]", 
-                weatherRowCount, fields.size(), requiredSize
-            );
-            continue;
+        size_t segmentIndex{utilities::findColumn(header, constants::column_names::SegmentId)};
+        size_t stationIndex{utilities::findColumn(header, constants::column_names::WeatherStationId)};
+        size_t blendStationsIndex{utilities::findColumn(header, constants::column_names::BlendStationIds)};
+        size_t blendWeightsIndex{utilities::findColumn(header, constants::column_names::BlendWeights)};
+        bool hasBlends{blendStationsIndex != 0 && blendWeightsIndex != 0};
+        if(stationIndex == 0) return segments;
+
+        for(const auto &row : csv){
+            if(row.size() <= std::max({segmentIndex, stationIndex, blendStationsIndex, blendWeightsIndex})) continue;
+            SegmentWeather segment{std::atoi(std::string{row[stationIndex].view()}.c_str()), {}};
+            if(hasBlends) segment.blend = weather::parseBlend(row[blendStationsIndex].view(), row[blendWeightsIndex].view());
+            segments.emplace(row[segmentIndex].view(), std::move(segment));
         }
+        return segments;
+    }
 
-        int locationId{std::stoi(fields[locationIdIndex])};
-        units::Timestamp timestamp{utilities::parseTimestamp(fields[timeIndex])};
+    // work units of segment positions. station-major: each unit is a run of one
+    // station's segments, so a worker joins them back to back while that
+    // station's series is in cache. large stations are cut so the units still
+    // spread over the workers, and the biggest units are handed out first
+    inline std::vector<std::vector<size_t>> stationSchedule(
+        const std::vector<container::Entry> &segments,
+        const std::unordered_map<std::string, SegmentWeather> &segmentWeather
+    ){
+        std::vector<std::vector<size_t>> units;
+        if(!constants::weather::StationLocalSchedule || segmentWeather.empty()){
+            for(size_t segment{0}; segment < segments.size(); segment++) units.push_back({segment});
+            return units;
+        }
 
-        weatherByStation[locationId].push_back({timestamp, fields});
-    }
+        std::map<int, std::vector<size_t>> stations;
+        for(size_t segment{0}; segment < segments.size(); segment++){
+            auto found{segmentWeather.find(segments[segment].segmentId)};
+            stations[found == segmentWeather.end() ? -1 : found->second.stationId].push_back(segment);
+        }
 
-    fmt::println("loaded {} weather records for {} stations", weatherRowCount, weatherByStation.size());
+        size_t workerCount{utilities::resolveThreadCount(constants::system::ThreadCount)};
+        size_t unitSize{std::max<size_t>(1, (segments.size() + 2 * workerCount - 1) / (2 * workerCount))};
+        for(const auto &[stationId, stationSegments] : stations){
+            for(size_t first{0}; first < stationSegments.size(); first += unitSize){
+                size_t last{std::min(first + unitSize, stationSegments.size())};
+                units.emplace_back(stationSegments.begin() + first, stationSegments.begin() + last);
+            }
+        }
 
-    // sort weather records by time
-    for(auto &[stationId, records] : weatherByStation){
-        std::sort(records.begin(), records.end(), [](const _::WeatherRecord &left, const _::WeatherRecord &right){
-            return left.timestamp < right.timestamp;
+        auto rowCount{[&](const std::vector<size_t> &unit){
+            uint64_t rows{0};
+            for(size_t segment : unit) rows += segments[segment].rowCount;
+            return rows;
+        }};
+        std::stable_sort(units.begin(), units.end(), [&](const auto &left, const auto &right){
+            return rowCount(left) > rowCount(right);
         });
+        return units;
     }
 
-    std::vector<std::filesystem::path> trafficFiles;
-    for(const auto &entry : std::filesystem::directory_iterator(trafficLocationDirectory)){
-        if(entry.is_regular_file() && entry.path().extension() == ".csv"){
-            trafficFiles.push_back(entry.path());
-        }
-    }
+} // namespace _
 
-    fmt::println("found {} traffic files", trafficFiles.size());
+inline void mergeWeather(
+    const std::string &weatherCsvPath,
+    const std::string &weatherIndexPath,
+    const std::string &segmentIndexPath,
+    const std::string &trafficContainerPath,
+    const std::string &outputContainerPath
+){
+    weather::Store weatherStore{weather::load(weatherCsvPath, weatherIndexPath)};
+    const std::vector<std::string> &weatherHeader{weatherStore.header()};
+    weatherStore.cacheSuffixes();
+
+    // station and blend per segment, for scheduling and for segments blended from
+    // several stations (the rest copy their station's cached suffix)
+    std::unordered_map<std::string, _::SegmentWeather> segmentWeather{_::loadSegmentWeather(segmentIndexPath)};
+    if(segmentWeather.empty()){
+        fmt::println("[!!! no segment index at {}, joining in container order with the nearest station only !!!]", segmentIndexPath);
+    }else if(constants::weather::BlendStationCount > 1){
+        fmt::println("blending weather from up to {} stations per segment", constants::weather::BlendStationCount);
+    }
 
-    std::filesystem::create_directories(outputDirectory);
+    auto input{container::Reader::open(trafficContainerPath)};
+    if(!input) return;
+    const auto &segments{input->entries()};
 
-    size_t fileCount{0};
-    for(const auto &trafficFile : trafficFiles){
-        fileCount++;
+    fmt::println("found {} traffic segments", segments.size());
 
-        csv2::Reader<
-            csv2::delimiter<','>, 
-            csv2::quote_character<'"'>, 
-            csv2::first_row_is_header<true>,
-            csv2::trim_policy::trim_whitespace
-        > trafficCsv;
+    // the joined container is the one queries read, so it carries zone maps
+    container::Writer writer{outputContainerPath, container::ZoneMaps::Build};
 
-        trafficCsv.mmap(trafficFile.string());
+    // the weather store and its suffix cache are shared read-only by every worker
+    std::atomic<size_t> segmentCount{0};
+    utilities::ArenaPool arenas;
+    auto joinSegment{[&](const container::Entry &entry){
+        tokenizer::Reader trafficCsv;
+        trafficCsv.parse(input->block(entry));
 
         std::vector<std::string> trafficHeader;
         for(const auto &cell : trafficCsv.header()){
@@ -126,41 +149,42 @@ inline void mergeWeather(
         size_t hourIndex        {utilities::findColumn(trafficHeader, constants::column_names::Hour)};
         size_t minuteIndex      {utilities::findColumn(trafficHeader, constants::column_names::Minute)};
 
-        std::vector<std::vector<std::string>> trafficRows;
+        // the segment's cells live in the worker's arena, released with one reset
+        auto arena{arenas.acquire()};
+        std::pmr::vector<std::pmr::vector<std::pmr::string>> trafficRows{arena.resource()};
+        trafficRows.reserve(entry.rowCount);
         int stationId{0};
 
         for(const auto &row : trafficCsv){
-            std::vector<std::string> fields;
+            std::pmr::vector<std::pmr::string> fields{arena.resource()};
+            fields.reserve(row.size());
             for(const auto &cell : row){
-                std::string value;
-                cell.read_value(value);
-                fields.push_back(value);
+                cell.read_value(fields.emplace_back());
             }
 
             size_t requiredSize{std::max({stationIdIndex, yearIndex, monthIndex, dayIndex, hourIndex, minuteIndex}) + 1};
 
             if(fields.size() < requiredSize) continue;
-            if(stationId == 0) stationId = std::stoi(fields[stationIdIndex]);
+            if(stationId == 0) stationId = utilities::toInt(fields[stationIdIndex]);
 
-            trafficRows.push_back(fields);
+            trafficRows.push_back(std::move(fields));
         }
 
         if(trafficRows.empty()){
-            continue;
+            return;
         }
 
-        auto &weatherRecords{weatherByStation[stationId]};
+        weather::Series weatherRecords{weatherStore.series(stationId)};
 
         if(weatherRecords.empty()){
             fmt::println(
-                "[!!! no weather data for station {}, skipping file {}... !!!]", 
-                stationId, trafficFile.filename().string()
+                "[!!! no weather data for station {}, skipping segment {}... !!!]", 
+                stationId, entry.segmentId
             );
-            continue;
+            return;
         }
 
-        std::filesystem::path outputPath{std::filesystem::path(outputDirectory) / trafficFile.filename()};
-        std::ofstream out{outputPath};
+        std::ostringstream out;
 
         for(size_t i{0}; i < trafficHeader.size(); i++){
             if(i > 0) out << ',';
@@ -171,31 +195,48 @@ inline void mergeWeather(
         }
         out << '\n';
 
+        // the other stations of a blend, each with its own forward cursor
+        const weather::Blend *blend{nullptr};
+        if(auto found{segmentWeather.find(entry.segmentId)}; found != segmentWeather.end() && found->second.blend.size() > 1){
+            blend = &found->second.blend;
+        }
+        std::vector<weather::Series> blendRecords;
+        std::vector<size_t> blendCursors;
+        std::vector<const float *> blendInputs;
+        std::vector<float> blendWeights;
+        std::vector<float> blended(weatherHeader.size());
+        std::string weatherFields;
+        if(blend){
+            for(size_t i{1}; i < blend->size(); i++) blendRecords.push_back(weatherStore.series((*blend)[i].stationId));
+            blendCursors.assign(blendRecords.size(), 0);
+        }
+
         size_t weatherIndex{0};
         size_t skippedRowCount{0};
         for(const auto &trafficFields : trafficRows){
             units::Timestamp trafficTime;
-            trafficTime.year    = std::stoi(trafficFields[yearIndex]);
-            trafficTime.month   = std::stoi(trafficFields[monthIndex]);
-            trafficTime.day     = std::stoi(trafficFields[dayIndex]);
-            trafficTime.hour    = std::stoi(trafficFields[hourIndex]);
-            trafficTime.minute  = std::stoi(trafficFields[minuteIndex]);
+            trafficTime.year    = utilities::toInt(trafficFields[yearIndex]);
+            trafficTime.month   = utilities::toInt(trafficFields[monthIndex]);
+            trafficTime.day     = utilities::toInt(trafficFields[dayIndex]);
+            trafficTime.hour    = utilities::toInt(trafficFields[hourIndex]);
+            trafficTime.minute  = utilities::toInt(trafficFields[minuteIndex]);
 
             // find matching weather record with a simple linear search since there are only 13 station
-            while(weatherIndex < weatherRecords.size() && weatherRecords[weatherIndex].timestamp < trafficTime){
+            int trafficMinute{trafficTime.toEpochMinutes()};
+            while(weatherIndex < weatherRecords.count && weatherRecords.minutes[weatherIndex] < trafficMinute){
                 weatherIndex++;
             }
-            if(weatherIndex >= weatherRecords.size()){
-                weatherIndex = weatherRecords.size() - 1;
+            if(weatherIndex >= weatherRecords.count){
+                weatherIndex = weatherRecords.count - 1;
             }
 
-            int timeDifferenceMinutes{trafficTime.absoluteDifferenceInMinutes(weatherRecords[weatherIndex].timestamp)};
+            int timeDifferenceMinutes{std::abs(weatherRecords.minutes[weatherIndex] - trafficMinute)};
             if(timeDifferenceMinutes > constants::system::MaxWeatherTimeDifferenceMinutes){
                 skippedRowCount++;
                 if(skippedRowCount <= constants::system::MaxSkippedRowWarnings){
                     fmt::println(
-                        "[!!! weather data is {} minutes away from traffic data for file {}, skipping row... !!!]",
-                        timeDifferenceMinutes, trafficFile.filename().string()
+                        "[!!! weather data is {} minutes away from traffic data for segment {}, skipping row... !!!]",
+                        timeDifferenceMinutes, entry.segmentId
                     );
                 }
                 continue;
@@ -206,24 +247,67 @@ inline void mergeWeather(
                 out << trafficFields[i];
             }
 
-            const auto &weatherFields{weatherRecords[weatherIndex].fields};
-            for(const auto &field : weatherFields){
-                out << ',' << field;
+            if(!blend){
+                out << weatherStore.suffix(weatherRecords, weatherIndex) << '\n';
+                continue;
+            }
+
+            // the nearest station decided the row above, the others join when they have a close enough record
+            blendInputs.assign(1, weatherRecords.row(weatherIndex));
+            blendWeights.assign(1, blend->front().weight);
+            for(size_t i{0}; i < blendRecords.size(); i++){
+                const weather::Series &records{blendRecords[i]};
+                if(records.empty()) continue;
+                size_t &cursor{blendCursors[i]};
+                while(cursor < records.count && records.minutes[cursor] < trafficMinute) cursor++;
+                size_t index{std::min(cursor, records.count - 1)};
+                if(std::abs(records.minutes[index] - trafficMinute) > constants::system::MaxWeatherTimeDifferenceMinutes) continue;
+                blendInputs.push_back(records.row(index));
+                blendWeights.push_back((*blend)[i + 1].weight);
             }
-            out << '\n';
+            weather::blendRows(blendInputs.data(), blendWeights.data(), blendInputs.size(), blended.size(), blended.data());
+
+            weatherFields.clear();
+            weatherStore.appendValues(weatherFields, stationId, weatherRecords.minutes[weatherIndex], blended.data());
+            out << weatherFields << '\n';
         }
 
         if(skippedRowCount > 0){
             fmt::println(
-                "[!!! skipped {} rows in file {} due to weather data being more than 2 hours away !!!]",
-                skippedRowCount, trafficFile.filename().string()
+                "[!!! skipped {} rows in segment {} due to weather data being more than 2 hours away !!!]",
+                skippedRowCount, entry.segmentId
             );
         }
 
-        if(fileCount % constants::system::FileProgressInterval == 0){
-            fmt::println("merged {} files", fileCount);
+        // dropped rows only narrow the range, so the input's bounds still hold
+        writer.append(entry.segmentId, out.str(), trafficRows.size() - skippedRowCount, entry.firstMinute, entry.lastMinute);
+
+        if(++segmentCount % constants::system::FileProgressInterval == 0){
+            fmt::println("merged {} segments", segmentCount.load());
         }
+    }};
+
+    std::vector<std::vector<size_t>> units{_::stationSchedule(segments, segmentWeather)};
+    fmt::println(
+        "joining in {} work units ({} scheduling)",
+        units.size(), constants::weather::StationLocalSchedule && !segmentWeather.empty() ? "station-major" : "container order"
+    );
+
+    utilities::CacheCounters cacheCounters;
+    cacheCounters.start();
+    utilities::parallelFor(units.size(), constants::system::ThreadCount, [&](size_t unit){
+        for(size_t segment : units[unit]) joinSegment(segments[segment]);
+    });
+    if(!writer.finish()) return;
+
+    if(auto cache{cacheCounters.stop()}){
+        fmt::println(
+            "join cache misses: {} of {} references ({:.2f}%)",
+            cache->misses, cache->references, 100.0 * cache->missRate()
+        );
+    }else{
+        fmt::println("join cache misses: hardware counters unavailable");
     }
 
-    fmt::println("done: merged {} files in {}", fileCount, outputDirectory);
+    fmt::println("done: merged {} segments in {}", segmentCount.load(), outputContainerPath);
 }
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace utilities{
+
+    // last level cache references and misses of this process, including threads
+    // started and joined while counting, via perf_event_open. without a pmu or
+    // with a restrictive perf_event_paranoid the counters are just unavailable
+    class CacheCounters{
+    public:
+        struct Reading{
+            uint64_t references;
+            uint64_t misses;
+
+            double missRate() const{ return references > 0 ? static_cast<double>(misses) / static_cast<double>(references) : 0.0; }
+        };
+
+        CacheCounters()
+            : references_{open(PERF_COUNT_HW_CACHE_REFERENCES)}
+            , misses_{open(PERF_COUNT_HW_CACHE_MISSES)}
+        {}
+
+        CacheCounters(const CacheCounters &) = delete;
+        CacheCounters &operator=(const CacheCounters &) = delete;
+
+        ~CacheCounters(){
+            if(references_ >= 0) ::close(references_);
+            if(misses_ >= 0) ::close(misses_);
+        }
+
+        bool available() const{ return references_ >= 0 && misses_ >= 0; }
+
+        void start(){
+            if(!available()) return;
+            for(int counter : {references_, misses_}){
+                ::ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+                ::ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+
+        std::optional<Reading> stop(){
+            if(!available()) return std::nullopt;
+            Reading reading{0, 0};
+            ::ioctl(references_, PERF_EVENT_IOC_DISABLE, 0);
+            ::ioctl(misses_, PERF_EVENT_IOC_DISABLE, 0);
+            if(::read(references_, &reading.references, sizeof(uint64_t)) != sizeof(uint64_t)) return std::nullopt;
+            if(::read(misses_, &reading.misses, sizeof(uint64_t)) != sizeof(uint64_t)) return std::nullopt;
+            return reading;
+        }
+
+    private:
+        static int open(uint64_t config){
+            perf_event_attr attributes{};
+            attributes.size             = sizeof(attributes);
+            attributes.type             = PERF_TYPE_HARDWARE;
+            attributes.config           = config;
+            attributes.disabled         = 1;
+            attributes.inherit          = 1;    // worker threads add their counts when they exit
+            attributes.exclude_kernel   = 1;
+            attributes.exclude_hv       = 1;
+            return static_cast<int>(::syscall(SYS_perf_event_open, &attributes, 0, -1, -1, 0));
+        }
+
+        int references_;
+        int misses_;
+    };
+
+} // namespace utilities
@@ -0,0 +1,438 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <fmt/core.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "constants.hpp"
+#include "units.hpp"
+#include "utilities.hpp"
+
+namespace regression{
+
+    struct StageSample{
+        std::string stage;
+        double seconds{0.0};
+        double peakMiB{0.0};    // peak resident set while the stage ran
+    };
+
+    using StageLog = std::vector<StageSample>;
+
+    namespace _{
+
+        // VmHWM, the peak resident set of the process
+        inline double peakMemoryMiB(){
+            std::ifstream status{"/proc/self/status"};
+            std::string line;
+            while(std::getline(status, line)){
+                if(line.rfind("VmHWM:", 0) != 0) continue;
+                return std::strtod(line.c_str() + 6, nullptr) / 1024.0;
+            }
+            return 0.0;
+        }
+
+        // restarts VmHWM at the current resident set. without it (old kernels,
+        // no procfs) every stage reports the peak of the whole run so far
+        inline void resetPeakMemory(){
+            int descriptor{::open("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC)};
+            if(descriptor < 0) return;
+            [[maybe_unused]] auto written{::write(descriptor, "5", 1)};
+            ::close(descriptor);
+        }
+
+        // the stage messages of a measured run go to a log instead of the report
+        class StdoutToFile{
+        public:
+            StdoutToFile(const std::string &path, bool append){
+                std::fflush(stdout);
+                saved_ = ::dup(STDOUT_FILENO);
+                int descriptor{::open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC), 0644)};
+                if(descriptor < 0) return;
+                ::dup2(descriptor, STDOUT_FILENO);
+                ::close(descriptor);
+            }
+
+            StdoutToFile(const StdoutToFile &) = delete;
+            StdoutToFile &operator=(const StdoutToFile &) = delete;
+
+            ~StdoutToFile(){
+                std::fflush(stdout);
+                if(saved_ < 0) return;
+                ::dup2(saved_, STDOUT_FILENO);
+                ::close(saved_);
+            }
+
+        private:
+            int saved_{-1};
+        };
+
+        // runs the stages inside a directory and goes back to the previous one
+        // however the scope is left, a stage may throw into an embedding host
+        class WorkingDirectory{
+        public:
+            explicit WorkingDirectory(const std::filesystem::path &directory)
+                : previous_{std::filesystem::current_path()}
+            {
+                std::filesystem::current_path(directory);
+            }
+
+            WorkingDirectory(const WorkingDirectory &) = delete;
+            WorkingDirectory &operator=(const WorkingDirectory &) = delete;
+
+            ~WorkingDirectory(){
+                std::error_code error;
+                std::filesystem::current_path(previous_, error);
+            }
+
+        private:
+            std::filesystem::path previous_;
+        };
+
+        inline bool writeFile(const std::string &path, const std::string &text){
+            std::ofstream out{path, std::ios::binary};
+            out.write(text.data(), static_cast<std::streamsize>(text.size()));
+            return out.good();
+        }
+
+        // traffic counts of Segments segments every ObservationMinutes for Days
+        // days, in shuffled order, and hourly weather of every station. only
+        // integers and the seeded generator go into it, so every machine writes
+        // the same bytes
+        inline bool generateDataset(const std::string &trafficPath, const std::string &weatherPath){
+            using namespace constants::regression;
+
+            std::mt19937_64 random{Seed};
+            constexpr std::array<const char *, 5> boroughs{"Manhattan", "Bronx", "Brooklyn", "Queens", "Staten Island"};
+            // the last street matches no road group, so the split stage drops it
+            constexpr std::array<const char *, 6> streets{"BELT PARKWAY", "SHORE PARKWAY", "BROOKLYN QUEENS EXPWY", "CROSS BRONX EXPWY", "MAJOR DEEGAN EXPWY", "BROADWAY"};
+            constexpr std::array<const char *, 4> directions{"NB", "SB", "EB", "WB"};
+            constexpr std::array<int, 24> hourlyVolume{40, 25, 20, 20, 35, 80, 180, 320, 380, 300, 240, 230, 240, 250, 270, 320, 380, 400, 330, 240, 170, 130, 90, 60};
+
+            struct Observation{
+                uint32_t segment;
+                int32_t minute;     // since the start of the dataset
+            };
+            int32_t observationsPerSegment{Days * 1440 / ObservationMinutes};
+            std::vector<Observation> observations;
+            observations.reserve(Segments * static_cast<size_t>(observationsPerSegment));
+            for(uint32_t segment{0}; segment < Segments; segment++){
+                for(int32_t observation{0}; observation < observationsPerSegment; observation++){
+                    observations.push_back({segment, observation * ObservationMinutes});
+                }
+            }
+            for(size_t i{observations.size() - 1}; i > 0; i--){
+                std::swap(observations[i], observations[random() % (i + 1)]);
+            }
+
+            struct SyntheticSegment{
+                int base;
+                int latitude;       // micro degrees
+                int longitude;
+            };
+            std::vector<SyntheticSegment> segments;
+            for(size_t segment{0}; segment < Segments; segment++){
+                segments.push_back({
+                    static_cast<int>(random() % 200),
+                    40500000 + static_cast<int>(random() % 400000),
+                    -74250000 + static_cast<int>(random() % 500000)
+                });
+            }
+
+            int32_t start{units::Timestamp{StartYear, 1, 1, 0, 0}.toEpochMinutes()};
+            std::string text{"RequestID,Boro,Yr,M,D,HH,MM,volume,SegmentID,street,fromSt,toSt,direction,latitude,longitude\n"};
+            for(const auto &[segment, minute] : observations){
+                const SyntheticSegment &synthetic{segments[segment]};
+                auto time{units::Timestamp::fromEpochMinutes(start + minute)};
+                fmt::format_to(
+                    std::back_inserter(text),
+                    "{},{},{},{},{},{},{},{},{},{},A,B,{},{}.{:06},-{}.{:06}\n",
+                    segment * static_cast<uint32_t>(Days) + static_cast<uint32_t>(minute / 1440),
+                    boroughs[segment % boroughs.size()],
+                    time.year, time.month, time.day, time.hour, time.minute,
+                    synthetic.base + hourlyVolume[time.hour] + static_cast<int>(random() % 50),
+                    1000 + segment,
+                    streets[segment % streets.size()],
+                    directions[segment % directions.size()],
+                    synthetic.latitude / 1000000, synthetic.latitude % 1000000,
+                    -synthetic.longitude / 1000000, -synthetic.longitude % 1000000
+                );
+            }
+            if(!writeFile(trafficPath, text)) return false;
+
+            text = "location_id,time,temperature_2m (°C),relative_humidity_2m (%),precipitation (mm),rain (mm)\n";
+            for(const auto &station : constants::weather::weatherStations()){
+                for(int32_t hour{0}; hour < (Days + 1) * 24; hour++){
+                    auto time{units::Timestamp::fromEpochMinutes(start + hour * 60)};
+                    // drawn one by one, the evaluation order of arguments is unspecified
+                    int temperatureTenths{static_cast<int>(random() % 300) - 50};
+                    int humidity{20 + static_cast<int>(random() % 80)};
+                    int rainTenths{random() % 5 == 0 ? static_cast<int>(random() % 40) : 0};
+                    fmt::format_to(
+                        std::back_inserter(text),
+                        "{},{}-{:02}-{:02}T{:02}:00,{:.1f},{},{:.1f},{:.1f}\n",
+                        station.id, time.year, time.month, time.day, time.hour,
+                        temperatureTenths / 10.0, humidity, rainTenths / 10.0, rainTenths / 10.0
+                    );
+                }
+            }
+            return writeFile(weatherPath, text);
+        }
+
+        inline std::string checksumOf(const std::filesystem::path &path){
+            auto file{utilities::MappedFile::open(path.string())};
+            static const char empty{0};
+            return fmt::format("{:016x}", file ? utilities::hashBytes(file->data(), file->size()) : utilities::hashBytes(&empty, 0));
+        }
+
+        // the generated inputs and every final output, keyed by their path in the work directory
+        inline std::map<std::string, std::string> checksums(const std::vector<std::string> &inputs){
+            std::map<std::string, std::string> sums;
+            for(const auto &input : inputs) sums[std::filesystem::path{input}.lexically_normal().string()] = checksumOf(input);
+            // containers and the weather index are intermediate, the outputs cover them
+            std::filesystem::path outputDirectory{std::filesystem::path{constants::paths::FinalOutput}.parent_path()};
+            for(const auto &entry : std::filesystem::directory_iterator{outputDirectory}){
+                std::string extension{entry.path().extension().string()};
+                if(!entry.is_regular_file() || extension == ".seg" || extension == ".idx") continue;
+                sums[entry.path().lexically_normal().string()] = checksumOf(entry.path());
+            }
+            return sums;
+        }
+
+        struct Baseline{
+            std::map<std::string, StageSample> stages;
+            std::map<std::string, std::string> checksums;
+        };
+
+        // "stage <name> <seconds> <peak MiB>" and "checksum <path> <hex>" lines, # starts a comment
+        inline std::optional<Baseline> loadBaseline(const std::string &path){
+            std::ifstream in{path};
+            if(!in) return std::nullopt;
+            Baseline baseline;
+            std::string line;
+            while(std::getline(in, line)){
+                std::istringstream fields{line};
+                std::string kind;
+                if(!(fields >> kind) || kind[0] == '#') continue;
+                if(kind == "stage"){
+                    StageSample sample;
+                    if(fields >> sample.stage >> sample.seconds >> sample.peakMiB) baseline.stages[sample.stage] = sample;
+                }else if(kind == "checksum"){
+                    std::string file, sum;
+                    if(fields >> file >> sum) baseline.checksums[file] = sum;
+                }
+            }
+            return baseline;
+        }
+
+        inline bool saveBaseline(const std::string &path, const StageLog &stages, const std::map<std::string, std::string> &checksums){
+            std::string text{fmt::format(
+                "# joiner perf baseline: best of {} runs of the pipeline on the generated dataset with {} worker thread(s)\n"
+                "# refresh with `joiner perf --update <this file>` after an intended change\n",
+                constants::regression::Repetitions, constants::regression::ThreadCount
+            )};
+            for(const auto &sample : stages) text += fmt::format("stage {} {:.3f} {:.1f}\n", sample.stage, sample.seconds, sample.peakMiB);
+            for(const auto &[file, sum] : checksums) text += fmt::format("checksum {} {}\n", file, sum);
+            std::filesystem::path baselinePath{path};
+            if(baselinePath.has_parent_path()) std::filesystem::create_directories(baselinePath.parent_path());
+            return writeFile(path, text);
+        }
+
+        // keeps the fastest time and the smallest peak of every stage, in first run order
+        inline void keepBest(StageLog &best, const StageLog &run){
+            for(const auto &sample : run){
+                auto found{std::find_if(best.begin(), best.end(), [&](const StageSample &kept){ return kept.stage == sample.stage; })};
+                if(found == best.end()){
+                    best.push_back(sample);
+                    continue;
+                }
+                found->seconds = std::min(found->seconds, sample.seconds);
+                found->peakMiB = std::min(found->peakMiB, sample.peakMiB);
+            }
+        }
+
+        inline double change(double value, double baseline){
+            return baseline > 0.0 ? 100.0 * (value - baseline) / baseline : 0.0;
+        }
+
+    } // namespace _
+
+    // times a pipeline stage and records its peak memory into log, when there is one
+    class StageTimer{
+    public:
+        StageTimer(StageLog *log, const char *stage)
+            : log_{log}
+            , stage_{stage}
+        {
+            if(log_ == nullptr) return;
+            _::resetPeakMemory();
+            start_ = std::chrono::steady_clock::now();
+        }
+
+        StageTimer(const StageTimer &) = delete;
+        StageTimer &operator=(const StageTimer &) = delete;
+
+        ~StageTimer(){
+            if(log_ == nullptr) return;
+            double seconds{std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count()};
+            log_->push_back({stage_, seconds, _::peakMemoryMiB()});
+        }
+
+    private:
+        StageLog *log_;
+        const char *stage_;
+        std::chrono::steady_clock::time_point start_;
+    };
+
+    // the generated dataset as TrafficInput and WeatherInput under directory,
+    // with the output directory next to them, for runs that have no real data
+    inline bool writeDataset(const std::filesystem::path &directory){
+        std::filesystem::path trafficPath{(directory / constants::paths::TrafficInput).lexically_normal()};
+        std::filesystem::path weatherPath{(directory / constants::paths::WeatherInput).lexically_normal()};
+        std::filesystem::path outputDirectory{(directory / constants::paths::FinalOutput).lexically_normal().parent_path()};
+        for(const auto &path : {trafficPath.parent_path(), weatherPath.parent_path(), outputDirectory}){
+            std::filesystem::create_directories(path);
+        }
+        return _::generateDataset(trafficPath.string(), weatherPath.string());
+    }
+
+    // joiner perf [--update] [--timing] [baseline]: runs pipeline on the
+    // generated dataset in PerfWorkDirectory with ThreadCount workers and
+    // compares checksums of its outputs with the baseline. --timing also runs
+    // it Repetitions times and fails on a stage slower or bigger than the
+    // tolerances allow, which only means something on the machine that
+    // recorded the baseline. --update measures and records a new baseline
+    inline int runRegression(const std::vector<std::string> &arguments, const std::function<void(StageLog &)> &pipeline){
+        using namespace constants::regression;
+
+        bool update{false};
+        bool timing{false};
+        std::string baselinePath{constants::paths::PerfBaseline};
+        for(const auto &argument : arguments){
+            if(argument == "--update") update = true;
+            else if(argument == "--timing") timing = true;
+            else baselinePath = argument;
+        }
+        timing = timing || update;
+        baselinePath = std::filesystem::absolute(baselinePath).lexically_normal().string();
+
+        std::filesystem::path workDirectory{std::filesystem::absolute(constants::paths::PerfWorkDirectory).lexically_normal()};
+        fmt::println("generating {} segments x {} days in {}...", Segments, Days, workDirectory.string());
+        if(!writeDataset(workDirectory)){
+            fmt::println("[!!! could not write the dataset to {} !!!]", workDirectory.string());
+            return 1;
+        }
+
+        StageLog best;
+        std::map<std::string, std::string> checksums;
+        {
+            // the stages use the relative paths of constants::paths, so they run inside the work directory
+            _::WorkingDirectory inside{workDirectory};
+            utilities::ThreadCountPin pin{ThreadCount};
+
+            std::vector<std::string> inputs{constants::paths::TrafficInput, constants::paths::WeatherInput};
+            std::filesystem::path outputDirectory{std::filesystem::path{constants::paths::FinalOutput}.parent_path()};
+            size_t runs{timing ? std::max<size_t>(1, Repetitions) : 1};
+            for(size_t run{0}; run < runs; run++){
+                // every run starts from nothing, a persisted weather index would skip its build
+                std::filesystem::remove_all(outputDirectory);
+                std::filesystem::create_directories(outputDirectory);
+
+                StageLog log;
+                auto start{std::chrono::steady_clock::now()};
+                {
+                    _::StdoutToFile quiet{"pipeline.log", run > 0};
+                    pipeline(log);
+                }
+                double total{std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count()};
+                double peak{0.0};
+                for(const auto &sample : log) peak = std::max(peak, sample.peakMiB);
+                log.push_back({"total", total, peak});
+                _::keepBest(best, log);
+                fmt::println("run {}: {:.3f} s", run + 1, total);
+            }
+            checksums = _::checksums(inputs);
+        }
+
+        if(update){
+            if(!_::saveBaseline(baselinePath, best, checksums)){
+                fmt::println("[!!! could not write {} !!!]", baselinePath);
+                return 1;
+            }
+            fmt::println("recorded {} stages and {} checksums in {}", best.size(), checksums.size(), baselinePath);
+            return 0;
+        }
+
+        auto baseline{_::loadBaseline(baselinePath)};
+        if(!baseline){
+            fmt::println("[!!! no baseline at {}, record one with `joiner perf --update` !!!]", baselinePath);
+            return 1;
+        }
+
+        std::vector<std::string> failures;
+        if(timing){
+            fmt::println("");
+            fmt::println("{:<16} {:>9} {:>9} {:>8} {:>9} {:>9} {:>8}", "stage", "seconds", "baseline", "change", "peak MiB", "baseline", "change");
+            for(const auto &sample : best){
+                auto found{baseline->stages.find(sample.stage)};
+                if(found == baseline->stages.end()){
+                    fmt::println("{:<16} {:>9.3f} {:>9} {:>8} {:>9.1f} {:>9} {:>8}", sample.stage, sample.seconds, "-", "new", sample.peakMiB, "-", "new");
+                    continue;
+                }
+                const StageSample &expected{found->second};
+                fmt::println(
+                    "{:<16} {:>9.3f} {:>9.3f} {:>+7.1f}% {:>9.1f} {:>9.1f} {:>+7.1f}%",
+                    sample.stage, sample.seconds, expected.seconds, _::change(sample.seconds, expected.seconds),
+                    sample.peakMiB, expected.peakMiB, _::change(sample.peakMiB, expected.peakMiB)
+                );
+                // times under MinimumSeconds are mostly timer and scheduler noise
+                if(sample.seconds > std::max(expected.seconds, MinimumSeconds) * (1.0 + TimeTolerance)){
+                    failures.push_back(fmt::format("{} took {:.3f} s, baseline {:.3f} s ({:+.1f}%, limit {:+.0f}%)",
+                        sample.stage, sample.seconds, expected.seconds, _::change(sample.seconds, expected.seconds), 100.0 * TimeTolerance));
+                }
+                if(sample.peakMiB > expected.peakMiB * (1.0 + MemoryTolerance)){
+                    failures.push_back(fmt::format("{} peaked at {:.1f} MiB, baseline {:.1f} MiB ({:+.1f}%, limit {:+.0f}%)",
+                        sample.stage, sample.peakMiB, expected.peakMiB, _::change(sample.peakMiB, expected.peakMiB), 100.0 * MemoryTolerance));
+                }
+            }
+        }
+        for(const auto &[stage, expected] : baseline->stages){
+            if(std::none_of(best.begin(), best.end(), [&](const StageSample &sample){ return sample.stage == stage; })){
+                failures.push_back(fmt::format("stage {} of the baseline did not run", stage));
+            }
+        }
+
+        for(const auto &[file, expected] : baseline->checksums){
+            auto found{checksums.find(file)};
+            if(found == checksums.end()) failures.push_back(fmt::format("{} was not written", file));
+            else if(found->second != expected) failures.push_back(fmt::format("{} checksum {} differs from {}", file, found->second, expected));
+        }
+        for(const auto &[file, sum] : checksums){
+            if(!baseline->checksums.contains(file)) fmt::println("{} is not in the baseline", file);
+        }
+
+        fmt::println("");
+        if(failures.empty()){
+            fmt::println("no regressions against {}", baselinePath);
+            return 0;
+        }
+        for(const auto &failure : failures) fmt::println("[!!! PERF REGRESSION: {} !!!]", failure);
+        fmt::println("[!!! {} regressions, stage messages are in {} !!!]", failures.size(), (workDirectory / "pipeline.log").string());
+        return 1;
+    }
+
+} // namespace regression
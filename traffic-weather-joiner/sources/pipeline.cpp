@@ -0,0 +1,271 @@
+#include "split_traffic.hpp"
+#include "sort_by_time.hpp"
+#include "aggregate_by_time.hpp"
+#include "merge_weather.hpp"
+#include "add_time_features.hpp"
+#include "assign_splits.hpp"
+#include "merge_split_data.hpp"
+#include "merge_by_time.hpp"
+#include "export_matrix.hpp"
+#include "train_models.hpp"
+#include "score_models.hpp"
+#include "prediction_server.hpp"
+#include "segment_query.hpp"
+#include "sharding.hpp"
+#include "tokenizer_benchmark.hpp"
+#include "perf_regression.hpp"
+
+#include "constants.hpp"
+#include "joiner.h"
+
+#include <string>
+
+// split through time features, every stage on the shard's own files
+void runSegmentStages(const sharding::Shard &shard, regression::StageLog *log = nullptr){
+    if(constants::flags::SplitData){
+        regression::StageTimer timer{log, "split"};
+        fmt::println("---Split traffic by segment---");
+        splitBySegmentId(
+            constants::paths::TrafficInput,
+            shard.path(constants::paths::TrafficByLocation),
+            shard.path(constants::paths::SegmentIndex),
+            shard
+        );
+        fmt::println("");
+    }
+
+    if(constants::flags::SortByTime){
+        regression::StageTimer timer{log, "sort"};
+        fmt::println("---Sort split data by time---");
+        sortByTime(
+            shard.path(constants::paths::TrafficByLocation),
+            shard.path(constants::paths::TrafficByLocationSorted)
+        );
+        fmt::println("");
+    }
+
+    if(constants::flags::AggregateByTime){
+        regression::StageTimer timer{log, "aggregate"};
+        fmt::println("---Aggregate into time buckets---");
+        aggregateByTime(
+            shard.path(constants::paths::TrafficByLocationSorted),
+            shard.path(constants::paths::TrafficAggregated)
+        );
+        fmt::println("");
+    }
+
+    if(constants::flags::MergeWeather){
+        regression::StageTimer timer{log, "merge-weather"};
+        fmt::println("---Merge weather data---");
+        mergeWeather(
+            constants::paths::WeatherInput,
+            constants::paths::WeatherIndex,
+            shard.path(constants::paths::SegmentIndex),
+            shard.path(constants::flags::AggregateByTime 
+                ? constants::paths::TrafficAggregated 
+                : constants::paths::TrafficByLocationSorted),
+            shard.path(constants::paths::MergedTrafficWeather)
+        );
+        fmt::print("");
+    }
+
+    if(constants::flags::MergeAll){
+        regression::StageTimer timer{log, "merge"};
+        fmt::println("---Merge all files---");
+        if(constants::flags::TimeOrderedMerge){
+            mergeSplitDataByTime(
+                shard.path(constants::paths::MergedTrafficWeather),
+                shard.path(constants::paths::FinalOutput)
+            );
+        }else{
+            mergeSplitData(
+                shard.path(constants::paths::MergedTrafficWeather),
+                shard.path(constants::paths::FinalOutput)
+            );
+        }
+        fmt::println("");
+    }
+
+    if(constants::flags::FeatureEngineering){
+        regression::StageTimer timer{log, "time-features"};
+        fmt::println("---Add time features---");
+        addTimeFeatures(
+            shard.path(constants::paths::FinalOutput),
+            shard.path(constants::paths::FinalOutputWithFeatures)
+        );
+        fmt::println("");
+    }
+}
+
+// split labels, matrix export and models, on the whole (merged) dataset
+void runModelStages(regression::StageLog *log = nullptr){
+    if(constants::flags::AssignSplits){
+        regression::StageTimer timer{log, "assign-splits"};
+        fmt::println("---Assign train/test splits---");
+        assignSplits(
+            constants::paths::FinalOutputWithFeatures,
+            constants::paths::FinalOutputWithSplits
+        );
+        fmt::println("");
+    }
+
+    if(constants::flags::ExportMatrix){
+        regression::StageTimer timer{log, "export-matrix"};
+        fmt::println("---Export feature matrix---");
+        // with split columns the matrix comes with each row's partition
+        bool splitColumns{constants::flags::AssignSplits && constants::splits::OutputMode == constants::splits::Output::Columns};
+        exportFeatureMatrix(
+            splitColumns ? constants::paths::FinalOutputWithSplits : constants::paths::FinalOutputWithFeatures,
+            constants::paths::FeatureMatrix
+        );
+        fmt::println("");
+    }
+
+    if(constants::flags::TrainModels){
+        regression::StageTimer timer{log, "train"};
+        fmt::println("---Train models---");
+        trainModels(
+            constants::paths::FeatureMatrix,
+            constants::paths::PrimaryModel,
+            constants::paths::ResidualModels,
+            constants::paths::TuningResults
+        );
+        fmt::println("");
+    }
+
+    if(constants::flags::ScoreModels){
+        regression::StageTimer timer{log, "score"};
+        fmt::println("---Score models---");
+        scoreModels(
+            constants::paths::FeatureMatrix,
+            constants::paths::PrimaryModel,
+            constants::paths::ResidualModels,
+            constants::paths::Predictions
+        );
+        fmt::println("");
+    }
+}
+
+// the command line of the joiner executable. shards are started from
+// executable, and refused without one
+int runCommand(int argc, char **argv, const char *executable){
+    // joiner serve [socket] / client [socket] / bench [--check | csv] / query [options] predicate... / perf [--update] [--timing] [baseline] / generate [directory] /
+    // --shard i/N / merge-shards N / shards N,
+    // no arguments runs the pipeline
+    std::string command{argc > 1 ? argv[1] : ""};
+    std::string socketPath{argc > 2 ? argv[2] : constants::paths::PredictionSocket};
+
+    if(command == "bench"){
+        if(argc > 2 && std::string{argv[2]} == "--check") return tokenizer::runCheck();
+        return tokenizer::runBenchmark(argc > 2 ? argv[2] : constants::paths::TrafficInput);
+    }
+
+    // the perf dataset as inputs of a run without real data
+    if(command == "generate"){
+        std::string directory{argc > 2 ? argv[2] : "."};
+        if(!regression::writeDataset(directory)){
+            fmt::println("[!!! could not write the dataset to {} !!!]", directory);
+            return 1;
+        }
+        return 0;
+    }
+
+    if(command == "perf"){
+        return regression::runRegression({argv + 2, argv + argc}, [](regression::StageLog &log){
+            runSegmentStages({}, &log);
+            runModelStages(&log);
+        });
+    }
+
+    if(command == "query"){
+        return query::runQuery({argv + 2, argv + argc});
+    }
+
+    if(command == "client"){
+        return serving::runClient(socketPath);
+    }
+
+    if(command == "serve"){
+        auto predictor{serving::Predictor::load(
+            constants::paths::SegmentIndex,
+            constants::paths::WeatherInput,
+            constants::paths::WeatherIndex,
+            constants::paths::FeatureMatrix,
+            constants::paths::PrimaryModel,
+            constants::paths::ResidualModels
+        )};
+        if(!predictor) return 1;
+        serving::serve(*predictor, socketPath);
+        return 0;
+    }
+
+    // one shard's segment stages, its outputs are merged by merge-shards
+    if(command == "--shard"){
+        auto shard{sharding::Shard::parse(argc > 2 ? argv[2] : "")};
+        if(!shard){
+            fmt::println("[!!! expected --shard i/N with i < N !!!]");
+            return 1;
+        }
+        runSegmentStages(*shard);
+        fmt::println("Shard {}/{} done!", shard->index, shard->count);
+        return 0;
+    }
+
+    // merge-shards N after N shard runs, shards N starts them on this machine first
+    if(command == "merge-shards" || command == "shards"){
+        size_t shardCount{argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 0};
+        if(shardCount == 0){
+            fmt::println("[!!! expected a shard count !!!]");
+            return 1;
+        }
+        if(command == "shards"){
+            if(executable == nullptr){
+                fmt::println("[!!! shards needs the joiner executable, run it from the joiner driver !!!]");
+                return 1;
+            }
+            if(!sharding::runLocalShards(executable, shardCount)) return 1;
+        }
+
+        fmt::println("---Merge shards---");
+        bool merged{
+            (!constants::flags::SplitData || sharding::collectShards(constants::paths::SegmentIndex, shardCount, constants::column_names::SegmentId))
+            && (!constants::flags::MergeAll || sharding::mergeSortedShards(constants::paths::FinalOutput, shardCount, constants::column_names::SegmentId, constants::flags::TimeOrderedMerge))
+            && (!constants::flags::FeatureEngineering || sharding::mergeSortedShards(constants::paths::FinalOutputWithFeatures, shardCount, constants::column_names::SegmentId, constants::flags::TimeOrderedMerge))
+        };
+        if(!merged) return 1;
+        fmt::println("");
+
+        runModelStages();
+        fmt::print("All done!");
+        return 0;
+    }
+
+    if(!command.empty()){
+        fmt::println("usage: {} [serve [socket] | client [socket] | bench [--check | csv] | query [--input seg] [--output path] column=value... | perf [--update] [--timing] [baseline] | generate [directory] | --shard i/N | merge-shards N | shards N]", argv[0]);
+        return 1;
+    }
+
+    runSegmentStages({});
+    runModelStages();
+    fmt::print("All done!");
+
+    return 0;
+}
+
+// joiner.h promises no exceptions across the C interface, a stage that throws
+// (on any of its workers) fails the command instead
+int joiner_run_executable(const char *executable, int argc, char **argv){
+    try{
+        return runCommand(argc, argv, executable);
+    }catch(const std::exception &error){
+        fmt::println("[!!! {} !!!]", error.what());
+        return 1;
+    }catch(...){
+        fmt::println("[!!! unknown error !!!]");
+        return 1;
+    }
+}
+
+int joiner_run_command(int argc, char **argv){
+    return joiner_run_executable(nullptr, argc, argv);
+}
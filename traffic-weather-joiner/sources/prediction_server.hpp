@@ -0,0 +1,493 @@
+#pragma once
+
+#include "constants.hpp"
+#include "csv_tokenizer.hpp"
+#include "compressed_io.hpp"
+#include "utilities.hpp"
+#include "time_features.hpp"
+#include "tree_ensemble.hpp"
+#include "weather_store.hpp"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cerrno>
+#include <cmath>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <fmt/core.h>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace serving{
+
+    namespace _{
+
+        struct Segment{
+            int weatherStationId;
+            std::string roadGroup;
+            double latitude;
+            double longitude;
+            weather::Blend blend;   // more than one station when the join blended weather
+        };
+
+        // where a matrix column comes from when it is rebuilt for a single request
+        enum class Source{ Missing, Year, Month, Day, Hour, Minute, Latitude, Longitude, RoadGroup, Weather, TimeFeature };
+
+        struct ColumnSource{
+            Source source{Source::Missing};
+            size_t index{0};        // weather field or time feature index
+            std::string level;      // road group of a road_group_<level> column
+        };
+
+        inline const std::vector<std::string> &timeFeatureNames(){
+            static const std::vector<std::string> names{
+                "is_holiday", "is_weekend", "month_cos", "month_sin", "hour_cos", "hour_sin", "minute_cos", "minute_sin"
+            };
+            return names;
+        }
+
+        inline std::unordered_map<std::string, Segment> loadSegments(const std::string &segmentIndexPath){
+            tokenizer::Reader csv;
+
+            std::unordered_map<std::string, Segment> segments;
+            auto input{compression::open(csv, segmentIndexPath)};
+            if(!input) return segments;
+
+            std::vector<std::string> header;
+            for(const auto &cell : csv.header()){
+                std::string value;
+                cell.read_value(value);
+                header.push_back(value);
+            }
+
+            size_t segmentIndex     {utilities::findColumn(header, constants::column_names::SegmentId)};
+            size_t stationIndex     {utilities::findColumn(header, constants::column_names::WeatherStationId)};
+            size_t roadGroupIndex   {utilities::findColumn(header, constants::column_names::RoadGroup)};
+            size_t latitudeIndex    {utilities::findColumn(header, constants::column_names::Latitude)};
+            size_t longitudeIndex   {utilities::findColumn(header, constants::column_names::Longitude)};
+            size_t requiredSize{std::max({segmentIndex, stationIndex, roadGroupIndex, latitudeIndex, longitudeIndex}) + 1};
+            size_t blendStationsIndex{utilities::findColumn(header, constants::column_names::BlendStationIds)};
+            size_t blendWeightsIndex{utilities::findColumn(header, constants::column_names::BlendWeights)};
+            bool hasBlends{blendStationsIndex != 0 && blendWeightsIndex != 0};
+
+            for(const auto &row : csv){
+                std::vector<std::string> fields;
+                for(const auto &cell : row){
+                    std::string value;
+                    cell.read_value(value);
+                    fields.push_back(value);
+                }
+                if(fields.size() < requiredSize) continue;
+
+                weather::Blend blend;
+                if(hasBlends && fields.size() > std::max(blendStationsIndex, blendWeightsIndex)){
+                    blend = weather::parseBlend(fields[blendStationsIndex], fields[blendWeightsIndex]);
+                }
+                segments[fields[segmentIndex]] = {
+                    std::stoi(fields[stationIndex]),
+                    fields[roadGroupIndex],
+                    std::stod(fields[latitudeIndex]),
+                    std::stod(fields[longitudeIndex]),
+                    std::move(blend)
+                };
+            }
+            return segments;
+        }
+
+        inline volatile std::sig_atomic_t stopRequested{0};
+
+        inline void requestStop(int){
+            stopRequested = 1;
+        }
+
+    } // namespace _
+
+    // everything a request needs, loaded once: the segment index written by the
+    // split stage, the weather store and optionally the hierarchical model
+    class Predictor{
+    public:
+        static std::optional<Predictor> load(
+            const std::string &segmentIndexPath,
+            const std::string &weatherCsvPath,
+            const std::string &weatherIndexPath,
+            const std::string &matrixBasePath,
+            const std::string &primaryModelPath,
+            const std::string &residualModelDirectory
+        ){
+            Predictor predictor;
+
+            predictor.segments_ = _::loadSegments(segmentIndexPath);
+            if(predictor.segments_.empty()){
+                fmt::println("[!!! no segments in {}, run the split stage first !!!]", segmentIndexPath);
+                return std::nullopt;
+            }
+            fmt::println("loaded {} segments", predictor.segments_.size());
+
+            predictor.weather_ = weather::load(weatherCsvPath, weatherIndexPath);
+            const auto &weatherHeader{predictor.weather_.header()};
+            for(size_t i{0}; i < weatherHeader.size(); i++){
+                if(weatherHeader[i] == constants::column_names::LocationId || weatherHeader[i] == constants::column_names::Time) continue;
+                predictor.weatherFields_.push_back(i);
+            }
+
+            predictor.columns_ = utilities::readLines(matrixBasePath + ".columns.txt");
+            if(!predictor.columns_.empty()){
+                predictor.model_ = inference::HierarchicalModel::load(predictor.columns_, primaryModelPath, residualModelDirectory);
+            }
+            if(predictor.model_){
+                predictor.mapColumns();
+            }else{
+                fmt::println("[!!! no model loaded, serving features only !!!]");
+            }
+
+            return predictor;
+        }
+
+        std::string header() const{
+            std::string line{fmt::format(
+                "{},{},{}", constants::column_names::SegmentId, constants::column_names::Time, constants::column_names::WeatherStationId
+            )};
+            line += ',';
+            line += constants::column_names::RoadGroup;
+            for(const auto &name : _::timeFeatureNames()) line += ',' + name;
+            for(size_t field : weatherFields_) line += ',' + weather_.header()[field];
+            if(model_) line += ",pred_primary,pred_hierarchical";
+            return line;
+        }
+
+        // "<segment>,<YYYY-MM-DDTHH:MM>" -> one response line appended to out, without the newline
+        void answer(std::string_view request, std::string &out) const{
+            if(request == "header"){
+                out += header();
+                return;
+            }
+
+            size_t comma{request.find(',')};
+            if(comma == std::string_view::npos){
+                out += "error,expected <segment>,<time>";
+                return;
+            }
+
+            std::string segmentId{request.substr(0, comma)};
+            std::string time{request.substr(comma + 1)};
+            auto segment{segments_.find(segmentId)};
+            if(segment == segments_.end()){
+                out += fmt::format("error,unknown segment {}", segmentId);
+                return;
+            }
+
+            units::Timestamp timestamp{utilities::parseTimestamp(time)};
+            if(timestamp.year == 0){
+                out += fmt::format("error,bad time {}", time);
+                return;
+            }
+
+            auto timeFeatures{feature_engineering::encodeTime(timestamp)};
+            std::array<double, 8> timeValues{
+                feature_engineering::isHoliday(timestamp) ? 1.0 : 0.0,
+                feature_engineering::isWeekend(timestamp) ? 1.0 : 0.0,
+                timeFeatures.monthCosine, timeFeatures.monthSine,
+                timeFeatures.hourCosine, timeFeatures.hourSine,
+                timeFeatures.minuteCosine, timeFeatures.minuteSine
+            };
+            const float *record{weather_.find(segment->second.weatherStationId, timestamp)};
+            std::vector<float> blended;
+            if(record && segment->second.blend.size() > 1){
+                blended.resize(weather_.header().size());
+                if(weather_.findBlended(segment->second.blend, timestamp, blended.data())) record = blended.data();
+            }
+
+            out += segmentId;
+            out += ',';
+            out += time;
+            out += fmt::format(",{},{}", segment->second.weatherStationId, segment->second.roadGroup);
+            for(double value : timeValues) out += fmt::format(",{}", value);
+            for(size_t field : weatherFields_){
+                out += ',';
+                if(record && !std::isnan(record[field])) out += fmt::format("{}", record[field]);
+            }
+
+            if(model_){
+                std::vector<float> row(columns_.size());
+                buildRow(segment->second, timestamp, timeValues, record, row);
+                float primary{0.0f};
+                float hierarchical{0.0f};
+                model_->score(row.data(), 1, &primary, &hierarchical);
+                out += fmt::format(",{},{}", primary, hierarchical);
+            }
+        }
+
+    private:
+        Predictor() = default;
+
+        // resolve every matrix column once so a request only copies values
+        void mapColumns(){
+            const auto &names{_::timeFeatureNames()};
+            std::string roadGroupPrefix{fmt::format("{}_", constants::column_names::RoadGroup)};
+
+            sources_.resize(columns_.size());
+            for(size_t i{0}; i < columns_.size(); i++){
+                const std::string &column{columns_[i]};
+                _::ColumnSource &target{sources_[i]};
+
+                if(column == constants::column_names::Year)             target.source = _::Source::Year;
+                else if(column == constants::column_names::Month)       target.source = _::Source::Month;
+                else if(column == constants::column_names::Day)         target.source = _::Source::Day;
+                else if(column == constants::column_names::Hour)        target.source = _::Source::Hour;
+                else if(column == constants::column_names::Minute)      target.source = _::Source::Minute;
+                else if(column == constants::column_names::Latitude)    target.source = _::Source::Latitude;
+                else if(column == constants::column_names::Longitude)   target.source = _::Source::Longitude;
+                else if(column.rfind(roadGroupPrefix, 0) == 0){
+                    target.source = _::Source::RoadGroup;
+                    target.level = column.substr(roadGroupPrefix.size());
+                }else if(auto name{std::find(names.begin(), names.end(), column)}; name != names.end()){
+                    target.source = _::Source::TimeFeature;
+                    target.index = static_cast<size_t>(name - names.begin());
+                }else if(auto field{std::find(weather_.header().begin(), weather_.header().end(), column)}; field != weather_.header().end()){
+                    target.source = _::Source::Weather;
+                    target.index = static_cast<size_t>(field - weather_.header().begin());
+                }
+            }
+
+            size_t missing{static_cast<size_t>(std::count_if(sources_.begin(), sources_.end(), [](const auto &source){
+                return source.source == _::Source::Missing;
+            }))};
+            fmt::println("{} of {} model columns are not known at request time and are passed as missing", missing, columns_.size());
+        }
+
+        void buildRow(
+            const _::Segment &segment,
+            const units::Timestamp &timestamp,
+            const std::array<double, 8> &timeValues,
+            const float *record,
+            std::vector<float> &row
+        ) const{
+            constexpr float missing{std::numeric_limits<float>::quiet_NaN()};
+            for(size_t i{0}; i < sources_.size(); i++){
+                const _::ColumnSource &source{sources_[i]};
+                switch(source.source){
+                    case _::Source::Year:           row[i] = static_cast<float>(timestamp.year); break;
+                    case _::Source::Month:          row[i] = static_cast<float>(timestamp.month); break;
+                    case _::Source::Day:            row[i] = static_cast<float>(timestamp.day); break;
+                    case _::Source::Hour:           row[i] = static_cast<float>(timestamp.hour); break;
+                    case _::Source::Minute:         row[i] = static_cast<float>(timestamp.minute); break;
+                    case _::Source::Latitude:       row[i] = static_cast<float>(segment.latitude); break;
+                    case _::Source::Longitude:      row[i] = static_cast<float>(segment.longitude); break;
+                    case _::Source::RoadGroup:      row[i] = segment.roadGroup == source.level ? 1.0f : 0.0f; break;
+                    case _::Source::TimeFeature:    row[i] = static_cast<float>(timeValues[source.index]); break;
+                    case _::Source::Weather:        row[i] = record ? record[source.index] : missing; break;
+                    case _::Source::Missing:        row[i] = missing; break;
+                }
+            }
+        }
+
+        std::unordered_map<std::string, _::Segment> segments_;
+        weather::Store weather_;
+        std::vector<size_t> weatherFields_;
+        std::vector<std::string> columns_;
+        std::vector<_::ColumnSource> sources_;
+        std::optional<inference::HierarchicalModel> model_;
+    };
+
+    // newline delimited requests over a unix stream socket, one response line per
+    // request in order. clients may pipeline whole batches, every complete line in
+    // a read is answered before the responses are flushed. a client is not read
+    // from while MaxPendingBytes of its responses are unread, and one sending a
+    // line over MaxRequestBytes is dropped
+    inline void serve(const Predictor &predictor, const std::string &socketPath){
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        if(socketPath.size() >= sizeof(address.sun_path)){
+            fmt::println("[!!! socket path {} is too long !!!]", socketPath);
+            return;
+        }
+        std::strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+
+        int listener{::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)};
+        ::unlink(socketPath.c_str());
+        if(listener < 0
+            || ::bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0
+            || ::listen(listener, SOMAXCONN) < 0){
+            fmt::println("[!!! could not listen on {}: {} !!!]", socketPath, std::strerror(errno));
+            if(listener >= 0) ::close(listener);
+            return;
+        }
+
+        struct sigaction action{};
+        action.sa_handler = _::requestStop;
+        ::sigaction(SIGINT, &action, nullptr);
+        ::sigaction(SIGTERM, &action, nullptr);
+        std::signal(SIGPIPE, SIG_IGN);
+
+        struct Connection{
+            std::string input;
+            std::string output;
+        };
+        std::vector<pollfd> descriptors{{listener, POLLIN, 0}};
+        std::vector<Connection> connections(1);
+        std::vector<char> buffer(constants::serving::ReadBufferBytes);
+        size_t requestCount{0};
+
+        // answers the complete lines read so far, until MaxPendingBytes of responses wait
+        auto answerPending{[&](Connection &connection){
+            size_t start{0};
+            while(connection.output.size() < constants::serving::MaxPendingBytes){
+                size_t end{connection.input.find('\n', start)};
+                if(end == std::string::npos) break;
+                std::string_view line{connection.input.data() + start, end - start};
+                if(!line.empty() && line.back() == '\r') line.remove_suffix(1);
+                predictor.answer(line, connection.output);
+                connection.output += '\n';
+                requestCount++;
+                start = end + 1;
+            }
+            connection.input.erase(0, start);
+        }};
+
+        fmt::println("listening on {}", socketPath);
+        while(!_::stopRequested){
+            if(::poll(descriptors.data(), descriptors.size(), -1) < 0){
+                if(errno == EINTR) continue;
+                fmt::println("[!!! poll failed: {} !!!]", std::strerror(errno));
+                break;
+            }
+
+            for(size_t i{descriptors.size()}; i-- > 1;){
+                pollfd &descriptor{descriptors[i]};
+                Connection &connection{connections[i]};
+                bool closed{(descriptor.revents & (POLLERR | POLLHUP | POLLNVAL)) != 0 && (descriptor.revents & POLLIN) == 0};
+
+                if(descriptor.revents & POLLIN){
+                    ssize_t received{::read(descriptor.fd, buffer.data(), buffer.size())};
+                    if(received > 0) connection.input.append(buffer.data(), static_cast<size_t>(received));
+                    else if(received == 0 || (errno != EAGAIN && errno != EINTR)) closed = true;
+                }
+
+                answerPending(connection);
+                if(!closed && connection.input.size() > constants::serving::MaxRequestBytes
+                    && connection.input.find('\n') == std::string::npos){
+                    fmt::println("[!!! dropped a client whose request is over {} bytes !!!]", constants::serving::MaxRequestBytes);
+                    closed = true;
+                }
+
+                if(!closed && !connection.output.empty()){
+                    ssize_t sent{::write(descriptor.fd, connection.output.data(), connection.output.size())};
+                    if(sent > 0) connection.output.erase(0, static_cast<size_t>(sent));
+                    else if(sent < 0 && errno != EAGAIN && errno != EINTR) closed = true;
+                    answerPending(connection);
+                }
+
+                // no reading while responses are backed up or requests already read are unanswered
+                bool readable{connection.output.size() < constants::serving::MaxPendingBytes
+                    && connection.input.find('\n') == std::string::npos};
+                descriptor.events = static_cast<short>((readable ? POLLIN : 0) | (connection.output.empty() ? 0 : POLLOUT));
+
+                if(closed){
+                    ::close(descriptor.fd);
+                    descriptors.erase(descriptors.begin() + static_cast<std::ptrdiff_t>(i));
+                    connections.erase(connections.begin() + static_cast<std::ptrdiff_t>(i));
+                }
+            }
+
+            if(descriptors[0].revents & POLLIN){
+                for(int client{::accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)}; client >= 0;
+                    client = ::accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)){
+                    descriptors.push_back({client, POLLIN, 0});
+                    connections.emplace_back();
+                }
+            }
+        }
+
+        for(const auto &descriptor : descriptors) ::close(descriptor.fd);
+        ::unlink(socketPath.c_str());
+        fmt::println("done: answered {} requests, removed {}", requestCount, socketPath);
+    }
+
+    // sends stdin to the server in batches of ClientBatchSize lines, prints the
+    // responses and reports round trip latency per batch on stderr
+    inline int runClient(const std::string &socketPath){
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        std::strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+
+        int server{::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)};
+        if(server < 0 || ::connect(server, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0){
+            std::cerr << fmt::format("[!!! could not connect to {}: {} !!!]\n", socketPath, std::strerror(errno));
+            if(server >= 0) ::close(server);
+            return 1;
+        }
+
+        std::vector<double> latencies;
+        std::vector<char> buffer(constants::serving::ReadBufferBytes);
+        std::string batch;
+        std::string responses;
+        size_t requestCount{0};
+
+        auto flush{[&](size_t lines) -> bool{
+            auto start{std::chrono::steady_clock::now()};
+            for(size_t written{0}; written < batch.size();){
+                ssize_t sent{::write(server, batch.data() + written, batch.size() - written)};
+                if(sent <= 0) return false;
+                written += static_cast<size_t>(sent);
+            }
+
+            size_t received{0};
+            size_t scanned{responses.size()};
+            while(received < lines){
+                ssize_t count{::read(server, buffer.data(), buffer.size())};
+                if(count <= 0) return false;
+                responses.append(buffer.data(), static_cast<size_t>(count));
+                for(; scanned < responses.size(); scanned++){
+                    if(responses[scanned] == '\n') received++;
+                }
+            }
+            latencies.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+
+            std::cout << responses;
+            responses.clear();
+            batch.clear();
+            return true;
+        }};
+
+        std::string line;
+        size_t pending{0};
+        while(std::getline(std::cin, line)){
+            if(line.empty()) continue;
+            batch += line;
+            batch += '\n';
+            requestCount++;
+            if(++pending == constants::serving::ClientBatchSize){
+                if(!flush(pending)) break;
+                pending = 0;
+            }
+        }
+        if(pending > 0) flush(pending);
+        ::close(server);
+
+        if(latencies.empty()) return 0;
+        std::sort(latencies.begin(), latencies.end());
+        auto percentile{[&](double fraction){
+            return latencies[std::min(latencies.size() - 1, static_cast<size_t>(fraction * latencies.size()))];
+        }};
+        std::cerr << fmt::format(
+            "{} requests in {} batches of up to {}: p50 {:.1f} us, p99 {:.1f} us, max {:.1f} us per batch\n",
+            requestCount, latencies.size(), constants::serving::ClientBatchSize,
+            percentile(0.50), percentile(0.99), latencies.back()
+        );
+        return 0;
+    }
+
+} // namespace serving
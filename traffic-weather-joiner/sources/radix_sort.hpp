@@ -0,0 +1,87 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <numeric>
+#include <vector>
+
+#include "constants.hpp"
+
+namespace utilities{
+
+    namespace _{
+
+        // signed keys as unsigned with the same order
+        inline uint32_t orderedKey(int32_t key){
+            return static_cast<uint32_t>(key) ^ 0x80000000u;
+        }
+
+        // ascending runs of keys, [starts[r], starts[r + 1]) is run r
+        inline std::vector<uint32_t> ascendingRuns(const std::vector<int32_t> &keys, size_t maxRuns){
+            std::vector<uint32_t> starts{0};
+            for(size_t i{1}; i < keys.size(); i++){
+                if(keys[i] >= keys[i - 1]) continue;
+                starts.push_back(static_cast<uint32_t>(i));
+                if(starts.size() > maxRuns) break;
+            }
+            starts.push_back(static_cast<uint32_t>(keys.size()));
+            return starts;
+        }
+
+        // LSD radix sort of (key << 32 | index) pairs over the key bytes, bytes every
+        // key shares (the high ones for a few years of minutes) cost no pass
+        inline void radixSortPairs(std::vector<uint64_t> &pairs){
+            std::vector<uint64_t> scratch(pairs.size());
+            for(int shift{32}; shift < 64; shift += 8){
+                std::array<size_t, 256> counts{};
+                for(uint64_t pair : pairs) counts[(pair >> shift) & 0xff]++;
+                if(std::find(counts.begin(), counts.end(), pairs.size()) != counts.end()) continue;
+
+                size_t offset{0};
+                for(size_t &count : counts){
+                    size_t bucket{count};
+                    count = offset;
+                    offset += bucket;
+                }
+                for(uint64_t pair : pairs) scratch[counts[(pair >> shift) & 0xff]++] = pair;
+                pairs.swap(scratch);
+            }
+        }
+
+    } // namespace _
+
+    // stable sorting permutation of keys: order[i] is the position of the i-th
+    // smallest key. sorted input is recognised in one pass, input made of a few
+    // sorted runs (appended exports) is merged run by run, anything else is radix sorted
+    inline std::vector<uint32_t> sortPermutation(const std::vector<int32_t> &keys){
+        std::vector<uint32_t> order(keys.size());
+        std::iota(order.begin(), order.end(), 0u);
+
+        std::vector<uint32_t> runs{_::ascendingRuns(keys, constants::system::NearlySortedMaxRuns)};
+        if(runs.size() <= 2) return order;
+
+        auto byKey{[&](uint32_t left, uint32_t right){ return keys[left] < keys[right]; }};
+        if(runs.size() - 1 <= constants::system::NearlySortedMaxRuns){
+            // bottom up pairwise merges, stable and O(n log runs)
+            for(size_t width{1}; width < runs.size() - 1; width *= 2){
+                for(size_t run{0}; run + width < runs.size() - 1; run += 2 * width){
+                    size_t last{std::min(run + 2 * width, runs.size() - 1)};
+                    std::inplace_merge(order.begin() + runs[run], order.begin() + runs[run + width], order.begin() + runs[last], byKey);
+                }
+            }
+            return order;
+        }
+
+        std::vector<uint64_t> pairs(keys.size());
+        for(size_t i{0}; i < keys.size(); i++){
+            pairs[i] = static_cast<uint64_t>(_::orderedKey(keys[i])) << 32 | i;
+        }
+        _::radixSortPairs(pairs);
+        for(size_t i{0}; i < pairs.size(); i++){
+            order[i] = static_cast<uint32_t>(pairs[i]);
+        }
+        return order;
+    }
+
+} // namespace utilities
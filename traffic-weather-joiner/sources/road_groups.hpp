@@ -0,0 +1,95 @@
+#pragma once
+
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <queue>
+#include <string_view>
+#include <vector>
+
+#include "constants.hpp"
+
+namespace feature_engineering{
+
+    // case-insensitive Aho-Corasick automaton over all road group patterns, a
+    // street name is classified in a single pass no matter how many patterns exist
+    class RoadGroupClassifier{
+    public:
+        static constexpr int Unmatched{-1};
+
+        RoadGroupClassifier(){
+            const auto &roadGroups{constants::road_groups::roadGroups()};
+            newState();
+
+            for(size_t group{0}; group < roadGroups.size() && group < 64; group++){
+                for(const char *pattern : roadGroups[group].patterns){
+                    int state{0};
+                    for(const char *c{pattern}; *c; c++){
+                        unsigned char symbol{fold(*c)};
+                        if(transitions_[state][symbol] == 0){
+                            int next{newState()};
+                            transitions_[state][symbol] = next;
+                        }
+                        state = transitions_[state][symbol];
+                    }
+                    outputs_[state] |= uint64_t{1} << group;
+                }
+            }
+
+            // breadth first: fill failure links and turn the trie into a full DFA
+            std::vector<int> failure(transitions_.size(), 0);
+            std::queue<int> pending;
+            for(int symbol{0}; symbol < 256; symbol++){
+                if(transitions_[0][symbol] != 0) pending.push(transitions_[0][symbol]);
+            }
+            while(!pending.empty()){
+                int state{pending.front()};
+                pending.pop();
+                outputs_[state] |= outputs_[failure[state]];
+
+                for(int symbol{0}; symbol < 256; symbol++){
+                    int &next{transitions_[state][symbol]};
+                    if(next != 0){
+                        failure[next] = transitions_[failure[state]][symbol];
+                        pending.push(next);
+                    }else{
+                        next = transitions_[failure[state]][symbol];
+                    }
+                }
+            }
+        }
+
+        // index into roadGroups() of the first group with a matching pattern
+        int classify(std::string_view street) const{
+            uint64_t matched{0};
+            int state{0};
+            for(char c : street){
+                state = transitions_[state][fold(c)];
+                matched |= outputs_[state];
+            }
+            if(matched == 0) return Unmatched;
+            return std::countr_zero(matched);
+        }
+
+        static const char *name(int group){
+            if(group == Unmatched) return constants::road_groups::UnmatchedName;
+            return constants::road_groups::roadGroups()[group].name;
+        }
+
+    private:
+        static unsigned char fold(char c){
+            unsigned char symbol{static_cast<unsigned char>(c)};
+            return (symbol >= 'a' && symbol <= 'z') ? symbol - ('a' - 'A') : symbol;
+        }
+
+        int newState(){
+            transitions_.push_back({});
+            outputs_.push_back(0);
+            return static_cast<int>(transitions_.size() - 1);
+        }
+
+        std::vector<std::array<int, 256>> transitions_;
+        std::vector<uint64_t> outputs_;
+    };
+
+} // namespace feature_engineering
@@ -0,0 +1,230 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <cstdlib>
+#include <ostream>
+#include <fmt/core.h>
+
+#include "constants.hpp"
+
+namespace feature_engineering{
+
+    namespace _{
+
+        // growable circular buffer, push/pop at both ends in amortized O(1)
+        template<typename T>
+        class RingBuffer{
+        public:
+            bool empty() const{ return count_ == 0; }
+            size_t size() const{ return count_; }
+
+            T &front(){ return items_[head_]; }
+            T &back(){ return items_[(head_ + count_ - 1) & (items_.size() - 1)]; }
+
+            void push_back(const T &item){
+                if(count_ == items_.size()) grow();
+                items_[(head_ + count_) & (items_.size() - 1)] = item;
+                count_++;
+            }
+
+            void pop_front(){
+                head_ = (head_ + 1) & (items_.size() - 1);
+                count_--;
+            }
+
+            void pop_back(){ count_--; }
+
+            void clear(){ head_ = 0; count_ = 0; }
+
+        private:
+            void grow(){
+                std::vector<T> grown(items_.empty() ? 16 : items_.size() * 2);
+                for(size_t i{0}; i < count_; i++){
+                    grown[i] = items_[(head_ + i) & (items_.size() - 1)];
+                }
+                items_ = std::move(grown);
+                head_ = 0;
+            }
+
+            std::vector<T> items_;
+            size_t head_{0};
+            size_t count_{0};
+        };
+
+        struct Observation{
+            int minute;
+            double value;
+        };
+
+    } // namespace _
+
+    // volume over the trailing [t - span, t) window, monotonic deques keep min/max O(1)
+    class RollingWindow{
+    public:
+        explicit RollingWindow(int spanMinutes) : spanMinutes_{spanMinutes}{}
+
+        void evictBefore(int minute){
+            int oldest{minute - spanMinutes_};
+            while(!window_.empty() && window_.front().minute < oldest){
+                sum_ -= window_.front().value;
+                window_.pop_front();
+            }
+            while(!minimums_.empty() && minimums_.front().minute < oldest) minimums_.pop_front();
+            while(!maximums_.empty() && maximums_.front().minute < oldest) maximums_.pop_front();
+        }
+
+        void push(const _::Observation &observation){
+            window_.push_back(observation);
+            sum_ += observation.value;
+
+            while(!minimums_.empty() && minimums_.back().value >= observation.value) minimums_.pop_back();
+            minimums_.push_back(observation);
+
+            while(!maximums_.empty() && maximums_.back().value <= observation.value) maximums_.pop_back();
+            maximums_.push_back(observation);
+        }
+
+        void clear(){
+            window_.clear();
+            minimums_.clear();
+            maximums_.clear();
+            sum_ = 0.0;
+        }
+
+        bool empty() const{ return window_.empty(); }
+        double mean() const{ return sum_ / static_cast<double>(window_.size()); }
+        double min(){ return minimums_.front().value; }
+        double max(){ return maximums_.front().value; }
+
+    private:
+        int spanMinutes_;
+        double sum_{0.0};
+        _::RingBuffer<_::Observation> window_;
+        _::RingBuffer<_::Observation> minimums_;
+        _::RingBuffer<_::Observation> maximums_;
+    };
+
+    // fixed ring of time slots covering one lag period, a slot is read before it is overwritten
+    class SameSlotLag{
+    public:
+        SameSlotLag(int lagMinutes, int slotMinutes)
+            : lagMinutes_{lagMinutes}
+            , slotMinutes_{slotMinutes}
+            , slots_(static_cast<size_t>(lagMinutes / slotMinutes))
+        {}
+
+        bool lookup(int minute, double &value) const{
+            const Slot &slot{slots_[indexOf(minute)]};
+            if(slot.count == 0 || slot.minute != minute - lagMinutes_) return false;
+            value = slot.sum / slot.count;
+            return true;
+        }
+
+        void push(const _::Observation &observation){
+            Slot &slot{slots_[indexOf(observation.minute)]};
+            if(slot.minute != observation.minute){
+                slot = {observation.minute, 0.0, 0};
+            }
+            slot.sum += observation.value;
+            slot.count++;
+        }
+
+        void clear(){ std::fill(slots_.begin(), slots_.end(), Slot{}); }
+
+    private:
+        struct Slot{
+            int minute{std::numeric_limits<int>::min()};
+            double sum{0.0};
+            int count{0};
+        };
+
+        size_t indexOf(int minute) const{
+            int slot{minute / slotMinutes_};
+            int slotCount{static_cast<int>(slots_.size())};
+            return static_cast<size_t>(((slot % slotCount) + slotCount) % slotCount);
+        }
+
+        int lagMinutes_;
+        int slotMinutes_;
+        std::vector<Slot> slots_;
+    };
+
+    // per-segment lag features over a time-sorted stream of rows. rows sharing a
+    // timestamp (e.g. both directions) only see strictly earlier observations
+    class LagFeatures{
+    public:
+        LagFeatures()
+            : sameSlot_{
+                constants::lag_features::SameSlotLagDays * 24 * 60,
+                constants::lag_features::SlotMinutes
+            }
+        {
+            for(int hours : constants::lag_features::WindowHours){
+                windows_.emplace_back(hours * 60);
+            }
+        }
+
+        static void writeHeader(std::ostream &out){
+            for(int hours : constants::lag_features::WindowHours){
+                out << fmt::format(",volume_mean_{0}h,volume_min_{0}h,volume_max_{0}h", hours);
+            }
+            out << ",volume_same_slot_last_week,minutes_since_last_observation";
+        }
+
+        void reset(){
+            for(auto &window : windows_) window.clear();
+            sameSlot_.clear();
+            pending_.clear();
+            lastMinute_ = std::numeric_limits<int>::min();
+        }
+
+        // writes the feature cells for a row at `minute`, then records its volume
+        void writeRow(std::ostream &out, int minute, const char *volume){
+            if(pending_.empty() || pending_.front().minute != minute){
+                flushPending();
+            }
+
+            for(auto &window : windows_){
+                window.evictBefore(minute);
+                if(window.empty()){
+                    out << ",,,";
+                    continue;
+                }
+                out << ',' << window.mean() << ',' << window.min() << ',' << window.max();
+            }
+
+            double lagged;
+            out << ',';
+            if(sameSlot_.lookup(minute, lagged)) out << lagged;
+
+            out << ',';
+            if(lastMinute_ != std::numeric_limits<int>::min()) out << minute - lastMinute_;
+
+            char *end{nullptr};
+            double value{std::strtod(volume, &end)};
+            if(end != volume){
+                pending_.push_back({minute, value});
+            }
+        }
+
+    private:
+        void flushPending(){
+            if(pending_.empty()) return;
+            for(const auto &observation : pending_){
+                for(auto &window : windows_) window.push(observation);
+                sameSlot_.push(observation);
+            }
+            lastMinute_ = pending_.front().minute;
+            pending_.clear();
+        }
+
+        std::vector<RollingWindow> windows_;
+        SameSlotLag sameSlot_;
+        std::vector<_::Observation> pending_;
+        int lastMinute_{std::numeric_limits<int>::min()};
+    };
+
+} // namespace feature_engineering
@@ -0,0 +1,81 @@
+#pragma once
+
+#include "constants.hpp"
+#include "utilities.hpp"
+#include "tree_ensemble.hpp"
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <fmt/core.h>
+
+// hierarchical prediction over the exported feature matrix: primary model plus
+// the residual model of the row's road group, written as one CSV line per row
+inline void scoreModels(
+    const std::string &matrixBasePath,
+    const std::string &primaryModelPath,
+    const std::string &residualModelDirectory,
+    const std::string &outputCsvPath
+){
+    std::vector<std::string> columns{utilities::readLines(matrixBasePath + ".columns.txt")};
+    if(columns.empty()){
+        fmt::println("[!!! no columns in {}.columns.txt, run the matrix export first !!!]", matrixBasePath);
+        return;
+    }
+
+    auto model{inference::HierarchicalModel::load(columns, primaryModelPath, residualModelDirectory)};
+    if(!model){
+        fmt::println("[!!! could not load primary model {}, skipping scoring !!!]", primaryModelPath);
+        return;
+    }
+
+    std::ifstream matrixIn{matrixBasePath + ".bin", std::ios::binary};
+    if(!matrixIn){
+        fmt::println("[!!! could not open {}.bin !!!]", matrixBasePath);
+        return;
+    }
+
+    size_t threadCount{utilities::resolveThreadCount(constants::inference::ThreadCount)};
+
+    size_t stride{columns.size()};
+    size_t batchRows{constants::inference::BatchRows};
+    size_t chunkRows{batchRows * threadCount};
+
+    std::vector<float> rows(chunkRows * stride);
+    std::vector<float> primaryPredictions(chunkRows);
+    std::vector<float> hierarchicalPredictions(chunkRows);
+
+    std::ofstream out{outputCsvPath};
+    out << "pred_primary,pred_hierarchical\n";
+
+    size_t rowCount{0};
+    while(matrixIn){
+        matrixIn.read(reinterpret_cast<char *>(rows.data()), static_cast<std::streamsize>(rows.size() * sizeof(float)));
+        size_t readRows{static_cast<size_t>(matrixIn.gcount()) / (stride * sizeof(float))};
+        if(readRows == 0) break;
+
+        // each worker scores whole batches of the chunk, the model arrays are shared read-only
+        size_t batchCount{(readRows + batchRows - 1) / batchRows};
+        utilities::parallelFor(batchCount, threadCount, [&](size_t batchIndex){
+            size_t first{batchIndex * batchRows};
+            size_t last{std::min(first + batchRows, readRows)};
+            model->score(
+                rows.data() + first * stride, 
+                last - first, 
+                primaryPredictions.data() + first, 
+                hierarchicalPredictions.data() + first
+            );
+        });
+
+        for(size_t row{0}; row < readRows; row++){
+            out << primaryPredictions[row] << ',' << hierarchicalPredictions[row] << '\n';
+        }
+
+        rowCount += readRows;
+        fmt::println("scored {} rows", rowCount);
+    }
+
+    fmt::println("done: {} predictions written to {}", rowCount, outputCsvPath);
+}
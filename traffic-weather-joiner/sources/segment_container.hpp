@@ -0,0 +1,294 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <fmt/core.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "utilities.hpp"
+#include "zone_maps.hpp"
+
+namespace container{
+
+    // one segment's csv block (header line included) inside a container file
+    struct Entry{
+        static constexpr int32_t UnboundedFirst{std::numeric_limits<int32_t>::min()};
+        static constexpr int32_t UnboundedLast{std::numeric_limits<int32_t>::max()};
+
+        std::string segmentId;
+        uint64_t offset;
+        uint64_t length;
+        uint64_t rowCount;
+        int32_t firstMinute{UnboundedFirst};     // epoch minutes the rows fall in, unbounded when the
+        int32_t lastMinute{UnboundedLast};       // writing stage did not parse time
+        std::vector<zones::ZoneMap> zones;      // row ranges of the block with their column bounds
+    };
+
+    // whether append() builds zone maps of its blocks. they cost a parse of every
+    // cell, so only containers that are queried (the joined one) build them
+    enum class ZoneMaps{ Skip, Build };
+
+    namespace _{
+
+        // file layout: block | block | ... | index entries | Footer. blocks are
+        // appended in whatever order workers finish, the index is sorted by segment id
+        constexpr char Magic[8]{'T', 'W', 'J', 'S', 'E', 'G', '0', '2'};
+
+        struct Footer{
+            uint64_t indexOffset;
+            uint64_t entryCount;
+            char magic[8];
+        };
+
+        template<typename T>
+        void put(std::string &out, const T &value){
+            out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+        }
+
+        template<typename T>
+        bool take(std::string_view &in, T &value){
+            if(in.size() < sizeof(value)) return false;
+            std::memcpy(&value, in.data(), sizeof(value));
+            in.remove_prefix(sizeof(value));
+            return true;
+        }
+
+        inline void putText(std::string &out, std::string_view text){
+            put(out, static_cast<uint32_t>(text.size()));
+            out.append(text);
+        }
+
+        inline bool takeText(std::string_view &in, std::string &text){
+            uint32_t size{0};
+            if(!take(in, size) || in.size() < size) return false;
+            text.assign(in.substr(0, size));
+            in.remove_prefix(size);
+            return true;
+        }
+
+        inline void putZones(std::string &out, const std::vector<zones::ZoneMap> &zoneMaps){
+            put(out, static_cast<uint32_t>(zoneMaps.size()));
+            for(const auto &zone : zoneMaps){
+                put(out, zone.offset);
+                put(out, zone.length);
+                put(out, zone.rowCount);
+                put(out, zone.firstMinute);
+                put(out, zone.lastMinute);
+                put(out, static_cast<uint32_t>(zone.columns.size()));
+                for(const auto &column : zone.columns){
+                    put(out, static_cast<uint8_t>(column.present));
+                    put(out, column.min);
+                    put(out, column.max);
+                    putText(out, column.minText);
+                    putText(out, column.maxText);
+                }
+            }
+        }
+
+        inline bool takeZones(std::string_view &in, std::vector<zones::ZoneMap> &zoneMaps){
+            uint32_t zoneCount{0};
+            if(!take(in, zoneCount)) return false;
+            zoneMaps.resize(zoneCount);
+            for(auto &zone : zoneMaps){
+                uint32_t columnCount{0};
+                if(!take(in, zone.offset) || !take(in, zone.length) || !take(in, zone.rowCount)
+                    || !take(in, zone.firstMinute) || !take(in, zone.lastMinute) || !take(in, columnCount)){
+                    return false;
+                }
+                zone.columns.resize(columnCount);
+                for(auto &column : zone.columns){
+                    uint8_t present{0};
+                    if(!take(in, present) || !take(in, column.min) || !take(in, column.max)
+                        || !takeText(in, column.minText) || !takeText(in, column.maxText)){
+                        return false;
+                    }
+                    column.present = present != 0;
+                }
+            }
+            return true;
+        }
+
+        inline bool writeAll(int descriptor, const char *data, size_t size, uint64_t offset){
+            while(size > 0){
+                ssize_t written{::pwrite(descriptor, data, size, static_cast<off_t>(offset))};
+                if(written <= 0) return false;
+                data += written;
+                size -= static_cast<size_t>(written);
+                offset += static_cast<uint64_t>(written);
+            }
+            return true;
+        }
+
+    } // namespace _
+
+    // append-only writer shared by every worker of a stage: append() reserves a
+    // byte range and pwrite()s the block into it, finish() adds the trailing index.
+    // with ZoneMaps::Build every block gets its zone maps on the way in, on the
+    // appending worker.
+    // a block that does not reach the file fails the writer, and finish() then
+    // removes the file instead of indexing it
+    class Writer{
+    public:
+        explicit Writer(const std::string &path, ZoneMaps zoneMaps = ZoneMaps::Skip)
+            : path_{path}
+            , descriptor_{::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)}
+            , zoneMaps_{zoneMaps}
+        {
+            if(descriptor_ < 0) fmt::println("[!!! could not create {} !!!]", path);
+        }
+
+        Writer(const Writer &) = delete;
+        Writer &operator=(const Writer &) = delete;
+
+        ~Writer(){
+            finish();
+        }
+
+        bool isOpen() const{ return descriptor_ >= 0; }
+        bool failed() const{ return failed_; }
+
+        // thread safe
+        void append(
+            std::string_view segmentId,
+            std::string_view block,
+            uint64_t rowCount,
+            int32_t firstMinute = Entry::UnboundedFirst,
+            int32_t lastMinute = Entry::UnboundedLast
+        ){
+            if(descriptor_ < 0 || failed_) return;
+            std::vector<zones::ZoneMap> zoneMaps;
+            if(zoneMaps_ == ZoneMaps::Build) zoneMaps = zones::build(block);
+            uint64_t offset{end_.fetch_add(block.size())};
+            if(!_::writeAll(descriptor_, block.data(), block.size(), offset)){
+                fmt::println("[!!! short write of segment {} to {} !!!]", segmentId, path_);
+                failed_ = true;
+                return;
+            }
+
+            std::lock_guard lock{mutex_};
+            entries_.push_back({std::string{segmentId}, offset, block.size(), rowCount, firstMinute, lastMinute, std::move(zoneMaps)});
+        }
+
+        // false when the container is incomplete, it is removed then
+        bool finish(){
+            if(finished_) return !failed_;
+            finished_ = true;
+            if(descriptor_ < 0){
+                failed_ = true;
+                return false;
+            }
+
+            std::sort(entries_.begin(), entries_.end(), [](const Entry &left, const Entry &right){
+                return left.segmentId < right.segmentId;
+            });
+
+            std::string index;
+            for(const auto &entry : entries_){
+                _::put(index, static_cast<uint32_t>(entry.segmentId.size()));
+                index += entry.segmentId;
+                _::put(index, entry.offset);
+                _::put(index, entry.length);
+                _::put(index, entry.rowCount);
+                _::put(index, entry.firstMinute);
+                _::put(index, entry.lastMinute);
+                _::putZones(index, entry.zones);
+            }
+
+            _::Footer footer{end_.load(), entries_.size(), {}};
+            std::memcpy(footer.magic, _::Magic, sizeof(footer.magic));
+            _::put(index, footer);
+
+            if(!failed_ && !_::writeAll(descriptor_, index.data(), index.size(), footer.indexOffset)){
+                fmt::println("[!!! could not write the index of {} !!!]", path_);
+                failed_ = true;
+            }
+            if(::close(descriptor_) != 0) failed_ = true;
+            descriptor_ = -1;
+
+            if(failed_){
+                fmt::println("[!!! {} is incomplete and is removed !!!]", path_);
+                ::unlink(path_.c_str());
+            }
+            return !failed_;
+        }
+
+    private:
+        std::string path_;
+        int descriptor_;
+        ZoneMaps zoneMaps_;
+        std::atomic<uint64_t> end_{0};
+        std::mutex mutex_;
+        std::vector<Entry> entries_;
+        std::atomic<bool> failed_{false};
+        bool finished_{false};
+    };
+
+    // mapped container, blocks are views into the one mapping
+    class Reader{
+    public:
+        static std::optional<Reader> open(const std::string &path){
+            auto file{utilities::MappedFile::open(path)};
+            if(!file || file->size() < sizeof(_::Footer)){
+                fmt::println("[!!! could not open segment container {} !!!]", path);
+                return std::nullopt;
+            }
+
+            _::Footer footer;
+            std::memcpy(&footer, file->data() + file->size() - sizeof(footer), sizeof(footer));
+            if(std::memcmp(footer.magic, _::Magic, sizeof(footer.magic)) != 0 || footer.indexOffset > file->size() - sizeof(footer)){
+                fmt::println("[!!! {} is not a complete segment container !!!]", path);
+                return std::nullopt;
+            }
+
+            auto malformed{[&](){
+                fmt::println("[!!! {} has a malformed index !!!]", path);
+                return std::nullopt;
+            }};
+
+            Reader reader;
+            std::string_view index{file->data() + footer.indexOffset, file->size() - sizeof(footer) - footer.indexOffset};
+            for(uint64_t i{0}; i < footer.entryCount; i++){
+                uint32_t idLength{0};
+                Entry entry;
+                if(!_::take(index, idLength) || index.size() < idLength) return malformed();
+                entry.segmentId.assign(index.substr(0, idLength));
+                index.remove_prefix(idLength);
+                if(!_::take(index, entry.offset) || !_::take(index, entry.length) || !_::take(index, entry.rowCount)
+                    || !_::take(index, entry.firstMinute) || !_::take(index, entry.lastMinute) || !_::takeZones(index, entry.zones)){
+                    return malformed();
+                }
+                if(entry.offset > footer.indexOffset || entry.length > footer.indexOffset - entry.offset) return malformed();
+                reader.entries_.push_back(std::move(entry));
+            }
+
+            reader.file_ = std::move(*file);
+            return reader;
+        }
+
+        const std::vector<Entry> &entries() const{ return entries_; }
+
+        // start of the mapping, entry offsets are relative to it
+        const char *data() const{ return file_.data(); }
+
+        std::string_view block(const Entry &entry) const{
+            return {file_.data() + entry.offset, static_cast<size_t>(entry.length)};
+        }
+
+    private:
+        Reader() = default;
+
+        utilities::MappedFile file_;
+        std::vector<Entry> entries_;
+    };
+
+} // namespace container
@@ -0,0 +1,349 @@
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <fmt/core.h>
+
+#include "constants.hpp"
+#include "compressed_io.hpp"
+#include "csv_tokenizer.hpp"
+#include "segment_container.hpp"
+#include "time_columns.hpp"
+#include "utilities.hpp"
+#include "zone_maps.hpp"
+
+namespace query{
+
+    enum class Operator{ Equal, NotEqual, Less, LessEqual, Greater, GreaterEqual };
+
+    // "column<op>value" with = != < <= > >=. values that parse as numbers compare
+    // numerically against the cells that do, anything else compares as text.
+    // the timestamp column compares the rows' epoch minutes with a
+    // "YYYY-MM-DD" or "YYYY-MM-DDTHH:MM" value
+    struct Predicate{
+        std::string column;
+        Operator op;
+        std::string text;
+        std::optional<double> number;
+        std::optional<int32_t> minute;
+
+        static std::optional<Predicate> parse(std::string_view expression){
+            size_t position{expression.find_first_of("=!<>")};
+            if(position == 0 || position == std::string_view::npos) return std::nullopt;
+
+            Predicate predicate;
+            predicate.column.assign(expression.substr(0, position));
+            std::string_view rest{expression.substr(position)};
+            auto take{[&](std::string_view symbol, Operator op){
+                if(rest.substr(0, symbol.size()) != symbol) return false;
+                predicate.op = op;
+                rest.remove_prefix(symbol.size());
+                return true;
+            }};
+            if(!take("<=", Operator::LessEqual) && !take(">=", Operator::GreaterEqual) && !take("!=", Operator::NotEqual)
+                && !take("=", Operator::Equal) && !take("<", Operator::Less) && !take(">", Operator::Greater)){
+                return std::nullopt;
+            }
+            predicate.text.assign(rest);
+
+            if(predicate.column == constants::zone_maps::TimestampColumn){
+                std::string value{predicate.text.size() == 10 ? predicate.text + "T00:00" : predicate.text};
+                units::Timestamp timestamp{utilities::parseTimestamp(value)};
+                if(timestamp.year == 0) return std::nullopt;
+                predicate.minute = timestamp.toEpochMinutes();
+                return predicate;
+            }
+
+            double number{0.0};
+            auto [end, error]{std::from_chars(predicate.text.data(), predicate.text.data() + predicate.text.size(), number)};
+            if(error == std::errc{} && end == predicate.text.data() + predicate.text.size() && !predicate.text.empty()){
+                predicate.number = number;
+            }
+            return predicate;
+        }
+
+        // whether any value in [low, high] can satisfy the predicate
+        template<typename T>
+        bool rangeMayMatch(const T &low, const T &high, const T &value) const{
+            switch(op){
+                case Operator::Equal:           return !(value < low) && !(high < value);
+                case Operator::NotEqual:        return low < high || high < low || !(value == low);
+                case Operator::Less:            return low < value;
+                case Operator::LessEqual:       return !(value < low);
+                case Operator::Greater:         return value < high;
+                case Operator::GreaterEqual:    return !(high < value);
+            }
+            return true;
+        }
+
+        template<typename T>
+        bool compare(const T &left, const T &right) const{
+            switch(op){
+                case Operator::Equal:           return left == right;
+                case Operator::NotEqual:        return !(left == right);
+                case Operator::Less:            return left < right;
+                case Operator::LessEqual:       return !(right < left);
+                case Operator::Greater:         return right < left;
+                case Operator::GreaterEqual:    return !(left < right);
+            }
+            return false;
+        }
+
+        // column is the predicate's column in the zone's header
+        bool mayMatch(const zones::ZoneMap &zone, size_t column) const{
+            if(minute) return zone.firstMinute <= zone.lastMinute && rangeMayMatch(zone.firstMinute, zone.lastMinute, *minute);
+            if(column >= zone.columns.size() || !zone.columns[column].present) return false;
+            const zones::ColumnZone &bounds{zone.columns[column]};
+            if(number) return !std::isnan(bounds.min) && rangeMayMatch(bounds.min, bounds.max, *number);
+            return rangeMayMatch(std::string_view{bounds.minText}, std::string_view{bounds.maxText}, std::string_view{text});
+        }
+
+        bool matches(std::string_view value) const{
+            if(!number) return compare(value, std::string_view{text});
+            double parsed{0.0};
+            auto [end, error]{std::from_chars(value.data(), value.data() + value.size(), parsed)};
+            if(error != std::errc{} || end != value.data() + value.size() || std::isnan(parsed)) return false;
+            return compare(parsed, *number);
+        }
+
+        bool matchesMinute(int32_t rowMinute) const{
+            return rowMinute != units::NoMinute && compare(rowMinute, *minute);
+        }
+    };
+
+    namespace _{
+
+        // a segment whose summary zone passes, with its header resolved
+        struct QuerySegment{
+            size_t entry;
+            std::string headerLine;
+            std::vector<size_t> columns;    // per predicate, unused for timestamp predicates
+            std::optional<units::TimeColumns> timeColumns;
+        };
+
+        struct QueryUnit{
+            size_t segment;     // into the QuerySegment list
+            size_t zone;        // WholeBlock for a block written without zone maps
+        };
+
+        constexpr size_t WholeBlock{std::numeric_limits<size_t>::max()};
+
+        // every row of a block as one zone without bounds, it may match anything
+        inline zones::ZoneMap wholeBlock(std::string_view block){
+            zones::ZoneMap zone;
+            size_t headerEnd{block.find('\n')};
+            zone.offset = headerEnd == std::string_view::npos ? block.size() : headerEnd + 1;
+            zone.length = block.size() - zone.offset;
+            return zone;
+        }
+
+        struct UnitResult{
+            std::string rows;
+            uint64_t rowCount{0};
+            int32_t firstMinute{std::numeric_limits<int32_t>::max()};
+            int32_t lastMinute{std::numeric_limits<int32_t>::min()};
+        };
+
+        inline bool zonePasses(const std::vector<Predicate> &predicates, const QuerySegment &segment, const zones::ZoneMap &zone){
+            for(size_t i{0}; i < predicates.size(); i++){
+                if(!predicates[i].mayMatch(zone, segment.columns[i])) return false;
+            }
+            return true;
+        }
+
+        inline UnitResult scanZone(
+            const std::vector<Predicate> &predicates,
+            const QuerySegment &segment,
+            std::string_view block,
+            const zones::ZoneMap &zone
+        ){
+            UnitResult result;
+            tokenizer::Reader csv;
+            csv.parseBody(block.substr(zone.offset, zone.length));
+            for(const auto &row : csv){
+                int32_t minute{segment.timeColumns ? segment.timeColumns->minuteOf(row, units::NoMinute) : units::NoMinute};
+                bool matched{true};
+                for(size_t i{0}; i < predicates.size() && matched; i++){
+                    if(predicates[i].minute) matched = predicates[i].matchesMinute(minute);
+                    else matched = segment.columns[i] < row.size() && predicates[i].matches(row[segment.columns[i]].view());
+                }
+                if(!matched) continue;
+
+                result.rows += row.text();
+                result.rows += '\n';
+                result.rowCount++;
+                if(minute != units::NoMinute){
+                    result.firstMinute = std::min(result.firstMinute, minute);
+                    result.lastMinute = std::max(result.lastMinute, minute);
+                }
+            }
+            return result;
+        }
+
+    } // namespace _
+
+    // joiner query [--input container] [--output path] predicate...
+    // the rows of the container's segments matching every predicate, in segment
+    // then row order. segments and zones whose bounds rule a predicate out are
+    // never read; the remaining zones are scanned in parallel windows and
+    // written in order. output is csv (stdout without --output, compressed by
+    // extension) or, for a .seg path, a segment container with fresh zone maps.
+    // progress goes to stderr so stdout stays clean
+    inline int runQuery(const std::vector<std::string> &arguments){
+        std::string inputPath{constants::paths::MergedTrafficWeather};
+        std::string outputPath;
+        std::vector<Predicate> predicates;
+        for(size_t i{0}; i < arguments.size(); i++){
+            if(arguments[i] == "--input" && i + 1 < arguments.size()) inputPath = arguments[++i];
+            else if(arguments[i] == "--output" && i + 1 < arguments.size()) outputPath = arguments[++i];
+            else{
+                auto predicate{Predicate::parse(arguments[i])};
+                if(!predicate){
+                    fmt::println(stderr, "[!!! could not parse predicate \"{}\", expected column=value (= != < <= > >=) !!!]", arguments[i]);
+                    return 1;
+                }
+                predicates.push_back(std::move(*predicate));
+            }
+        }
+
+        auto input{container::Reader::open(inputPath)};
+        if(!input) return 1;
+        const auto &entries{input->entries()};
+
+        // resolve the columns per segment, then rule out whole segments on their summary zone
+        std::vector<_::QuerySegment> segments;
+        std::vector<_::QueryUnit> scanUnits;
+        size_t zoneCount{0};
+        for(size_t entry{0}; entry < entries.size(); entry++){
+            zoneCount += std::max<size_t>(1, entries[entry].zones.size());
+            std::string_view block{input->block(entries[entry])};
+
+            _::QuerySegment segment{entry, {}, {}, std::nullopt};
+            segment.headerLine.assign(block.substr(0, std::min(block.find('\n'), block.size())));
+            if(!segment.headerLine.empty() && segment.headerLine.back() == '\r') segment.headerLine.pop_back();
+
+            tokenizer::Reader csv;
+            csv.parse(segment.headerLine);
+            std::vector<std::string> header;
+            for(const auto &cell : csv.header()){
+                std::string value;
+                cell.read_value(value);
+                header.push_back(value);
+            }
+            segment.timeColumns = units::TimeColumns::find(header);
+
+            bool resolved{true};
+            for(const auto &predicate : predicates){
+                auto found{std::find(header.begin(), header.end(), predicate.column)};
+                if(!predicate.minute && found == header.end()) resolved = false;
+                segment.columns.push_back(static_cast<size_t>(found - header.begin()));
+            }
+            if(!resolved) continue;
+
+            // no zone maps rule nothing out, the whole block is scanned
+            if(entries[entry].zones.empty()){
+                scanUnits.push_back({segments.size(), _::WholeBlock});
+                segments.push_back(std::move(segment));
+                continue;
+            }
+
+            zones::ZoneMap summary;
+            for(const auto &zone : entries[entry].zones) summary.include(zone);
+            if(!_::zonePasses(predicates, segment, summary)) continue;
+
+            for(size_t zone{0}; zone < entries[entry].zones.size(); zone++){
+                if(_::zonePasses(predicates, segment, entries[entry].zones[zone])) scanUnits.push_back({segments.size(), zone});
+            }
+            segments.push_back(std::move(segment));
+        }
+        fmt::println(stderr, "{}: {} of {} segments and {} of {} zones may match", inputPath, segments.size(), entries.size(), scanUnits.size(), zoneCount);
+
+        bool toContainer{outputPath.size() > 4 && outputPath.substr(outputPath.size() - 4) == ".seg"};
+        std::unique_ptr<container::Writer> writer;
+        std::unique_ptr<compression::OutputFile> file;
+        std::ostream *out{&std::cout};
+        if(toContainer){
+            writer = std::make_unique<container::Writer>(outputPath, container::ZoneMaps::Build);
+            if(!writer->isOpen()) return 1;
+        }else if(!outputPath.empty()){
+            file = std::make_unique<compression::OutputFile>(outputPath);
+            out = file.get();
+        }
+
+        bool headerWritten{false};
+        std::string segmentBlock;
+        _::UnitResult segmentResult;
+        size_t openSegment{segments.size()};
+        uint64_t matchedRows{0};
+        auto closeSegment{[&](){
+            if(openSegment == segments.size() || segmentResult.rowCount == 0) return;
+            const auto &entry{entries[segments[openSegment].entry]};
+            if(segmentResult.firstMinute > segmentResult.lastMinute){
+                writer->append(entry.segmentId, segmentBlock, segmentResult.rowCount);
+            }else{
+                writer->append(entry.segmentId, segmentBlock, segmentResult.rowCount, segmentResult.firstMinute, segmentResult.lastMinute);
+            }
+        }};
+
+        size_t window{std::max<size_t>(1, constants::zone_maps::QueryWindowUnits)};
+        for(size_t first{0}; first < scanUnits.size(); first += window){
+            size_t count{std::min(window, scanUnits.size() - first)};
+            std::vector<_::UnitResult> results(count);
+            utilities::parallelFor(count, constants::system::ThreadCount, [&](size_t i){
+                const _::QueryUnit &unit{scanUnits[first + i]};
+                const _::QuerySegment &segment{segments[unit.segment]};
+                const container::Entry &entry{entries[segment.entry]};
+                std::string_view block{input->block(entry)};
+                results[i] = _::scanZone(predicates, segment, block, unit.zone == _::WholeBlock ? _::wholeBlock(block) : entry.zones[unit.zone]);
+            });
+
+            for(size_t i{0}; i < count; i++){
+                const _::UnitResult &result{results[i]};
+                matchedRows += result.rowCount;
+                size_t segment{scanUnits[first + i].segment};
+
+                if(toContainer){
+                    if(segment != openSegment){
+                        closeSegment();
+                        openSegment = segment;
+                        segmentBlock = segments[segment].headerLine + '\n';
+                        segmentResult = {};
+                    }
+                    segmentBlock += result.rows;
+                    segmentResult.rowCount += result.rowCount;
+                    segmentResult.firstMinute = std::min(segmentResult.firstMinute, result.firstMinute);
+                    segmentResult.lastMinute = std::max(segmentResult.lastMinute, result.lastMinute);
+                    continue;
+                }
+
+                if(result.rowCount == 0) continue;
+                if(!headerWritten){
+                    *out << segments[segment].headerLine << '\n';
+                    headerWritten = true;
+                }
+                *out << result.rows;
+            }
+        }
+        if(toContainer){
+            closeSegment();
+            if(!writer->finish()) return 1;
+        }else if(!headerWritten && !segments.empty()){
+            *out << segments.front().headerLine << '\n';
+        }
+        out->flush();
+        if(file && !file->close()) return 1;
+
+        fmt::println(stderr, "{} matching rows{}{}", matchedRows, outputPath.empty() ? "" : " in ", outputPath);
+        return 0;
+    }
+
+} // namespace query
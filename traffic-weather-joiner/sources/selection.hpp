@@ -0,0 +1,93 @@
+#pragma once
+
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "constants.hpp"
+#include "units.hpp"
+
+namespace selection{
+
+    // maps input columns to their position in the projected row, -1 means the
+    // cell is never read. an empty keep list keeps every column
+    class Projection{
+    public:
+        Projection(
+            const std::vector<std::string> &inputHeader,
+            const std::vector<std::string> &keep,
+            const std::vector<std::string_view> &required
+        ) : slots_(inputHeader.size(), -1){
+            for(size_t i{0}; i < inputHeader.size(); i++){
+                const std::string &name{inputHeader[i]};
+                bool selected{keep.empty()
+                    || std::find(keep.begin(), keep.end(), name) != keep.end()
+                    || std::find(required.begin(), required.end(), std::string_view{name}) != required.end()};
+                if(!selected) continue;
+                slots_[i] = static_cast<int>(header_.size());
+                header_.push_back(name);
+            }
+        }
+
+        const std::vector<std::string> &header() const{ return header_; }
+        size_t size() const{ return header_.size(); }
+
+        int slotOf(size_t inputColumn) const{
+            return inputColumn < slots_.size() ? slots_[inputColumn] : -1;
+        }
+
+        // reads only the projected cells of a csv row
+        template<typename Row>
+        std::vector<std::string> read(const Row &row) const{
+            std::vector<std::string> fields(header_.size());
+            size_t column{0};
+            size_t filled{0};
+            for(const auto &cell : row){
+                int slot{slotOf(column++)};
+                if(slot < 0) continue;
+                cell.read_value(fields[slot]);
+                filled = std::max(filled, static_cast<size_t>(slot) + 1);
+            }
+            fields.resize(filled);
+            return fields;
+        }
+
+    private:
+        std::vector<int> slots_;
+        std::vector<std::string> header_;
+    };
+
+    inline bool contains(const std::vector<std::string> &values, std::string_view value){
+        return values.empty() || std::find(values.begin(), values.end(), value) != values.end();
+    }
+
+    inline bool segmentSelected(std::string_view segmentId){
+        return contains(constants::selection::segmentIds(), segmentId);
+    }
+
+    inline bool boroughSelected(std::string_view borough){
+        return contains(constants::selection::boroughs(), borough);
+    }
+
+    inline bool hasTimeRange(){
+        return constants::selection::FirstDate != 0 || constants::selection::LastDate != 0;
+    }
+
+    // widened by marginMinutes on both ends so weather just outside the range still joins
+    inline bool inTimeRange(const units::Timestamp &timestamp, int marginMinutes = 0){
+        auto dayStart{[](int packedDate){
+            return units::Timestamp{packedDate / 10000, packedDate / 100 % 100, packedDate % 100, 0, 0}.toEpochMinutes();
+        }};
+
+        int minute{timestamp.toEpochMinutes()};
+        if(constants::selection::FirstDate != 0 && minute < dayStart(constants::selection::FirstDate) - marginMinutes){
+            return false;
+        }
+        if(constants::selection::LastDate != 0 && minute >= dayStart(constants::selection::LastDate) + 24 * 60 + marginMinutes){
+            return false;
+        }
+        return true;
+    }
+
+} // namespace selection
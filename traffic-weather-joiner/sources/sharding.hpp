@@ -0,0 +1,244 @@
+#pragma once
+
+#include <algorithm>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <fmt/core.h>
+
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "constants.hpp"
+#include "compressed_io.hpp"
+#include "csv_tokenizer.hpp"
+#include "time_columns.hpp"
+#include "utilities.hpp"
+
+extern char **environ;
+
+namespace sharding{
+
+    // which part of the segments this process owns. segment ids are hash
+    // partitioned, so shards need no coordination and every segment (with all
+    // of its rows) lands in exactly one shard. the default owns everything
+    struct Shard{
+        size_t index{0};
+        size_t count{1};
+
+        // "i/N" with i < N
+        static std::optional<Shard> parse(std::string_view text){
+            size_t slash{text.find('/')};
+            if(slash == std::string_view::npos) return std::nullopt;
+            std::string index{text.substr(0, slash)};
+            std::string count{text.substr(slash + 1)};
+            char *end{nullptr};
+            unsigned long parsedIndex{std::strtoul(index.c_str(), &end, 10)};
+            if(end == index.c_str() || *end != '\0') return std::nullopt;
+            unsigned long parsedCount{std::strtoul(count.c_str(), &end, 10)};
+            if(end == count.c_str() || *end != '\0' || parsedCount == 0 || parsedIndex >= parsedCount) return std::nullopt;
+            return Shard{parsedIndex, parsedCount};
+        }
+
+        bool isSharded() const{ return count > 1; }
+
+        bool owns(std::string_view segmentId) const{
+            return count == 1 || utilities::hashBytes(segmentId.data(), segmentId.size()) % count == index;
+        }
+
+        // the shard's copy of an output: ./output/name.csv -> ./output/name.shard-1-of-4.csv
+        std::string path(const std::string &path) const{
+            if(count == 1) return path;
+            size_t name{path.find_last_of('/')};
+            name = name == std::string::npos ? 0 : name + 1;
+            size_t extension{path.find('.', name + 1)};
+            if(extension == std::string::npos) extension = path.size();
+            return fmt::format("{}.shard-{}-of-{}{}", path.substr(0, extension), index, count, path.substr(extension));
+        }
+    };
+
+    namespace _{
+
+        // one shard's csv, read a row at a time
+        struct ShardInput{
+            tokenizer::Reader csv;
+            compression::Input input;
+            tokenizer::Reader::Iterator row;
+            std::optional<units::TimeColumns> time;    // set when merging by time
+            int32_t minute{units::NoMinute};
+            std::string key;
+            bool done{false};
+
+            void advance(size_t keyColumn){
+                if(done) return;
+                if(!(row != tokenizer::Reader::Iterator{})){
+                    done = true;
+                    return;
+                }
+                tokenizer::Row current{*row};
+                key.assign(keyColumn < current.size() ? current[keyColumn].view() : std::string_view{});
+                if(time) minute = time->minuteOf(current, minute);
+            }
+
+            bool before(const ShardInput &other) const{
+                return minute < other.minute || (minute == other.minute && key < other.key);
+            }
+        };
+
+        inline std::vector<std::string> readHeader(const tokenizer::Reader &csv){
+            std::vector<std::string> header;
+            for(const auto &cell : csv.header()){
+                std::string value;
+                cell.read_value(value);
+                header.push_back(value);
+            }
+            return header;
+        }
+
+    } // namespace _
+
+    // merges every shard's copy of path, each ordered by keyColumn (by time and
+    // then keyColumn with byTime), into path. ties go to the lower shard, and as
+    // a segment lives in one shard its rows stay together, so the result is the
+    // order a single process would write
+    inline bool mergeSortedShards(const std::string &path, size_t shardCount, std::string_view keyColumn, bool byTime = false){
+        std::vector<std::unique_ptr<_::ShardInput>> shards;
+        std::vector<std::string> header;
+        size_t keyIndex{0};
+
+        for(size_t shard{0}; shard < shardCount; shard++){
+            std::string shardPath{Shard{shard, shardCount}.path(path)};
+            auto input{std::make_unique<_::ShardInput>()};
+            input->input = compression::open(input->csv, shardPath);
+            if(!input->input){
+                fmt::println("[!!! missing shard output {} !!!]", shardPath);
+                return false;
+            }
+
+            std::vector<std::string> shardHeader{_::readHeader(input->csv)};
+            if(shard == 0){
+                header = shardHeader;
+                keyIndex = utilities::findColumn(header, std::string{keyColumn});
+            }else if(shardHeader != header){
+                fmt::println("[!!! {} has a different header than shard 0 !!!]", shardPath);
+                return false;
+            }
+
+            if(byTime){
+                input->time = units::TimeColumns::find(header);
+                if(!input->time){
+                    fmt::println("[!!! {} has no time columns to merge by !!!]", shardPath);
+                    return false;
+                }
+            }
+            input->row = input->csv.begin();
+            input->advance(keyIndex);
+            shards.push_back(std::move(input));
+        }
+
+        compression::OutputFile out{path};
+        for(size_t i{0}; i < header.size(); i++){
+            if(i > 0) out << ',';
+            out << header[i];
+        }
+        out << '\n';
+
+        // a handful of shards, a linear scan for the smallest key is enough
+        size_t rowCount{0};
+        while(true){
+            _::ShardInput *next{nullptr};
+            for(const auto &shard : shards){
+                if(!shard->done && (next == nullptr || shard->before(*next))) next = shard.get();
+            }
+            if(next == nullptr) break;
+
+            out << (*next->row).text() << '\n';
+            rowCount++;
+            ++next->row;
+            next->advance(keyIndex);
+        }
+        if(!out.close()) return false;
+
+        fmt::println("merged {} rows from {} shards into {}", rowCount, shardCount, path);
+        return true;
+    }
+
+    // small files (the segment index) whose row order is not keyed: every
+    // shard's rows, sorted by keyColumn
+    inline bool collectShards(const std::string &path, size_t shardCount, std::string_view keyColumn){
+        std::vector<std::string> header;
+        std::vector<std::pair<std::string, std::string>> rows;
+
+        for(size_t shard{0}; shard < shardCount; shard++){
+            std::string shardPath{Shard{shard, shardCount}.path(path)};
+            tokenizer::Reader csv;
+            auto input{compression::open(csv, shardPath)};
+            if(!input){
+                fmt::println("[!!! missing shard output {} !!!]", shardPath);
+                return false;
+            }
+
+            std::vector<std::string> shardHeader{_::readHeader(csv)};
+            if(shard == 0) header = shardHeader;
+            else if(shardHeader != header){
+                fmt::println("[!!! {} has a different header than shard 0 !!!]", shardPath);
+                return false;
+            }
+
+            size_t keyIndex{utilities::findColumn(header, std::string{keyColumn})};
+            for(const auto &row : csv){
+                rows.emplace_back(keyIndex < row.size() ? row[keyIndex].view() : std::string_view{}, row.text());
+            }
+        }
+
+        std::stable_sort(rows.begin(), rows.end(), [](const auto &left, const auto &right){
+            return left.first < right.first;
+        });
+
+        compression::OutputFile out{path};
+        for(size_t i{0}; i < header.size(); i++){
+            if(i > 0) out << ',';
+            out << header[i];
+        }
+        out << '\n';
+        for(const auto &row : rows) out << row.second << '\n';
+        if(!out.close()) return false;
+
+        fmt::println("collected {} rows from {} shards into {}", rows.size(), shardCount, path);
+        return true;
+    }
+
+    // runs "<executable> --shard i/N" for every shard on this machine and waits
+    // for all of them, true when every shard exited cleanly
+    inline bool runLocalShards(const std::string &executable, size_t shardCount){
+        std::vector<pid_t> children;
+        for(size_t shard{0}; shard < shardCount; shard++){
+            std::string flag{"--shard"};
+            std::string value{fmt::format("{}/{}", shard, shardCount)};
+            std::vector<char *> arguments{
+                const_cast<char *>(executable.c_str()), flag.data(), value.data(), nullptr
+            };
+
+            pid_t child{0};
+            if(::posix_spawn(&child, executable.c_str(), nullptr, nullptr, arguments.data(), environ) != 0){
+                fmt::println("[!!! could not start shard {} !!!]", value);
+                continue;
+            }
+            children.push_back(child);
+        }
+
+        bool succeeded{children.size() == shardCount};
+        for(pid_t child : children){
+            int status{0};
+            if(::waitpid(child, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0){
+                fmt::println("[!!! shard process {} failed !!!]", child);
+                succeeded = false;
+            }
+        }
+        return succeeded;
+    }
+
+} // namespace sharding
@@ -1,47 +1,44 @@
 #pragma once
 
-#include <csv2/reader.hpp>
 #include <string>
 #include <vector>
 #include <algorithm>
-#include <filesystem>
-#include <fstream>
+#include <atomic>
+#include <memory_resource>
+#include <sstream>
 #include <fmt/core.h>
 
 #include "constants.hpp"
+#include "csv_tokenizer.hpp"
+#include "radix_sort.hpp"
+#include "segment_container.hpp"
 #include "units.hpp"
+#include "rolling_features.hpp"
 
 inline void sortByTime(
-    const std::string &inputDirectory,
-    const std::string &outputDirectory
+    const std::string &inputContainerPath,
+    const std::string &outputContainerPath
 ){
-    std::filesystem::create_directories(outputDirectory);
-    
-    std::vector<std::filesystem::path> csvFiles;
-    for(const auto &entry : std::filesystem::directory_iterator(inputDirectory)){
-        if(entry.is_regular_file() && entry.path().extension() == ".csv"){
-            csvFiles.push_back(entry.path());
-        }
-    }
-    
-    fmt::println("found {} CSV files to sort", csvFiles.size());
-    
-    size_t fileCount{0};
-    for(const auto &inputPath : csvFiles){
-        fileCount++;
-        
-        if(fileCount % constants::system::FileProgressInterval == 0){
-            fmt::println("sorting file {}/{}", fileCount, csvFiles.size());
+    auto input{container::Reader::open(inputContainerPath)};
+    if(!input) return;
+    const auto &segments{input->entries()};
+
+    fmt::println("found {} segments to sort", segments.size());
+
+    container::Writer writer{outputContainerPath};
+
+    std::atomic<size_t> segmentCount{0};
+    utilities::ArenaPool arenas;
+    utilities::parallelFor(segments.size(), constants::system::ThreadCount, [&](size_t segment){
+        const container::Entry &entry{segments[segment]};
+
+        if(++segmentCount % constants::system::FileProgressInterval == 0){
+            fmt::println("sorting segment {}/{}", segmentCount.load(), segments.size());
         }
         
-        csv2::Reader<
-            csv2::delimiter<','>,
-            csv2::quote_character<'"'>,
-            csv2::first_row_is_header<true>,
-            csv2::trim_policy::trim_whitespace
-        > csv;
+        tokenizer::Reader csv;
         
-        csv.mmap(inputPath.string());
+        csv.parse(input->block(entry));
         
         std::vector<std::string> header;
         for(const auto &cell : csv.header()){
@@ -55,6 +52,7 @@ inline void sortByTime(
         size_t dayIndex{0};
         size_t hourIndex{0};
         size_t minuteIndex{0};
+        size_t volumeIndex{header.size()};
         
         for(size_t i{0}; i < header.size(); i++){
             if(header[i] == constants::column_names::Year)  yearIndex = i;
@@ -62,51 +60,78 @@ inline void sortByTime(
             if(header[i] == constants::column_names::Day)   dayIndex = i;
             if(header[i] == constants::column_names::Hour)  hourIndex = i;
             if(header[i] == constants::column_names::Minute)minuteIndex = i;
+            if(header[i] == constants::column_names::Volume)volumeIndex = i;
         }
+
+        // with aggregation on, lag features are computed over the buckets instead
+        bool addLagFeatures{
+            constants::flags::LagFeatures && !constants::flags::AggregateByTime && volumeIndex < header.size()
+        };
         
-        std::vector<units::TimeRowData> rows;
+        // rows stay where they were parsed, only the permutation is sorted. their
+        // cells live in the worker's arena, released together with the segment
+        auto arena{arenas.acquire()};
+        std::pmr::vector<std::pmr::vector<std::pmr::string>> rows{arena.resource()};
+        std::vector<int32_t> minutes;
+        rows.reserve(entry.rowCount);
+        minutes.reserve(entry.rowCount);
         
         for(const auto &row : csv){
-            std::vector<std::string> fields;
+            std::pmr::vector<std::pmr::string> fields{arena.resource()};
+            fields.reserve(row.size());
             for(const auto &cell : row){
-                std::string value;
-                cell.read_value(value);
-                fields.push_back(value);
+                cell.read_value(fields.emplace_back());
             }
             
             size_t requiredSize{std::max({yearIndex, monthIndex, dayIndex, hourIndex, minuteIndex}) + 1};
+            if(addLagFeatures) requiredSize = std::max(requiredSize, volumeIndex + 1);
             if(fields.size() < requiredSize) continue;
             
-            units::TimeRowData timeRow;
-            timeRow.timestamp.year  = std::stoi(fields[yearIndex]);
-            timeRow.timestamp.month = std::stoi(fields[monthIndex]);
-            timeRow.timestamp.day   = std::stoi(fields[dayIndex]);
-            timeRow.timestamp.hour  = std::stoi(fields[hourIndex]);
-            timeRow.timestamp.minute= std::stoi(fields[minuteIndex]);
-            timeRow.fullRow = fields;
-            
-            rows.push_back(timeRow);
+            units::Timestamp timestamp;
+            timestamp.year  = utilities::toInt(fields[yearIndex]);
+            timestamp.month = utilities::toInt(fields[monthIndex]);
+            timestamp.day   = utilities::toInt(fields[dayIndex]);
+            timestamp.hour  = utilities::toInt(fields[hourIndex]);
+            timestamp.minute= utilities::toInt(fields[minuteIndex]);
+            minutes.push_back(timestamp.toEpochMinutes());
+            rows.push_back(std::move(fields));
         }
         
-        std::sort(rows.begin(), rows.end());
+        std::vector<uint32_t> order{utilities::sortPermutation(minutes)};
         
-        std::filesystem::path outputPath{std::filesystem::path(outputDirectory) / inputPath.filename()};
-        std::ofstream out{outputPath};
+        std::ostringstream out;
         
         for(size_t i{0}; i < header.size(); i++){
             if(i > 0) out << ',';
             out << header[i];
         }
+        if(addLagFeatures) feature_engineering::LagFeatures::writeHeader(out);
         out << '\n';
         
-        for(const auto &timeRow : rows){
-            for(size_t i{0}; i < timeRow.fullRow.size(); i++){
+        // rows are time ordered here, so lag features come out of the same write pass
+        feature_engineering::LagFeatures lagFeatures;
+        for(uint32_t index : order){
+            const auto &fields{rows[index]};
+            for(size_t i{0}; i < fields.size(); i++){
                 if(i > 0) out << ',';
-                out << timeRow.fullRow[i];
+                out << fields[i];
+            }
+            if(addLagFeatures){
+                lagFeatures.writeRow(out, minutes[index], fields[volumeIndex].c_str());
             }
             out << '\n';
         }
-    }
-    
-    fmt::println("done: sorted {} files to {}", csvFiles.size(), outputDirectory);
+
+        if(rows.empty()){
+            writer.append(entry.segmentId, out.str(), 0);
+            return;
+        }
+        writer.append(
+            entry.segmentId, out.str(), rows.size(),
+            minutes[order.front()], minutes[order.back()]
+        );
+    });
+    if(!writer.finish()) return;
+
+    fmt::println("done: sorted {} segments to {}", segments.size(), outputContainerPath);
 }
@@ -1,6 +1,5 @@
 #pragma once
 
-#include <csv2/reader.hpp>
 #include <string>
 #include <vector>
 #include <algorithm>
@@ -8,74 +7,103 @@
 #include <cmath>
 #include <fmt/core.h>
 #include <fstream>
-#include <unordered_map>
+#include <sstream>
 
 #include "constants.hpp"
-
-namespace _{
-
-    inline int findClosestStation(double latitude, double longitude){
-        const auto &stations{constants::weather::weatherStations()};
-        int closestId{stations[0].id};
-        
-        double deltaLatitude{latitude - stations[0].latitude};
-        double deltaLongitude{longitude - stations[0].longitude};
-        double closestDistance{deltaLatitude * deltaLatitude + deltaLongitude * deltaLongitude};
-        
-        for(const auto &station : stations){
-            double deltaLatitude{latitude - station.latitude};
-            double deltaLongitude{longitude - station.longitude};
-            double distance{deltaLatitude * deltaLatitude + deltaLongitude * deltaLongitude};
-            
-            if(distance < closestDistance){
-                closestDistance = distance;
-                closestId = station.id;
-            }
-        }
-        
-        return closestId;
-    }
-
-} // namespace _
+#include "csv_tokenizer.hpp"
+#include "compressed_io.hpp"
+#include "road_groups.hpp"
+#include "segment_container.hpp"
+#include "selection.hpp"
+#include "sharding.hpp"
+#include "station_blend.hpp"
+#include "string_interner.hpp"
 
 inline void splitBySegmentId(
     const std::string &inputCsvPath, 
-    const std::string &outputDirectory
+    const std::string &outputContainerPath,
+    const std::string &segmentIndexPath,
+    const sharding::Shard &shard
 ){
     fmt::println("loading {}...", inputCsvPath);
 
-    csv2::Reader<
-        csv2::delimiter<','>, 
-        csv2::quote_character<'"'>, 
-        csv2::first_row_is_header<true>,
-        csv2::trim_policy::trim_whitespace
-    > csv;
-    csv.mmap(inputCsvPath);
+    tokenizer::Reader csv;
+    auto input{compression::open(csv, inputCsvPath)};
 
-    std::vector<std::string> header;
+    std::vector<std::string> inputHeader;
     for(const auto &cell : csv.header()){
         std::string value;
         cell.read_value(value);
-        header.push_back(value);
+        inputHeader.push_back(value);
+    }
+
+    // columns later stages depend on survive any projection
+    std::vector<std::string_view> requiredColumns{
+        constants::column_names::SegmentId,
+        constants::column_names::Latitude,
+        constants::column_names::Longitude,
+        constants::column_names::Year,
+        constants::column_names::Month,
+        constants::column_names::Day,
+        constants::column_names::Hour,
+        constants::column_names::Minute,
+        constants::column_names::Volume,
+        constants::column_names::Street
+    };
+    if(!constants::selection::boroughs().empty()){
+        requiredColumns.push_back(constants::column_names::Borough);
     }
 
+    selection::Projection projection{inputHeader, constants::selection::trafficColumns(), requiredColumns};
+    const std::vector<std::string> &header{projection.header()};
+
     size_t segmentIdIndex{0};
     size_t latitudeIndex{0};
     size_t longitudeIndex{0};
+    size_t streetIndex{header.size()};
+    size_t boroughIndex{header.size()};
+    size_t yearIndex{0};
+    size_t monthIndex{0};
+    size_t dayIndex{0};
+    size_t hourIndex{0};
+    size_t minuteIndex{0};
     
     for(size_t i{0}; i < header.size(); i++){
         if(header[i] == constants::column_names::SegmentId) segmentIdIndex = i;
         if(header[i] == constants::column_names::Latitude)  latitudeIndex = i;
         if(header[i] == constants::column_names::Longitude) longitudeIndex = i;
+        if(header[i] == constants::column_names::Street)    streetIndex = i;
+        if(header[i] == constants::column_names::Borough)   boroughIndex = i;
+        if(header[i] == constants::column_names::Year)      yearIndex = i;
+        if(header[i] == constants::column_names::Month)     monthIndex = i;
+        if(header[i] == constants::column_names::Day)       dayIndex = i;
+        if(header[i] == constants::column_names::Hour)      hourIndex = i;
+        if(header[i] == constants::column_names::Minute)    minuteIndex = i;
     }
 
+    bool filterBoroughs{!constants::selection::boroughs().empty() && boroughIndex < header.size()};
+    bool filterTime{selection::hasTimeRange()};
+
+    bool classifyRoadGroups{constants::flags::ClassifyRoadGroups && streetIndex < header.size()};
+    feature_engineering::RoadGroupClassifier classifier;
+
     struct LocationData{
         int weatherStationId;
+        weather::Blend blend;
+        double latitude;
+        double longitude;
+        int roadGroup;
+        bool dropped;
+        bool foreign;       // owned by another shard
         std::vector<std::vector<std::string>> rows;
     };
 
-    std::unordered_map<std::string, LocationData> groups;
+    // segment ids are interned to dense indices into groups, in first seen order
+    utilities::StringInterner segmentIds;
+    std::vector<LocationData> groups;
     size_t rowCount{0};
+    size_t droppedRowCount{0};
+    size_t foreignRowCount{0};
 
     for(const auto &row : csv){
         rowCount++;
@@ -83,59 +111,143 @@ inline void splitBySegmentId(
             fmt::println("processed {} rows", rowCount);
         }
 
-        std::vector<std::string> fields;
-        for(const auto &cell : row){
-            std::string value;
-            cell.read_value(value);
-            fields.push_back(value);
-        }
+        std::vector<std::string> fields{projection.read(row)};
 
         size_t requiredSize{std::max({segmentIdIndex, latitudeIndex, longitudeIndex}) + 1};
+        if(classifyRoadGroups) requiredSize = std::max(requiredSize, streetIndex + 1);
+        if(filterBoroughs) requiredSize = std::max(requiredSize, boroughIndex + 1);
+        if(filterTime) requiredSize = std::max({requiredSize, yearIndex + 1, monthIndex + 1, dayIndex + 1, hourIndex + 1, minuteIndex + 1});
         if(fields.size() < requiredSize) continue;
 
-        std::string segmentId{fields[segmentIdIndex]};
+        // row predicates, rejected rows are never buffered or written
+        if(!selection::segmentSelected(fields[segmentIdIndex])) continue;
+        if(filterBoroughs && !selection::boroughSelected(fields[boroughIndex])) continue;
+        if(filterTime){
+            units::Timestamp timestamp{
+                std::stoi(fields[yearIndex]),
+                std::stoi(fields[monthIndex]),
+                std::stoi(fields[dayIndex]),
+                std::stoi(fields[hourIndex]),
+                std::stoi(fields[minuteIndex])
+            };
+            if(!selection::inTimeRange(timestamp)) continue;
+        }
+
+        bool inserted{false};
+        uint32_t segment{segmentIds.intern(fields[segmentIdIndex], inserted)};
+        if(inserted) groups.emplace_back();
+        LocationData &location{groups[segment]};
         
-        if(groups[segmentId].rows.empty()){
+        // station and road group are decided once per segment, from its first row
+        if(inserted){
             double latitude{std::stod(fields[latitudeIndex])};
             double longitude{std::stod(fields[longitudeIndex])};
-            groups[segmentId].weatherStationId = _::findClosestStation(latitude, longitude);
+            location.blend = weather::nearestStations(latitude, longitude, constants::weather::BlendStationCount);
+            location.weatherStationId = location.blend.front().stationId;
+            location.latitude = latitude;
+            location.longitude = longitude;
+            location.roadGroup = classifyRoadGroups 
+                ? classifier.classify(fields[streetIndex]) 
+                : feature_engineering::RoadGroupClassifier::Unmatched;
+            location.foreign = !shard.owns(fields[segmentIdIndex]);
+            location.dropped = location.foreign || (classifyRoadGroups 
+                && constants::road_groups::DropUnmatched 
+                && location.roadGroup == feature_engineering::RoadGroupClassifier::Unmatched);
+        }
+
+        if(location.dropped){
+            if(location.foreign) foreignRowCount++;
+            else droppedRowCount++;
+            continue;
         }
         
-        groups[segmentId].rows.push_back(fields);
+        location.rows.push_back(std::move(fields));
+    }
+
+    size_t keptSegmentCount{0};
+    size_t foreignSegmentCount{0};
+    for(const auto &locationData : groups){
+        if(!locationData.dropped) keptSegmentCount++;
+        if(locationData.foreign) foreignSegmentCount++;
     }
 
     fmt::println("total rows: {}", rowCount);
     fmt::println("segments: {}", groups.size());
+    if(shard.isSharded()){
+        fmt::println(
+            "shard {}/{}: {} segments ({} rows) belong to other shards",
+            shard.index, shard.count, foreignSegmentCount, foreignRowCount
+        );
+    }
+    if(classifyRoadGroups){
+        fmt::println("kept {} segments in configured road groups, dropped {} rows", keptSegmentCount, droppedRowCount);
+    }
 
-    std::filesystem::create_directories(outputDirectory);
-
-    size_t count{0};
-    for(const auto &[segmentId, locationData] : groups){
-        count++;
+    std::filesystem::path outputPath{outputContainerPath};
+    if(outputPath.has_parent_path()) std::filesystem::create_directories(outputPath.parent_path());
+    container::Writer writer{outputContainerPath};
 
-        std::string filename{segmentId + ".csv"};
-        std::filesystem::path outputPath{std::filesystem::path(outputDirectory) / filename};
+    // every segment becomes one block of the container, serialised in parallel
+    std::atomic<size_t> count{0};
+    utilities::parallelFor(groups.size(), constants::system::ThreadCount, [&](size_t segment){
+        const LocationData &locationData{groups[segment]};
+        if(locationData.dropped) return;
 
-        std::ofstream out{outputPath};
+        std::ostringstream out;
 
         for(size_t i{0}; i < header.size(); i++){
             if(i > 0) out << ',';
             out << header[i];
         }
-        out << ',' << constants::column_names::WeatherStationId << '\n';
+        out << ',' << constants::column_names::WeatherStationId;
+        if(classifyRoadGroups) out << ',' << constants::column_names::RoadGroup;
+        out << '\n';
 
+        const char *roadGroupName{feature_engineering::RoadGroupClassifier::name(locationData.roadGroup)};
         for(const auto &row : locationData.rows){
             for(size_t i{0}; i < row.size(); i++){
                 if(i > 0) out << ',';
                 out << row[i];
             }
-            out << ',' << locationData.weatherStationId << '\n';
+            out << ',' << locationData.weatherStationId;
+            if(classifyRoadGroups) out << ',' << roadGroupName;
+            out << '\n';
         }
 
-        if(count % constants::system::SegmentProgressInterval == 0){
-            fmt::println("written {} files", count);
+        writer.append(segmentIds.name(static_cast<uint32_t>(segment)), out.str(), locationData.rows.size());
+        if(++count % constants::system::SegmentProgressInterval == 0){
+            fmt::println("written {} segments", count.load());
         }
+    });
+    if(!writer.finish()) return;
+
+    // segment -> station map (and blend weights) for lookups that do not rescan the split container.
+    // rows go in SegmentID order, as collectShards writes them, so a sharded run gives the same file
+    std::vector<uint32_t> indexOrder;
+    for(uint32_t segment{0}; segment < groups.size(); segment++){
+        if(!groups[segment].dropped) indexOrder.push_back(segment);
+    }
+    std::sort(indexOrder.begin(), indexOrder.end(), [&](uint32_t left, uint32_t right){
+        return std::string_view{segmentIds.name(left)} < std::string_view{segmentIds.name(right)};
+    });
+
+    std::ofstream indexOut{segmentIndexPath};
+    indexOut << constants::column_names::SegmentId << ','
+             << constants::column_names::WeatherStationId << ','
+             << constants::column_names::RoadGroup << ','
+             << constants::column_names::Latitude << ','
+             << constants::column_names::Longitude << ','
+             << constants::column_names::BlendStationIds << ','
+             << constants::column_names::BlendWeights << '\n';
+    for(uint32_t segment : indexOrder){
+        const LocationData &locationData{groups[segment]};
+        indexOut << segmentIds.name(segment) << ','
+                 << locationData.weatherStationId << ','
+                 << feature_engineering::RoadGroupClassifier::name(locationData.roadGroup) << ','
+                 << fmt::format("{:.6f},{:.6f}", locationData.latitude, locationData.longitude) << ','
+                 << weather::formatBlendStations(locationData.blend) << ','
+                 << weather::formatBlendWeights(locationData.blend) << '\n';
     }
 
-    fmt::println("done: {} files in {}", groups.size(), outputDirectory);
+    fmt::println("done: {} segments in {}", count.load(), outputContainerPath);
 }
@@ -0,0 +1,161 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include <fmt/core.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "constants.hpp"
+
+namespace weather{
+
+    struct StationWeight{
+        int stationId;
+        float weight;
+    };
+
+    // stations a segment's weather is blended from, nearest first, weights sum to 1
+    using Blend = std::vector<StationWeight>;
+
+    // the count nearest stations by the planar degree distance the single station
+    // lookup always used, weighted by inverse distance to the power BlendPower.
+    // a segment sitting on a station takes that station alone
+    inline Blend nearestStations(double latitude, double longitude, size_t count){
+        const auto &stations{constants::weather::weatherStations()};
+
+        std::vector<std::pair<double, int>> distances;
+        for(const auto &station : stations){
+            double deltaLatitude{latitude - station.latitude};
+            double deltaLongitude{longitude - station.longitude};
+            distances.push_back({std::sqrt(deltaLatitude * deltaLatitude + deltaLongitude * deltaLongitude), station.id});
+        }
+        // stable, so ties keep the station list order like the strict < scan did
+        std::stable_sort(distances.begin(), distances.end(), [](const auto &left, const auto &right){
+            return left.first < right.first;
+        });
+
+        count = std::clamp<size_t>(count, 1, distances.size());
+        if(count == 1 || distances.front().first < 1e-9) return {{distances.front().second, 1.0f}};
+
+        std::vector<double> weights;
+        double total{0.0};
+        for(size_t i{0}; i < count; i++){
+            weights.push_back(std::pow(distances[i].first, -constants::weather::BlendPower));
+            total += weights.back();
+        }
+
+        Blend blend;
+        for(size_t i{0}; i < count; i++){
+            blend.push_back({distances[i].second, static_cast<float>(weights[i] / total)});
+        }
+        return blend;
+    }
+
+    // "3;7;11" and "0.523;0.301;0.176", the two segment index columns
+    inline std::string formatBlendStations(const Blend &blend){
+        std::string out;
+        for(const auto &station : blend){
+            if(!out.empty()) out += ';';
+            out += fmt::format("{}", station.stationId);
+        }
+        return out;
+    }
+
+    inline std::string formatBlendWeights(const Blend &blend){
+        std::string out;
+        for(const auto &station : blend){
+            if(!out.empty()) out += ';';
+            out += fmt::format("{:.6f}", station.weight);
+        }
+        return out;
+    }
+
+    // empty when the lists are malformed or of different lengths
+    inline Blend parseBlend(std::string_view stationIds, std::string_view weights){
+        Blend blend;
+        while(!stationIds.empty() && !weights.empty()){
+            size_t idEnd{std::min(stationIds.find(';'), stationIds.size())};
+            size_t weightEnd{std::min(weights.find(';'), weights.size())};
+            std::string id{stationIds.substr(0, idEnd)};
+            std::string weight{weights.substr(0, weightEnd)};
+
+            char *end{nullptr};
+            long parsedId{std::strtol(id.c_str(), &end, 10)};
+            if(end == id.c_str()) return {};
+            float parsedWeight{std::strtof(weight.c_str(), &end)};
+            if(end == weight.c_str()) return {};
+            blend.push_back({static_cast<int>(parsedId), parsedWeight});
+
+            stationIds.remove_prefix(std::min(idEnd + 1, stationIds.size()));
+            weights.remove_prefix(std::min(weightEnd + 1, weights.size()));
+        }
+        if(!stationIds.empty() || !weights.empty()) return {};
+        return blend;
+    }
+
+    namespace _{
+
+        inline void blendRowsScalar(const float *const *rows, const float *weights, size_t rowCount, size_t fieldCount, float *out){
+            for(size_t field{0}; field < fieldCount; field++){
+                float sum{0.0f};
+                float total{0.0f};
+                for(size_t row{0}; row < rowCount; row++){
+                    float value{rows[row][field]};
+                    if(std::isnan(value)) continue;
+                    sum = std::fma(weights[row], value, sum);
+                    total += weights[row];
+                }
+                out[field] = total > 0.0f ? sum / total : std::numeric_limits<float>::quiet_NaN();
+            }
+        }
+
+#if defined(__x86_64__) || defined(__i386__)
+        // eight fields per step, the last step masked to the fields left. missing
+        // (NaN) values are masked out of both the weighted sum and the weight
+        // total, so the remaining stations are renormalised per field
+        __attribute__((target("avx2,fma")))
+        inline void blendRowsAvx2(const float *const *rows, const float *weights, size_t rowCount, size_t fieldCount, float *out){
+            const __m256i lanes{_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7)};
+            for(size_t field{0}; field < fieldCount; field += 8){
+                int left{static_cast<int>(std::min<size_t>(fieldCount - field, 8))};
+                __m256i inRange{_mm256_cmpgt_epi32(_mm256_set1_epi32(left), lanes)};
+
+                __m256 sum{_mm256_setzero_ps()};
+                __m256 total{_mm256_setzero_ps()};
+                for(size_t row{0}; row < rowCount; row++){
+                    __m256 values{_mm256_maskload_ps(rows[row] + field, inRange)};
+                    __m256 present{_mm256_and_ps(_mm256_cmp_ps(values, values, _CMP_ORD_Q), _mm256_castsi256_ps(inRange))};
+                    __m256 weight{_mm256_and_ps(present, _mm256_set1_ps(weights[row]))};
+                    sum = _mm256_fmadd_ps(weight, _mm256_and_ps(present, values), sum);
+                    total = _mm256_add_ps(total, weight);
+                }
+                // 0 / 0 leaves fields no station has as NaN
+                _mm256_maskstore_ps(out + field, inRange, _mm256_div_ps(sum, total));
+            }
+        }
+#endif
+
+    } // namespace _
+
+    // out[f] = weighted mean of rows[r][f] over the rows that have field f
+    inline void blendRows(const float *const *rows, const float *weights, size_t rowCount, size_t fieldCount, float *out){
+#if defined(__x86_64__) || defined(__i386__)
+        static const bool hasAvx2Fma{__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")};
+        if(hasAvx2Fma){
+            _::blendRowsAvx2(rows, weights, rowCount, fieldCount, out);
+            return;
+        }
+#endif
+        _::blendRowsScalar(rows, weights, rowCount, fieldCount, out);
+    }
+
+} // namespace weather
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "utilities.hpp"
+
+namespace utilities{
+
+    // maps strings to dense ids 0, 1, 2... in first seen order. open addressing
+    // with linear probing over a power of two table of ids, keys live back to back
+    // in one buffer, so a lookup is one hash of the view plus (mostly) one probe
+    class StringInterner{
+    public:
+        static constexpr uint32_t Empty{std::numeric_limits<uint32_t>::max()};
+
+        explicit StringInterner(size_t expectedKeys = 1024){
+            size_t capacity{16};
+            while(capacity < expectedKeys * 2) capacity *= 2;
+            slots_.assign(capacity, Empty);
+        }
+
+        // id of key, adding it when it is new
+        uint32_t intern(std::string_view key, bool &inserted){
+            uint64_t hash{hashBytes(key.data(), key.size())};
+            size_t mask{slots_.size() - 1};
+            for(size_t slot{hash & mask};; slot = (slot + 1) & mask){
+                uint32_t id{slots_[slot]};
+                if(id == Empty){
+                    inserted = true;
+                    return insert(slot, key, hash);
+                }
+                if(hashes_[id] == hash && name(id) == key){
+                    inserted = false;
+                    return id;
+                }
+            }
+        }
+
+        uint32_t find(std::string_view key) const{
+            uint64_t hash{hashBytes(key.data(), key.size())};
+            size_t mask{slots_.size() - 1};
+            for(size_t slot{hash & mask};; slot = (slot + 1) & mask){
+                uint32_t id{slots_[slot]};
+                if(id == Empty) return Empty;
+                if(hashes_[id] == hash && name(id) == key) return id;
+            }
+        }
+
+        std::string_view name(uint32_t id) const{
+            return {characters_.data() + offsets_[id], offsets_[id + 1] - offsets_[id]};
+        }
+
+        size_t size() const{ return hashes_.size(); }
+
+    private:
+        uint32_t insert(size_t slot, std::string_view key, uint64_t hash){
+            uint32_t id{static_cast<uint32_t>(hashes_.size())};
+            characters_.append(key);
+            offsets_.push_back(characters_.size());
+            hashes_.push_back(hash);
+            slots_[slot] = id;
+
+            // at most half full keeps probe sequences short
+            if(hashes_.size() * 2 > slots_.size()) grow();
+            return id;
+        }
+
+        void grow(){
+            std::vector<uint32_t> slots(slots_.size() * 2, Empty);
+            size_t mask{slots.size() - 1};
+            for(uint32_t id{0}; id < hashes_.size(); id++){
+                size_t slot{hashes_[id] & mask};
+                while(slots[slot] != Empty) slot = (slot + 1) & mask;
+                slots[slot] = id;
+            }
+            slots_ = std::move(slots);
+        }
+
+        std::vector<uint32_t> slots_;
+        std::vector<uint64_t> hashes_;          // by id, so growing never rehashes keys
+        std::vector<size_t> offsets_{0};        // key id spans characters_[offsets_[id], offsets_[id + 1])
+        std::string characters_;
+    };
+
+} // namespace utilities
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "constants.hpp"
+#include "csv_tokenizer.hpp"
+#include "units.hpp"
+
+namespace units{
+
+    constexpr int32_t NoMinute{std::numeric_limits<int32_t>::min()};
+
+    // where the traffic time fields are in a header, so a row's epoch minute can
+    // be read without copying its cells
+    struct TimeColumns{
+        size_t year;
+        size_t month;
+        size_t day;
+        size_t hour;
+        size_t minute;
+
+        static std::optional<TimeColumns> find(const std::vector<std::string> &header){
+            auto column{[&](const char *name) -> std::optional<size_t>{
+                auto found{std::find(header.begin(), header.end(), name)};
+                if(found == header.end()) return std::nullopt;
+                return static_cast<size_t>(found - header.begin());
+            }};
+            auto year{column(constants::column_names::Year)};
+            auto month{column(constants::column_names::Month)};
+            auto day{column(constants::column_names::Day)};
+            auto hour{column(constants::column_names::Hour)};
+            auto minute{column(constants::column_names::Minute)};
+            if(!year || !month || !day || !hour || !minute) return std::nullopt;
+            return TimeColumns{*year, *month, *day, *hour, *minute};
+        }
+
+        // a row whose time does not parse keeps the minute of the row before it,
+        // so it stays where it is within its segment
+        int32_t minuteOf(const tokenizer::Row &row, int32_t previous) const{
+            int fields[5];
+            size_t columns[5]{year, month, day, hour, minute};
+            for(size_t i{0}; i < 5; i++){
+                if(columns[i] >= row.size()) return previous;
+                std::string_view text{row[columns[i]].view()};
+                auto [end, error]{std::from_chars(text.data(), text.data() + text.size(), fields[i])};
+                if(error != std::errc{} || end != text.data() + text.size()) return previous;
+            }
+            return Timestamp{fields[0], fields[1], fields[2], fields[3], fields[4]}.toEpochMinutes();
+        }
+    };
+
+} // namespace units
@@ -59,8 +59,8 @@ namespace feature_engineering{
         return dayOfWeek == 0 || dayOfWeek == 1;
     }
 
-    inline const std::unordered_set<int> &getHolidaySet(){
-        static std::unordered_set<int> holidays;
+    inline std::unordered_set<int> makeHolidaySet(){
+        std::unordered_set<int> holidays;
 
         // 2000 Federal Holidays
         holidays.insert(20000101); // New Year's Day
@@ -413,6 +413,12 @@ namespace feature_engineering{
         return holidays;
     }
 
+    // built once, isHoliday() is on the per-row and per-request path
+    inline const std::unordered_set<int> &getHolidaySet(){
+        static const std::unordered_set<int> holidays{makeHolidaySet()};
+        return holidays;
+    }
+
     inline bool isHoliday(const units::Timestamp &timestamp){
         return getHolidaySet().count(timestamp.toPackedDate()) > 0;
     }
@@ -0,0 +1,225 @@
+#pragma once
+
+#include <csv2/reader.hpp>
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <fmt/core.h>
+
+#include "constants.hpp"
+#include "csv_tokenizer.hpp"
+#include "utilities.hpp"
+
+namespace tokenizer{
+
+    namespace _{
+
+        struct BenchmarkResult{
+            double seconds{0.0};
+            size_t rows{0};
+            size_t cells{0};
+            size_t valueBytes{0};       // cheap checksum that both readers saw the same cells
+        };
+
+        // reads every cell into a string, the way the stages consume a reader
+        template<typename Reader>
+        BenchmarkResult timeReader(Reader &csv, const std::string &path){
+            auto start{std::chrono::steady_clock::now()};
+            BenchmarkResult result;
+            if(!csv.mmap(path)) return result;
+
+            std::string value;
+            for(const auto &cell : csv.header()){
+                cell.read_value(value);
+                result.valueBytes += value.size();
+            }
+            for(const auto &row : csv){
+                result.rows++;
+                for(const auto &cell : row){
+                    cell.read_value(value);
+                    result.cells++;
+                    result.valueBytes += value.size();
+                }
+            }
+
+            result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            return result;
+        }
+
+        template<typename MakeReader>
+        BenchmarkResult bestOf(MakeReader &&makeReader, const std::string &path){
+            BenchmarkResult best;
+            for(size_t repetition{0}; repetition < constants::tokenizer::BenchmarkRepetitions; repetition++){
+                auto csv{makeReader()};
+                BenchmarkResult result{timeReader(*csv, path)};
+                if(repetition == 0 || result.seconds < best.seconds) best = result;
+            }
+            return best;
+        }
+
+        // a csv and the header and rows a reader must give for it, cells as read_value gives them
+        struct CheckCase{
+            const char *name;
+            std::string text;
+            std::vector<std::vector<std::string>> rows;
+        };
+
+        inline std::vector<CheckCase> checkCases(){
+            // a quoted field long enough to span several 64 byte chunks, with a newline in the middle
+            std::string longField{"\"" + std::string(60, 'x') + ",\n" + std::string(70, 'y') + "\"\"z\""};
+            return {
+                {"quoted commas and newlines",
+                    "id,name,note\n1,\"a,b\",\"line one\nline two\"\n2,\"say \"\"hi\"\"\",x\n",
+                    {{"id", "name", "note"}, {"1", "\"a,b\"", "\"line one\nline two\""}, {"2", "\"say \"\"hi\"\"\"", "x"}}},
+                {"crlf",
+                    "a,b\r\n1,2\r\n\"3\r\n4\",5\r\n",
+                    {{"a", "b"}, {"1", "2"}, {"\"3\r\n4\"", "5"}}},
+                {"blank lines",
+                    "\n\na,b\n\n1,2\n\n\n3,4\n\n",
+                    {{"a", "b"}, {"1", "2"}, {"3", "4"}}},
+                {"missing final newline",
+                    "a,b\n1,2\n3,4",
+                    {{"a", "b"}, {"1", "2"}, {"3", "4"}}},
+                {"crlf and missing final newline",
+                    "a,b\r\n\r\n1,2\r",
+                    {{"a", "b"}, {"1", "2"}}},
+                {"empty and padded fields",
+                    "a, b ,c\n,,\n 1 ,\t,3\n",
+                    {{"a", "b", "c"}, {"", "", ""}, {"1", "", "3"}}},
+                {"fields across chunks",
+                    "k,long,v\n1," + longField + ",2\n3,\"\",4",
+                    {{"k", "long", "v"}, {"1", longField, "2"}, {"3", "\"\"", "4"}}}
+            };
+        }
+
+        // hands out the text a few bytes per read, like a decompressor would
+        class PieceSource : public TextSource{
+        public:
+            PieceSource(std::string_view text, size_t pieceBytes)
+                : text_{text}
+                , pieceBytes_{pieceBytes}
+            {}
+
+            bool read(std::string &text) override{
+                if(offset_ == text_.size()) return false;
+                size_t bytes{std::min(pieceBytes_, text_.size() - offset_)};
+                text.append(text_.substr(offset_, bytes));
+                offset_ += bytes;
+                return true;
+            }
+
+            void rewind() override{ offset_ = 0; }
+
+        private:
+            std::string_view text_;
+            size_t pieceBytes_;
+            size_t offset_{0};
+        };
+
+        // header and rows, iterated twice to cover restarting
+        inline std::vector<std::vector<std::string>> readRows(const Reader &csv){
+            std::vector<std::vector<std::string>> rows;
+            for(int pass{0}; pass < 2; pass++){
+                rows.clear();
+                rows.emplace_back();
+                for(const auto &cell : csv.header()) cell.read_value(rows.back().emplace_back());
+                for(const auto &row : csv){
+                    rows.emplace_back();
+                    for(const auto &cell : row) cell.read_value(rows.back().emplace_back());
+                }
+            }
+            return rows;
+        }
+
+    } // namespace _
+
+    // every instruction set the cpu supports, with block sizes down to one byte
+    // and from mapped or streamed text, must read the csv corner cases into the
+    // expected cells. ctest runs it as `joiner bench --check`
+    inline int runCheck(){
+        constexpr size_t blockSizes[]{1, 2, 3, 7, 63, 64, 65, 1000, constants::tokenizer::BlockBytes};
+        constexpr size_t pieceSizes[]{1, 5, 64};
+
+        size_t readCount{0};
+        int status{0};
+        for(Isa isa : {Isa::Scalar, Isa::Sse42, Isa::Avx2}){
+            if(!isSupported(isa)) continue;
+
+            for(const auto &check : _::checkCases()){
+                for(size_t blockBytes : blockSizes){
+                    auto report{[&](const std::vector<std::vector<std::string>> &rows, const std::string &how){
+                        readCount++;
+                        if(rows == check.rows) return;
+                        std::string difference{rows.size() == check.rows.size()
+                            ? std::string{"other cells than expected"}
+                            : fmt::format("{} rows, {} expected", rows.size(), check.rows.size())};
+                        fmt::println("[!!! {}: \"{}\" read {} with {} byte blocks{} !!!]",
+                            isaName(isa), check.name, difference, blockBytes, how);
+                        status = 1;
+                    }};
+
+                    Reader parsed{isa, blockBytes};
+                    parsed.parse(check.text);
+                    report(_::readRows(parsed), "");
+
+                    for(size_t pieceBytes : pieceSizes){
+                        Reader streamed{isa, blockBytes};
+                        streamed.stream(std::make_unique<_::PieceSource>(check.text, pieceBytes));
+                        report(_::readRows(streamed), fmt::format(", streamed {} bytes at a time", pieceBytes));
+                    }
+                }
+            }
+            fmt::println("{}: checked", isaName(isa));
+        }
+        fmt::println("{} reads of {} csv corner cases, {}", readCount, _::checkCases().size(), status == 0 ? "all as expected" : "some wrong");
+        return status;
+    }
+
+    // throughput of csv2 and of this tokenizer with every instruction set the
+    // cpu supports on the same file, best of BenchmarkRepetitions runs each
+    inline int runBenchmark(const std::string &path){
+        auto file{utilities::MappedFile::open(path)};
+        if(!file){
+            fmt::println("[!!! could not open {} !!!]", path);
+            return 1;
+        }
+        double megabytes{static_cast<double>(file->size()) / (1 << 20)};
+        file.reset();
+
+        fmt::println("{}: {:.1f} MiB, best of {} runs, every cell read into a string", path, megabytes, constants::tokenizer::BenchmarkRepetitions);
+        fmt::println("{:<10} {:>10} {:>10} {:>12} {:>10}", "reader", "seconds", "MiB/s", "cells", "speedup");
+
+        using Csv2Reader = csv2::Reader<
+            csv2::delimiter<','>,
+            csv2::quote_character<'"'>,
+            csv2::first_row_is_header<true>,
+            csv2::trim_policy::trim_whitespace
+        >;
+        _::BenchmarkResult baseline{_::bestOf([](){ return std::make_unique<Csv2Reader>(); }, path)};
+        fmt::println(
+            "{:<10} {:>10.3f} {:>10.1f} {:>12} {:>10}",
+            "csv2", baseline.seconds, megabytes / baseline.seconds, baseline.cells, "1.00x"
+        );
+
+        int status{0};
+        for(Isa isa : {Isa::Scalar, Isa::Sse42, Isa::Avx2}){
+            if(!isSupported(isa)) continue;
+
+            _::BenchmarkResult result{_::bestOf([isa](){ return std::make_unique<Reader>(isa); }, path)};
+            fmt::println(
+                "{:<10} {:>10.3f} {:>10.1f} {:>12} {:>9.2f}x",
+                isaName(isa), result.seconds, megabytes / result.seconds, result.cells, baseline.seconds / result.seconds
+            );
+            if(result.cells != baseline.cells || result.valueBytes != baseline.valueBytes){
+                fmt::println("[!!! {} read {} cells ({} bytes), csv2 read {} ({} bytes) !!!]",
+                    isaName(isa), result.cells, result.valueBytes, baseline.cells, baseline.valueBytes);
+                status = 1;
+            }
+        }
+        fmt::println("pipeline uses {}", isaName(activeIsa()));
+        return status;
+    }
+
+} // namespace tokenizer
@@ -0,0 +1,308 @@
+#pragma once
+
+#include "constants.hpp"
+#include "utilities.hpp"
+#include "gradient_boosting.hpp"
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <fmt/core.h>
+
+namespace _{
+
+    struct TuningResult{
+        training::BoostingParameters parameters;
+        double meanRmse;
+        double standardDeviation;
+    };
+
+    // latin hypercube over the configured ranges, learning rate and loss reduction on a log scale
+    inline std::vector<training::BoostingParameters> makeGrid(size_t size, uint64_t seed){
+        namespace config = constants::training;
+        std::mt19937_64 random{seed};
+        std::uniform_real_distribution<double> jitter{0.0, 1.0};
+
+        auto stratified{[&](){
+            std::vector<double> positions(size);
+            for(size_t i{0}; i < size; i++) positions[i] = (i + jitter(random)) / size;
+            std::shuffle(positions.begin(), positions.end(), random);
+            return positions;
+        }};
+        auto linear{[](double low, double high, double position){ return low + (high - low) * position; }};
+        auto logarithmic{[](double low, double high, double position){
+            return std::exp(std::log(low) + (std::log(high) - std::log(low)) * position);
+        }};
+
+        std::vector<double> depth{stratified()};
+        std::vector<double> minChild{stratified()};
+        std::vector<double> learningRate{stratified()};
+        std::vector<double> lossReduction{stratified()};
+        std::vector<double> columnFraction{stratified()};
+
+        std::vector<training::BoostingParameters> grid;
+        for(size_t i{0}; i < size; i++){
+            grid.push_back({
+                config::Trees,
+                static_cast<int>(std::lround(linear(config::MinDepth, config::MaxDepth, depth[i]))),
+                std::round(linear(config::MinChildWeight, config::MaxChildWeight, minChild[i])),
+                logarithmic(config::MinLearningRate, config::MaxLearningRate, learningRate[i]),
+                logarithmic(config::MinLossReduction, config::MaxLossReduction, lossReduction[i]),
+                linear(config::MinColumnFraction, config::MaxColumnFraction, columnFraction[i]),
+                config::Lambda
+            });
+        }
+        return grid;
+    }
+
+    struct FoldRows{
+        std::vector<std::vector<uint32_t>> train;
+        std::vector<std::vector<uint32_t>> validation;
+    };
+
+    // rows keep their exported fold when there are partitions, else they are dealt out shuffled
+    inline FoldRows assignFolds(const std::vector<uint32_t> &rows, const std::vector<int32_t> &partitions, size_t folds, uint64_t seed){
+        std::vector<uint32_t> shuffled(rows);
+        if(partitions.empty()){
+            std::mt19937_64 random{seed};
+            std::shuffle(shuffled.begin(), shuffled.end(), random);
+        }
+
+        FoldRows foldRows{std::vector<std::vector<uint32_t>>(folds), std::vector<std::vector<uint32_t>>(folds)};
+        for(size_t i{0}; i < shuffled.size(); i++){
+            size_t rowFold{partitions.empty() ? i % folds : static_cast<size_t>(partitions[shuffled[i]]) % folds};
+            for(size_t fold{0}; fold < folds; fold++){
+                (rowFold == fold ? foldRows.validation : foldRows.train)[fold].push_back(shuffled[i]);
+            }
+        }
+        return foldRows;
+    }
+
+    // every (grid point, fold) pair is one job, all jobs share the binned matrix read-only
+    inline std::vector<TuningResult> crossValidate(
+        const training::BinnedMatrix &matrix,
+        const std::vector<float> &labels,
+        const std::vector<uint32_t> &rows,
+        const std::vector<int32_t> &partitions,
+        const std::vector<training::BoostingParameters> &grid,
+        size_t folds,
+        uint64_t seed
+    ){
+        FoldRows foldRows{assignFolds(rows, partitions, folds, seed)};
+
+        std::vector<double> foldRmse(grid.size() * folds);
+        utilities::parallelFor(foldRmse.size(), constants::training::ThreadCount, [&](size_t job){
+            size_t point{job / folds};
+            size_t fold{job % folds};
+            training::Booster booster{training::fit(matrix, labels, foldRows.train[fold], grid[point], seed + job)};
+            foldRmse[job] = training::rootMeanSquaredError(booster, matrix, labels, foldRows.validation[fold]);
+        });
+
+        std::vector<TuningResult> results;
+        for(size_t point{0}; point < grid.size(); point++){
+            double sum{0.0};
+            double squaredSum{0.0};
+            for(size_t fold{0}; fold < folds; fold++){
+                double rmse{foldRmse[point * folds + fold]};
+                sum += rmse;
+                squaredSum += rmse * rmse;
+            }
+            double mean{sum / folds};
+            results.push_back({grid[point], mean, std::sqrt(std::max(0.0, squaredSum / folds - mean * mean))});
+        }
+        return results;
+    }
+
+    inline void writeTuningResults(std::ofstream &out, const std::string &model, const std::vector<TuningResult> &results){
+        for(const auto &result : results){
+            const auto &parameters{result.parameters};
+            out << model << ','
+                << parameters.trees << ','
+                << parameters.maxDepth << ','
+                << parameters.minChildWeight << ','
+                << parameters.learningRate << ','
+                << parameters.lossReduction << ','
+                << parameters.columnFraction << ','
+                << result.meanRmse << ','
+                << result.standardDeviation << '\n';
+        }
+    }
+
+    // predictions for rows, each from a model fitted with parameters on the other
+    // folds, so no row is predicted by a model that saw it. indexed by row
+    inline std::vector<float> outOfFoldPredictions(
+        const training::BinnedMatrix &matrix,
+        const std::vector<float> &labels,
+        const std::vector<uint32_t> &rows,
+        const std::vector<int32_t> &partitions,
+        const training::BoostingParameters &parameters,
+        size_t folds,
+        uint64_t seed
+    ){
+        FoldRows foldRows{assignFolds(rows, partitions, folds, seed)};
+
+        std::vector<float> predictions(labels.size());
+        utilities::parallelFor(folds, constants::training::ThreadCount, [&](size_t fold){
+            training::Booster booster{training::fit(matrix, labels, foldRows.train[fold], parameters, seed + fold)};
+            for(uint32_t row : foldRows.validation[fold]) predictions[row] = booster.predict(matrix, row);
+        });
+        return predictions;
+    }
+
+    struct FittedModel{
+        training::Booster booster;
+        training::BoostingParameters parameters;
+    };
+
+    // grid search + k-fold CV, then refit the best parameters on every training row,
+    // score the held-out test rows (if any) and save the model
+    inline FittedModel tuneAndFit(
+        const std::string &model,
+        const training::BinnedMatrix &matrix,
+        const std::vector<float> &labels,
+        const std::vector<uint32_t> &rows,
+        const std::vector<uint32_t> &testRows,
+        const std::vector<int32_t> &partitions,
+        size_t folds,
+        const std::vector<std::string> &columns,
+        const std::string &modelPath,
+        std::ofstream &resultsOut
+    ){
+        uint64_t seed{constants::training::Seed};
+        auto grid{makeGrid(constants::training::GridSize, seed)};
+
+        fmt::println("tuning {}: {} rows, {} grid points x {} folds", model, rows.size(), grid.size(), folds);
+        auto results{crossValidate(matrix, labels, rows, partitions, grid, folds, seed)};
+        writeTuningResults(resultsOut, model, results);
+
+        const TuningResult &best{*std::min_element(results.begin(), results.end(), [](const auto &left, const auto &right){
+            return left.meanRmse < right.meanRmse;
+        })};
+        fmt::println(
+            "best {}: depth {}, min child {}, learning rate {:.4f}, loss reduction {:.4f}, columns {:.2f}, cv rmse {:.3f}",
+            model, best.parameters.maxDepth, best.parameters.minChildWeight, best.parameters.learningRate,
+            best.parameters.lossReduction, best.parameters.columnFraction, best.meanRmse
+        );
+
+        training::Booster booster{training::fit(matrix, labels, rows, best.parameters, seed)};
+        if(!testRows.empty()){
+            fmt::println("test {}: rmse {:.3f} on {} held-out rows", model, training::rootMeanSquaredError(booster, matrix, labels, testRows), testRows.size());
+        }
+
+        std::filesystem::path path{modelPath};
+        if(path.has_parent_path()) std::filesystem::create_directories(path.parent_path());
+        std::ofstream modelOut{modelPath};
+        modelOut << training::toXgboostJson(booster, columns).dump();
+        fmt::println("saved {} model to {}", model, modelPath);
+
+        return {std::move(booster), best.parameters};
+    }
+
+} // namespace _
+
+// tunes and fits the primary model on the exported feature matrix, then one
+// residual model per road group on the primary's out-of-fold residuals, saving
+// them where scoreModels looks for them.
+// with <base>.partitions.bin only training rows are tuned and fitted on, in
+// their assigned folds, and the test rows are kept for the held-out score
+inline void trainModels(
+    const std::string &matrixBasePath,
+    const std::string &primaryModelPath,
+    const std::string &residualModelDirectory,
+    const std::string &resultsCsvPath
+){
+    std::vector<std::string> columns{utilities::readLines(matrixBasePath + ".columns.txt")};
+    std::ifstream matrixIn{matrixBasePath + ".bin", std::ios::binary};
+    std::ifstream labelsIn{matrixBasePath + ".labels.bin", std::ios::binary};
+    if(columns.empty() || !matrixIn || !labelsIn){
+        fmt::println("[!!! no feature matrix at {}, run the matrix export first !!!]", matrixBasePath);
+        return;
+    }
+
+    size_t rowCount{static_cast<size_t>(std::filesystem::file_size(matrixBasePath + ".labels.bin") / sizeof(float))};
+    std::vector<float> values(rowCount * columns.size());
+    std::vector<float> labels(rowCount);
+    matrixIn.read(reinterpret_cast<char *>(values.data()), static_cast<std::streamsize>(values.size() * sizeof(float)));
+    labelsIn.read(reinterpret_cast<char *>(labels.data()), static_cast<std::streamsize>(labels.size() * sizeof(float)));
+
+    std::vector<int32_t> partitions;
+    std::string partitionsPath{matrixBasePath + ".partitions.bin"};
+    if(std::filesystem::exists(partitionsPath)){
+        if(std::filesystem::file_size(partitionsPath) != rowCount * sizeof(int32_t)){
+            fmt::println("[!!! {} does not match the rows of {}.bin, export the matrix again !!!]", partitionsPath, matrixBasePath);
+            return;
+        }
+        partitions.resize(rowCount);
+        std::ifstream partitionsIn{partitionsPath, std::ios::binary};
+        partitionsIn.read(reinterpret_cast<char *>(partitions.data()), static_cast<std::streamsize>(partitions.size() * sizeof(int32_t)));
+    }
+    auto isTest{[&](size_t row){ return !partitions.empty() && partitions[row] == constants::matrix_export::TestPartition; }};
+
+    // rows of each road group, read from its one-hot column before the raw values are dropped
+    struct GroupRows{
+        const char *name;
+        std::vector<uint32_t> train;
+        std::vector<uint32_t> test;
+    };
+    std::vector<GroupRows> groupRows;
+    for(const auto &group : constants::road_groups::roadGroups()){
+        std::string indicator{fmt::format("{}_{}", constants::column_names::RoadGroup, group.name)};
+        auto column{std::find(columns.begin(), columns.end(), indicator)};
+        if(column == columns.end()) continue;
+
+        size_t feature{static_cast<size_t>(column - columns.begin())};
+        GroupRows rows{group.name, {}, {}};
+        for(size_t row{0}; row < rowCount; row++){
+            if(values[row * columns.size() + feature] == 1.0f) (isTest(row) ? rows.test : rows.train).push_back(static_cast<uint32_t>(row));
+        }
+        groupRows.push_back(std::move(rows));
+    }
+
+    fmt::println("loaded {} rows x {} columns, quantising...", rowCount, columns.size());
+    training::BinnedMatrix matrix{training::quantise(
+        values, rowCount, columns.size(),
+        constants::training::MaxBins,
+        constants::training::QuantileSampleRows,
+        constants::training::ThreadCount
+    )};
+    values = {};
+
+    std::ofstream resultsOut{resultsCsvPath};
+    resultsOut << "model,trees,tree_depth,min_child_weight,learn_rate,loss_reduction,column_fraction,mean_rmse,std_rmse\n";
+
+    std::vector<uint32_t> trainRows;
+    std::vector<uint32_t> testRows;
+    for(size_t i{0}; i < rowCount; i++) (isTest(i) ? testRows : trainRows).push_back(static_cast<uint32_t>(i));
+
+    _::FittedModel primary{_::tuneAndFit(
+        "primary", matrix, labels, trainRows, testRows, partitions, constants::training::Folds, columns, primaryModelPath, resultsOut
+    )};
+
+    // in-sample residuals shrink towards zero, so training rows get the residual of
+    // the primary fitted without their fold. test rows get the final primary's, as scoring does
+    fmt::println("out-of-fold primary predictions: {} folds", constants::training::Folds);
+    std::vector<float> predictions{_::outOfFoldPredictions(
+        matrix, labels, trainRows, partitions, primary.parameters, constants::training::Folds, constants::training::Seed
+    )};
+    for(uint32_t row : testRows) predictions[row] = primary.booster.predict(matrix, row);
+
+    std::vector<float> residuals(rowCount);
+    for(size_t row{0}; row < rowCount; row++){
+        residuals[row] = labels[row] - predictions[row];
+    }
+
+    for(const auto &group : groupRows){
+        if(group.train.size() < constants::training::ResidualFolds * 2) continue;
+
+        std::filesystem::path modelPath{std::filesystem::path(residualModelDirectory) / (std::string{group.name} + ".json")};
+        _::tuneAndFit(
+            group.name, matrix, residuals, group.train, group.test, partitions, constants::training::ResidualFolds, columns, modelPath.string(), resultsOut
+        );
+    }
+
+    fmt::println("done: tuning results written to {}", resultsCsvPath);
+}
@@ -0,0 +1,317 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <optional>
+#include <string>
+#include <vector>
+#include <fmt/core.h>
+#include <nlohmann/json.hpp>
+
+#include "constants.hpp"
+
+namespace inference{
+
+    // one node of the flattened forest. children of a split are adjacent, so a
+    // node only stores the index of its left child
+    struct TreeNode{
+        float value;            // split condition, or leaf value when feature < 0
+        int32_t feature;        // matrix column, -1 for leaves
+        uint32_t leftChild;
+        uint32_t defaultLeft;   // missing values go left
+    };
+
+    namespace _{
+
+        struct RawNode{
+            int feature;
+            float value;
+            int left;
+            int right;
+            bool defaultLeft;
+        };
+
+        inline float parseBaseScore(const nlohmann::json &value){
+            // "5E-1" in older models, "[5E-1]" since xgboost 2.x
+            std::string text{value.is_string() ? value.get<std::string>() : value.dump()};
+            text.erase(std::remove_if(text.begin(), text.end(), [](char c){ return c == '[' || c == ']'; }), text.end());
+            return std::strtof(text.c_str(), nullptr);
+        }
+
+        inline int resolveFeature(const std::string &name, const std::vector<std::string> &columns){
+            auto found{std::find(columns.begin(), columns.end(), name)};
+            if(found != columns.end()) return static_cast<int>(found - columns.begin());
+            // unnamed models dump features as f<index>
+            if(name.size() > 1 && name[0] == 'f' && name.find_first_not_of("0123456789", 1) == std::string::npos){
+                return std::atoi(name.c_str() + 1);
+            }
+            return -1;
+        }
+
+        // text dump (xgb.dump(..., dump_format = "json")): nested nodes with yes/no/missing ids
+        inline void collectDumpNodes(
+            const nlohmann::json &node,
+            const std::vector<std::string> &columns,
+            std::vector<RawNode> &nodes,
+            std::vector<std::string> &unresolved
+        ){
+            size_t id{node.at("nodeid").get<size_t>()};
+            if(nodes.size() <= id) nodes.resize(id + 1);
+
+            if(node.contains("leaf")){
+                nodes[id] = {-1, node.at("leaf").get<float>(), -1, -1, true};
+                return;
+            }
+
+            std::string split{node.at("split").get<std::string>()};
+            int feature{resolveFeature(split, columns)};
+            if(feature < 0) unresolved.push_back(split);
+
+            int yes{node.at("yes").get<int>()};
+            int no{node.at("no").get<int>()};
+            int missing{node.value("missing", yes)};
+            nodes[id] = {feature, node.at("split_condition").get<float>(), yes, no, missing == yes};
+
+            for(const auto &child : node.at("children")){
+                collectDumpNodes(child, columns, nodes, unresolved);
+            }
+        }
+
+    } // namespace _
+
+    // xgboost gbtree model loaded from either a saved JSON model or a JSON dump,
+    // with feature references resolved against the exported matrix columns
+    class TreeEnsemble{
+    public:
+        static std::optional<TreeEnsemble> load(const std::string &path, const std::vector<std::string> &columns){
+            std::ifstream in{path};
+            if(!in){
+                return std::nullopt;
+            }
+
+            auto document(nlohmann::json::parse(in, nullptr, false));
+            if(document.is_discarded()){
+                fmt::println("[!!! {} is not valid JSON !!!]", path);
+                return std::nullopt;
+            }
+
+            TreeEnsemble ensemble;
+            std::vector<std::string> unresolved;
+
+            if(document.is_array()){
+                ensemble.baseScore_ = constants::inference::DumpBaseScore;
+                for(const auto &tree : document){
+                    std::vector<_::RawNode> nodes;
+                    _::collectDumpNodes(tree, columns, nodes, unresolved);
+                    ensemble.append(nodes);
+                }
+            }else{
+                const auto &learner{document.at("learner")};
+                ensemble.baseScore_ = _::parseBaseScore(learner.at("learner_model_param").at("base_score"));
+
+                std::string objective{learner.at("objective").value("name", std::string{"reg:squarederror"})};
+                ensemble.logLink_ = objective == "count:poisson" || objective == "reg:gamma" || objective == "reg:tweedie";
+
+                std::vector<std::string> featureNames;
+                if(learner.contains("feature_names")){
+                    featureNames = learner.at("feature_names").get<std::vector<std::string>>();
+                }
+
+                for(const auto &tree : learner.at("gradient_booster").at("model").at("trees")){
+                    const auto &leftChildren    {tree.at("left_children")};
+                    const auto &rightChildren   {tree.at("right_children")};
+                    const auto &splitIndices    {tree.at("split_indices")};
+                    const auto &splitConditions {tree.at("split_conditions")};
+                    const auto &defaultLeft     {tree.at("default_left")};
+
+                    std::vector<_::RawNode> nodes(leftChildren.size());
+                    for(size_t i{0}; i < nodes.size(); i++){
+                        int left{leftChildren[i].get<int>()};
+                        int feature{-1};
+                        if(left >= 0){
+                            int splitIndex{splitIndices[i].get<int>()};
+                            feature = splitIndex;
+                            if(!featureNames.empty()){
+                                feature = _::resolveFeature(featureNames[splitIndex], columns);
+                                if(feature < 0) unresolved.push_back(featureNames[splitIndex]);
+                            }
+                        }
+                        bool goesLeft{defaultLeft[i].is_boolean() ? defaultLeft[i].get<bool>() : defaultLeft[i].get<int>() != 0};
+                        nodes[i] = {feature, splitConditions[i].get<float>(), left, rightChildren[i].get<int>(), goesLeft};
+                    }
+                    ensemble.append(nodes);
+                }
+            }
+
+            std::sort(unresolved.begin(), unresolved.end());
+            unresolved.erase(std::unique(unresolved.begin(), unresolved.end()), unresolved.end());
+            for(const auto &name : unresolved){
+                fmt::println("[!!! feature {} of {} is not an exported column, treating it as missing !!!]", name, path);
+            }
+
+            if(ensemble.logLink_) ensemble.baseScore_ = std::log(ensemble.baseScore_);
+            return ensemble;
+        }
+
+        size_t treeCount() const{ return roots_.size(); }
+
+        // adds the margin of every tree to margins[row] for rowCount rows of width
+        // `stride`, trees outer so each tree's nodes stay in cache across the batch
+        void accumulate(const float *rows, size_t rowCount, size_t stride, float *margins) const{
+            for(uint32_t root : roots_){
+                for(size_t row{0}; row < rowCount; row++){
+                    margins[row] += walk(root, rows + row * stride, stride);
+                }
+            }
+        }
+
+        // same, for the subset of rows listed in rowIndices, margins are indexed alike
+        void accumulate(const float *rows, const std::vector<uint32_t> &rowIndices, size_t stride, float *margins) const{
+            for(uint32_t root : roots_){
+                for(uint32_t row : rowIndices){
+                    margins[row] += walk(root, rows + row * stride, stride);
+                }
+            }
+        }
+
+        float baseMargin() const{ return baseScore_; }
+
+        float transform(float margin) const{
+            return logLink_ ? std::exp(margin) : margin;
+        }
+
+    private:
+        float walk(uint32_t index, const float *row, size_t stride) const{
+            const TreeNode *node{&nodes_[index]};
+            while(node->feature >= 0){
+                float value{static_cast<size_t>(node->feature) < stride
+                    ? row[node->feature]
+                    : std::numeric_limits<float>::quiet_NaN()};
+                bool left{std::isnan(value) ? node->defaultLeft != 0 : value < node->value};
+                node = &nodes_[node->leftChild + (left ? 0 : 1)];
+            }
+            return node->value;
+        }
+
+        // breadth first renumbering so siblings sit next to each other
+        void append(const std::vector<_::RawNode> &nodes){
+            if(nodes.empty()) return;
+
+            uint32_t root{static_cast<uint32_t>(nodes_.size())};
+            roots_.push_back(root);
+
+            std::vector<int> order{0};
+            nodes_.push_back({});
+            for(size_t position{0}; position < order.size(); position++){
+                const _::RawNode &raw{nodes[order[position]]};
+                TreeNode &node{nodes_[root + position]};
+
+                if(raw.left < 0){
+                    node = {raw.value, -1, 0, 0};
+                    continue;
+                }
+
+                uint32_t leftChild{static_cast<uint32_t>(root + order.size())};
+                order.push_back(raw.left);
+                order.push_back(raw.right);
+                nodes_.resize(root + order.size());
+
+                // unresolved features never match, so always follow the missing branch
+                TreeNode &split{nodes_[root + position]};
+                split = {
+                    raw.value,
+                    raw.feature < 0 ? std::numeric_limits<int32_t>::max() : raw.feature,
+                    leftChild,
+                    raw.defaultLeft ? 1u : 0u
+                };
+            }
+        }
+
+        std::vector<TreeNode> nodes_;
+        std::vector<uint32_t> roots_;
+        float baseScore_{0.5f};
+        bool logLink_{false};
+    };
+
+    // primary model plus one residual model per road group, selected by the
+    // row's road_group_<name> one-hot column
+    class HierarchicalModel{
+    public:
+        static std::optional<HierarchicalModel> load(
+            const std::vector<std::string> &columns,
+            const std::string &primaryModelPath,
+            const std::string &residualModelDirectory
+        ){
+            fmt::println("loading primary model {}...", primaryModelPath);
+            auto primary{TreeEnsemble::load(primaryModelPath, columns)};
+            if(!primary){
+                return std::nullopt;
+            }
+            fmt::println("primary model: {} trees", primary->treeCount());
+
+            HierarchicalModel model{std::move(*primary), {}, columns.size()};
+            for(const auto &group : constants::road_groups::roadGroups()){
+                std::filesystem::path modelPath{std::filesystem::path(residualModelDirectory) / (std::string{group.name} + ".json")};
+                std::string indicator{fmt::format("{}_{}", constants::column_names::RoadGroup, group.name)};
+                auto indicatorColumn{std::find(columns.begin(), columns.end(), indicator)};
+                if(indicatorColumn == columns.end() || !std::filesystem::exists(modelPath)) continue;
+
+                auto residual{TreeEnsemble::load(modelPath.string(), columns)};
+                if(!residual) continue;
+
+                fmt::println("residual model for {}: {} trees", group.name, residual->treeCount());
+                model.residuals_.push_back({static_cast<size_t>(indicatorColumn - columns.begin()), std::move(*residual)});
+            }
+            return model;
+        }
+
+        // scores `count` rows of width stride, trees outer within each model
+        void score(const float *rows, size_t count, float *primaryPredictions, float *hierarchicalPredictions) const{
+            std::fill(primaryPredictions, primaryPredictions + count, primary_.baseMargin());
+            primary_.accumulate(rows, count, stride_, primaryPredictions);
+
+            for(size_t row{0}; row < count; row++){
+                primaryPredictions[row] = primary_.transform(primaryPredictions[row]);
+                hierarchicalPredictions[row] = primaryPredictions[row];
+            }
+
+            std::vector<uint32_t> groupRows;
+            std::vector<float> residualMargins(count);
+            for(const auto &residual : residuals_){
+                groupRows.clear();
+                for(size_t row{0}; row < count; row++){
+                    if(rows[row * stride_ + residual.indicatorColumn] == 1.0f) groupRows.push_back(static_cast<uint32_t>(row));
+                }
+                if(groupRows.empty()) continue;
+
+                for(uint32_t row : groupRows) residualMargins[row] = residual.model.baseMargin();
+                residual.model.accumulate(rows, groupRows, stride_, residualMargins.data());
+                for(uint32_t row : groupRows) hierarchicalPredictions[row] += residual.model.transform(residualMargins[row]);
+            }
+        }
+
+        size_t stride() const{ return stride_; }
+
+    private:
+        struct Residual{
+            size_t indicatorColumn;     // road_group_<name> one-hot column of the matrix
+            TreeEnsemble model;
+        };
+
+        HierarchicalModel(TreeEnsemble primary, std::vector<Residual> residuals, size_t stride)
+            : primary_{std::move(primary)}
+            , residuals_{std::move(residuals)}
+            , stride_{stride}
+        {}
+
+        TreeEnsemble primary_;
+        std::vector<Residual> residuals_;
+        size_t stride_;
+    };
+
+} // namespace inference
@@ -24,6 +24,37 @@ namespace units{
         // convert to YYYYMMDD
         int toPackedDate() const{ return year * 10000 + month * 100 + day;}
 
+        // minutes since 1970-01-01 00:00 (no timezone, days from civil)
+        int toEpochMinutes() const{
+            int shiftedYear     {month <= 2 ? year - 1 : year};
+            int era             {(shiftedYear >= 0 ? shiftedYear : shiftedYear - 399) / 400};
+            int yearOfEra       {shiftedYear - era * 400};
+            int dayOfYear       {(153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1};
+            int dayOfEra        {yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear};
+            int daysSinceEpoch  {era * 146097 + dayOfEra - 719468};
+            return daysSinceEpoch * 1440 + hour * 60 + minute;
+        }
+
+        // inverse of toEpochMinutes (civil from days)
+        static Timestamp fromEpochMinutes(int epochMinutes){
+            int days            {epochMinutes >= 0 ? epochMinutes / 1440 : (epochMinutes - 1439) / 1440};
+            int minuteOfDay     {epochMinutes - days * 1440};
+            int shiftedDays     {days + 719468};
+            int era             {(shiftedDays >= 0 ? shiftedDays : shiftedDays - 146096) / 146097};
+            int dayOfEra        {shiftedDays - era * 146097};
+            int yearOfEra       {(dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365};
+            int dayOfYear       {dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100)};
+            int monthIndex      {(5 * dayOfYear + 2) / 153};
+            int month           {monthIndex < 10 ? monthIndex + 3 : monthIndex - 9};
+            return {
+                yearOfEra + era * 400 + (month <= 2 ? 1 : 0),
+                month,
+                dayOfYear - (153 * monthIndex + 2) / 5 + 1,
+                minuteOfDay / 60,
+                minuteOfDay % 60
+            };
+        }
+
         int absoluteDifferenceInMinutes(const Timestamp &other) const{
             std::tm time1{
                 .tm_sec     = 0,
@@ -55,13 +86,4 @@ namespace units{
         }
     };
 
-    struct TimeRowData{
-        Timestamp timestamp;
-        std::vector<std::string> fullRow;
-        
-        bool operator<(const TimeRowData &other) const{
-            return timestamp < other.timestamp;
-        }
-    };
-
 } // namespace units
\ No newline at end of file
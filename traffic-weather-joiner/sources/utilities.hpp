@@ -1,9 +1,28 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <cstdint>
 #include <cstdio>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include "units.hpp"
 
 namespace utilities{
@@ -32,4 +51,231 @@ namespace utilities{
         return 0;
     }
 
+    // std::stoi for a cell of any string type: leading digits, throws when there are none
+    inline int toInt(std::string_view text){
+        int value{0};
+        auto [end, error]{std::from_chars(text.data(), text.data() + text.size(), value)};
+        if(error == std::errc::result_out_of_range) throw std::out_of_range{"integer out of range: " + std::string{text}};
+        if(error != std::errc{}) throw std::invalid_argument{"not an integer: \"" + std::string{text} + "\""};
+        return value;
+    }
+
+    inline std::vector<std::string> readLines(const std::string &path){
+        std::vector<std::string> lines;
+        std::ifstream in{path};
+        std::string line;
+        while(std::getline(in, line)){
+            lines.push_back(line);
+        }
+        return lines;
+    }
+
+    namespace _{
+        inline std::atomic<size_t> pinnedThreadCount{0};
+    }
+
+    // 0 means one worker per hardware thread. a ThreadCountPin overrides every configuration
+    inline size_t resolveThreadCount(size_t configured){
+        if(size_t pinned{_::pinnedThreadCount.load()}; pinned != 0) return pinned;
+        if(configured != 0) return configured;
+        return std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    // every worker pool started while it lives uses count threads
+    class ThreadCountPin{
+    public:
+        explicit ThreadCountPin(size_t count)
+            : previous_{_::pinnedThreadCount.exchange(count)}
+        {}
+
+        ThreadCountPin(const ThreadCountPin &) = delete;
+        ThreadCountPin &operator=(const ThreadCountPin &) = delete;
+
+        ~ThreadCountPin(){
+            _::pinnedThreadCount = previous_;
+        }
+
+    private:
+        size_t previous_;
+    };
+
+    // runs task(i) for every i in [0, count) on up to threadCount workers pulling from a shared counter.
+    // the first exception a task throws stops the handing out and is rethrown here once every worker is done
+    template<typename Task>
+    void parallelFor(size_t count, size_t threadCount, Task &&task){
+        std::atomic<size_t> next{0};
+        std::exception_ptr failure;
+        std::mutex failureMutex;
+        auto work{[&](){
+            try{
+                for(size_t i{next++}; i < count; i = next++){
+                    task(i);
+                }
+            }catch(...){
+                std::lock_guard lock{failureMutex};
+                if(!failure) failure = std::current_exception();
+                next = count;
+            }
+        }};
+
+        size_t workerCount{std::min(resolveThreadCount(threadCount), count)};
+        if(workerCount <= 1){
+            work();
+        }else{
+            std::vector<std::thread> workers;
+            for(size_t i{0}; i < workerCount; i++){
+                workers.emplace_back(work);
+            }
+            for(auto &worker : workers){
+                worker.join();
+            }
+        }
+        if(failure) std::rethrow_exception(failure);
+    }
+
+    // 64-bit multiply-xorshift over 8 byte words. not cryptographic, only used to
+    // notice that an input changed since a cache was built from it
+    inline uint64_t hashBytes(const char *data, size_t size, uint64_t seed = 0){
+        uint64_t hash{seed ^ (size * 0x9E3779B97F4A7C15ull)};
+        size_t i{0};
+        for(; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)){
+            uint64_t word;
+            std::memcpy(&word, data + i, sizeof(word));
+            hash = (hash ^ word) * 0xFF51AFD7ED558CCDull;
+            hash ^= hash >> 32;
+        }
+        uint64_t tail{0};
+        std::memcpy(&tail, data + i, size - i);
+        hash = (hash ^ tail) * 0xC4CEB9FE1A85EC53ull;
+        return hash ^ (hash >> 29);
+    }
+
+    // read-only mapping of a whole file, unmapped when the last copy goes away
+    class MappedFile{
+    public:
+        static std::optional<MappedFile> open(const std::string &path){
+            int descriptor{::open(path.c_str(), O_RDONLY | O_CLOEXEC)};
+            if(descriptor < 0) return std::nullopt;
+
+            struct stat status{};
+            if(::fstat(descriptor, &status) < 0 || status.st_size <= 0){
+                ::close(descriptor);
+                return std::nullopt;
+            }
+
+            size_t size{static_cast<size_t>(status.st_size)};
+            void *address{::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, descriptor, 0)};
+            ::close(descriptor);
+            if(address == MAP_FAILED) return std::nullopt;
+
+            MappedFile file;
+            file.size_ = size;
+            file.data_ = std::shared_ptr<const char>(static_cast<const char *>(address), [size](const char *mapped){
+                ::munmap(const_cast<char *>(mapped), size);
+            });
+            return file;
+        }
+
+        const char *data() const{ return data_.get(); }
+        size_t size() const{ return size_; }
+
+    private:
+        std::shared_ptr<const char> data_;
+        size_t size_{0};
+    };
+
+    // bump allocator for the working set of one file, all of it released by one
+    // reset(). whatever overflowed the buffer is added to it on reset, so once a
+    // worker has seen its largest file the following ones allocate nothing
+    class Arena{
+    public:
+        explicit Arena(size_t initialBytes = 1 << 20)
+            : buffer_{new std::byte[initialBytes]}
+            , bufferBytes_{initialBytes}
+        {
+            resource_.emplace(buffer_.get(), bufferBytes_, &overflow_);
+        }
+
+        Arena(const Arena &) = delete;
+        Arena &operator=(const Arena &) = delete;
+
+        std::pmr::memory_resource *resource(){ return &*resource_; }
+
+        // every container allocated from resource() must be gone by now
+        void reset(){
+            resource_.reset();
+            if(overflow_.bytes > 0){
+                bufferBytes_ += overflow_.bytes;
+                buffer_.reset(new std::byte[bufferBytes_]);
+                overflow_.bytes = 0;
+            }
+            resource_.emplace(buffer_.get(), bufferBytes_, &overflow_);
+        }
+
+    private:
+        // the heap behind the buffer, counting what it hands out
+        struct OverflowResource : std::pmr::memory_resource{
+            size_t bytes{0};
+
+            void *do_allocate(size_t size, size_t alignment) override{
+                bytes += size;
+                return std::pmr::new_delete_resource()->allocate(size, alignment);
+            }
+            void do_deallocate(void *pointer, size_t size, size_t alignment) override{
+                std::pmr::new_delete_resource()->deallocate(pointer, size, alignment);
+            }
+            bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override{ return this == &other; }
+        };
+
+        std::unique_ptr<std::byte[]> buffer_;
+        size_t bufferBytes_;
+        OverflowResource overflow_;
+        std::optional<std::pmr::monotonic_buffer_resource> resource_;
+    };
+
+    // arenas of the workers of a parallelFor, one per file being processed at a
+    // time. a lease resets its arena when it goes out of scope, so declare it
+    // before the containers that use it
+    class ArenaPool{
+    public:
+        class Lease{
+        public:
+            Lease(ArenaPool &pool, Arena &arena)
+                : pool_{pool}
+                , arena_{arena}
+            {}
+
+            Lease(const Lease &) = delete;
+            Lease &operator=(const Lease &) = delete;
+
+            ~Lease(){
+                arena_.reset();
+                std::lock_guard lock{pool_.mutex_};
+                pool_.idle_.push_back(&arena_);
+            }
+
+            std::pmr::memory_resource *resource(){ return arena_.resource(); }
+
+        private:
+            ArenaPool &pool_;
+            Arena &arena_;
+        };
+
+        Lease acquire(){
+            std::lock_guard lock{mutex_};
+            if(idle_.empty()){
+                arenas_.push_back(std::make_unique<Arena>());
+                return Lease{*this, *arenas_.back()};
+            }
+            Arena *arena{idle_.back()};
+            idle_.pop_back();
+            return Lease{*this, *arena};
+        }
+
+    private:
+        std::mutex mutex_;
+        std::vector<std::unique_ptr<Arena>> arenas_;
+        std::vector<Arena *> idle_;
+    };
+
 } // namespace utilities
@@ -0,0 +1,441 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <fmt/core.h>
+
+#include <unistd.h>
+
+#include "constants.hpp"
+#include "csv_tokenizer.hpp"
+#include "compressed_io.hpp"
+#include "utilities.hpp"
+#include "selection.hpp"
+#include "station_blend.hpp"
+
+namespace weather{
+
+    // one station's records sorted by time: minutes[i] is the record's epoch
+    // minute and values[i * fieldCount + f] its value for header field f
+    struct Series{
+        const int32_t *minutes{nullptr};
+        const float *values{nullptr};
+        size_t count{0};
+        size_t fieldCount{0};
+
+        bool empty() const{ return count == 0; }
+        const float *row(size_t index) const{ return values + index * fieldCount; }
+    };
+
+    namespace _{
+
+        // index file layout, every section starts 8 byte aligned:
+        // IndexHeader | field names, '\n' separated | uint8 decimals[fieldCount] | StationEntry[stationCount]
+        // | int32 minutes[recordCount] | float values[recordCount * fieldCount]
+        constexpr char IndexMagic[8]{'T', 'W', 'J', 'W', 'X', '0', '0', '1'};
+
+        struct IndexHeader{
+            char magic[8];
+            uint64_t key;               // source hash mixed with the configuration that shaped the records
+            uint32_t fieldCount;
+            uint32_t stationCount;
+            uint64_t recordCount;
+            uint64_t namesBytes;
+        };
+
+        struct StationEntry{
+            int32_t stationId;
+            uint32_t reserved;
+            uint64_t firstRecord;
+            uint64_t recordCount;
+        };
+
+        inline size_t align(size_t offset){
+            return (offset + 7) & ~size_t{7};
+        }
+
+        // projection and time range change which records and fields end up in the index
+        inline uint64_t indexKey(const utilities::MappedFile &source){
+            std::string configuration{fmt::format(
+                "{}|{}|{}|",
+                constants::selection::FirstDate,
+                constants::selection::LastDate,
+                constants::system::MaxWeatherTimeDifferenceMinutes
+            )};
+            for(const auto &column : constants::selection::weatherColumns()) configuration += column + ',';
+            return utilities::hashBytes(source.data(), source.size(), utilities::hashBytes(configuration.data(), configuration.size()));
+        }
+
+        struct Buffers{
+            std::vector<int32_t> minutes;
+            std::vector<float> values;
+        };
+
+    } // namespace _
+
+    // hourly weather grouped by station and sorted by time, typed. backed either
+    // by freshly parsed buffers or by a mapped index file
+    class Store{
+    public:
+        const std::vector<std::string> &header() const{ return header_; }
+        size_t recordCount() const{ return recordCount_; }
+        size_t stationCount() const{ return stations_.size(); }
+
+        Series series(int stationId) const{
+            auto station{std::lower_bound(stations_.begin(), stations_.end(), stationId, [](const _::StationEntry &entry, int id){
+                return entry.stationId < id;
+            })};
+            if(station == stations_.end() || station->stationId != stationId) return {};
+            return {
+                minutes_ + station->firstRecord,
+                values_ + station->firstRecord * header_.size(),
+                static_cast<size_t>(station->recordCount),
+                header_.size()
+            };
+        }
+
+        // first record at or after timestamp (the last one past the end), if it is
+        // within MaxWeatherTimeDifferenceMinutes
+        const float *find(int stationId, const units::Timestamp &timestamp) const{
+            Series records{series(stationId)};
+            if(records.empty()) return nullptr;
+
+            int minute{timestamp.toEpochMinutes()};
+            size_t found{static_cast<size_t>(std::lower_bound(records.minutes, records.minutes + records.count, minute) - records.minutes)};
+            if(found == records.count) found = records.count - 1;
+
+            if(std::abs(records.minutes[found] - minute) > constants::system::MaxWeatherTimeDifferenceMinutes) return nullptr;
+            return records.row(found);
+        }
+
+        // like find, but the weighted mean of every blend station's record; the
+        // first (nearest) station must have one. values goes to out[fieldCount]
+        bool findBlended(const Blend &blend, const units::Timestamp &timestamp, float *out) const{
+            std::vector<const float *> rows;
+            std::vector<float> weights;
+            for(const auto &station : blend){
+                const float *values{find(station.stationId, timestamp)};
+                if(values == nullptr){
+                    if(rows.empty()) return false;
+                    continue;
+                }
+                rows.push_back(values);
+                weights.push_back(station.weight);
+            }
+            if(rows.empty()) return false;
+            blendRows(rows.data(), weights.data(), rows.size(), header_.size(), out);
+            return true;
+        }
+
+        // ",<field>,<field>..." of one record in header order, numbers printed with
+        // as many decimals as the column had in the csv
+        void appendRecord(std::string &out, int stationId, const Series &records, size_t index) const{
+            appendValues(out, stationId, records.minutes[index], records.row(index));
+        }
+
+        // appendRecord for values that are not a stored record, e.g. a blend
+        void appendValues(std::string &out, int stationId, int32_t minute, const float *values) const{
+            for(size_t field{0}; field < header_.size(); field++){
+                out += ',';
+                if(field == locationField_){
+                    out += fmt::format("{}", stationId);
+                }else if(field == timeField_){
+                    auto timestamp{units::Timestamp::fromEpochMinutes(minute)};
+                    out += fmt::format(
+                        "{:04}-{:02}-{:02}T{:02}:{:02}",
+                        timestamp.year, timestamp.month, timestamp.day, timestamp.hour, timestamp.minute
+                    );
+                }else if(!std::isnan(values[field])){
+                    out += fmt::format("{:.{}f}", values[field], decimals_[field]);
+                }
+            }
+        }
+
+        // formats every record once with appendRecord, so joins can copy a
+        // record's suffix instead of printing its fields again for each row
+        void cacheSuffixes(){
+            suffixes_.clear();
+            suffixOffsets_.assign(1, 0);
+            suffixOffsets_.reserve(recordCount_ + 1);
+            for(const auto &station : stations_){
+                Series records{series(station.stationId)};
+                for(size_t index{0}; index < records.count; index++){
+                    appendRecord(suffixes_, station.stationId, records, index);
+                    suffixOffsets_.push_back(suffixes_.size());
+                }
+            }
+        }
+
+        // the cached appendRecord output of records[index], needs cacheSuffixes()
+        std::string_view suffix(const Series &records, size_t index) const{
+            size_t record{static_cast<size_t>(records.minutes - minutes_) + index};
+            return {suffixes_.data() + suffixOffsets_[record], suffixOffsets_[record + 1] - suffixOffsets_[record]};
+        }
+
+        static Store fromIndex(const utilities::MappedFile &index, uint64_t key);
+        static Store fromCsv(const std::string &weatherCsvPath);
+        bool writeIndex(const std::string &indexPath, uint64_t key) const;
+
+    private:
+        void resolveFields(){
+            locationField_  = utilities::findColumn(header_, constants::column_names::LocationId);
+            timeField_      = utilities::findColumn(header_, constants::column_names::Time);
+        }
+
+        std::vector<std::string> header_;
+        std::vector<uint8_t> decimals_;
+        size_t locationField_{0};
+        size_t timeField_{0};
+        std::vector<_::StationEntry> stations_;
+        const int32_t *minutes_{nullptr};
+        const float *values_{nullptr};
+        size_t recordCount_{0};
+        std::shared_ptr<const void> storage_;   // keeps minutes_ and values_ alive
+        std::string suffixes_;                  // record r is suffixes_[suffixOffsets_[r], suffixOffsets_[r + 1])
+        std::vector<size_t> suffixOffsets_;
+    };
+
+    // empty store if the file is not an index for this source and configuration
+    inline Store Store::fromIndex(const utilities::MappedFile &index, uint64_t key){
+        Store store;
+        if(index.size() < sizeof(_::IndexHeader)) return store;
+
+        _::IndexHeader header;
+        std::memcpy(&header, index.data(), sizeof(header));
+        if(std::memcmp(header.magic, _::IndexMagic, sizeof(header.magic)) != 0 || header.key != key) return store;
+
+        // counts past what the file could hold would overflow the offsets below
+        if(header.namesBytes > index.size() || header.recordCount > index.size() / sizeof(int32_t)) return store;
+
+        size_t namesOffset      {sizeof(_::IndexHeader)};
+        size_t decimalsOffset   {namesOffset + header.namesBytes};
+        size_t stationsOffset   {_::align(decimalsOffset + header.fieldCount)};
+        size_t minutesOffset    {stationsOffset + header.stationCount * sizeof(_::StationEntry)};
+        size_t valuesOffset     {_::align(minutesOffset + header.recordCount * sizeof(int32_t))};
+        if(valuesOffset > index.size()
+            || header.recordCount * sizeof(float) > (index.size() - valuesOffset) / std::max<size_t>(header.fieldCount, 1)) return store;
+        size_t endOffset        {valuesOffset + header.recordCount * header.fieldCount * sizeof(float)};
+        if(endOffset != index.size()) return store;
+
+        std::string_view names{index.data() + namesOffset, header.namesBytes};
+        for(size_t start{0}; start <= names.size();){
+            size_t end{std::min(names.find('\n', start), names.size())};
+            store.header_.emplace_back(names.substr(start, end - start));
+            start = end + 1;
+        }
+        if(store.header_.size() != header.fieldCount) return {};
+        store.decimals_.assign(index.data() + decimalsOffset, index.data() + decimalsOffset + header.fieldCount);
+
+        const auto *stations{reinterpret_cast<const _::StationEntry *>(index.data() + stationsOffset)};
+        store.stations_.assign(stations, stations + header.stationCount);
+
+        // a stale or corrupt index of the right size must not send series() out of the records
+        for(size_t station{0}; station < store.stations_.size(); station++){
+            const _::StationEntry &entry{store.stations_[station]};
+            if(entry.firstRecord > header.recordCount || entry.recordCount > header.recordCount - entry.firstRecord) return {};
+            if(station > 0 && store.stations_[station - 1].stationId >= entry.stationId) return {};
+        }
+        store.minutes_      = reinterpret_cast<const int32_t *>(index.data() + minutesOffset);
+        store.values_       = reinterpret_cast<const float *>(index.data() + valuesOffset);
+        store.recordCount_  = header.recordCount;
+        store.storage_      = std::shared_ptr<const void>(std::make_shared<utilities::MappedFile>(index), index.data());
+        store.resolveFields();
+        return store;
+    }
+
+    inline Store Store::fromCsv(const std::string &weatherCsvPath){
+        fmt::println("loading weather: {}", weatherCsvPath);
+
+        tokenizer::Reader weatherCsv;
+
+        auto weatherInput{compression::open(weatherCsv, weatherCsvPath)};
+
+        std::vector<std::string> weatherInputHeader;
+        for(const auto &cell : weatherCsv.header()){
+            std::string value;
+            cell.read_value(value);
+            weatherInputHeader.push_back(value);
+        }
+
+        selection::Projection weatherProjection{
+            weatherInputHeader,
+            constants::selection::weatherColumns(),
+            {constants::column_names::LocationId, constants::column_names::Time}
+        };
+
+        Store store;
+        store.header_ = weatherProjection.header();
+        store.resolveFields();
+        size_t fieldCount{store.header_.size()};
+        store.decimals_.assign(fieldCount, 0);
+
+        struct Parsed{
+            int32_t stationId;
+            int32_t minute;
+            uint32_t row;
+        };
+        std::vector<Parsed> parsed;
+        std::vector<float> parsedValues;
+
+        size_t weatherRowCount{0};
+
+        for(const auto &row : weatherCsv){
+            weatherRowCount++;
+            if(weatherRowCount % constants::system::RowProgressInterval == 0){
+                fmt::println("loaded {} weather records", weatherRowCount);
+            }
+
+            std::vector<std::string> fields{weatherProjection.read(row)};
+
+            size_t requiredSize{std::max(store.locationField_, store.timeField_) + 1};
+            if(fields.size() < requiredSize){
+                fmt::println(
+                    "[!!! row {} has only {} columns when it should have {}, skipping... !!!]",
+                    weatherRowCount, fields.size(), requiredSize
+                );
+                continue;
+            }
+
+            units::Timestamp timestamp{utilities::parseTimestamp(fields[store.timeField_])};
+            if(!selection::inTimeRange(timestamp, constants::system::MaxWeatherTimeDifferenceMinutes)) continue;
+
+            parsed.push_back({std::stoi(fields[store.locationField_]), timestamp.toEpochMinutes(), static_cast<uint32_t>(parsed.size())});
+            static const std::string empty;
+            for(size_t field{0}; field < fieldCount; field++){
+                const std::string &value{field < fields.size() ? fields[field] : empty};
+                char *end{nullptr};
+                float number{std::strtof(value.c_str(), &end)};
+                size_t point{value.find('.')};
+                if(point != std::string::npos){
+                    size_t digits{value.find_first_not_of("0123456789", point + 1)};
+                    digits = (digits == std::string::npos ? value.size() : digits) - point - 1;
+                    store.decimals_[field] = std::max(store.decimals_[field], static_cast<uint8_t>(std::min<size_t>(digits, 9)));
+                }
+                parsedValues.push_back(
+                    field == store.timeField_ || end == value.c_str() ? std::numeric_limits<float>::quiet_NaN() : number
+                );
+            }
+        }
+
+        fmt::println("loaded {} weather records, sorting by station and time...", weatherRowCount);
+
+        std::stable_sort(parsed.begin(), parsed.end(), [](const Parsed &left, const Parsed &right){
+            if(left.stationId != right.stationId) return left.stationId < right.stationId;
+            return left.minute < right.minute;
+        });
+
+        auto buffers{std::make_shared<_::Buffers>()};
+        buffers->minutes.reserve(parsed.size());
+        buffers->values.reserve(parsed.size() * fieldCount);
+        for(const auto &record : parsed){
+            if(store.stations_.empty() || store.stations_.back().stationId != record.stationId){
+                store.stations_.push_back({record.stationId, 0, buffers->minutes.size(), 0});
+            }
+            store.stations_.back().recordCount++;
+            buffers->minutes.push_back(record.minute);
+            const float *values{parsedValues.data() + static_cast<size_t>(record.row) * fieldCount};
+            buffers->values.insert(buffers->values.end(), values, values + fieldCount);
+        }
+
+        store.minutes_      = buffers->minutes.data();
+        store.values_       = buffers->values.data();
+        store.recordCount_  = buffers->minutes.size();
+        store.storage_      = std::move(buffers);
+
+        fmt::println("{} weather records for {} stations", store.recordCount_, store.stations_.size());
+        return store;
+    }
+
+    inline bool Store::writeIndex(const std::string &indexPath, uint64_t key) const{
+        std::filesystem::path path{indexPath};
+        if(path.has_parent_path()) std::filesystem::create_directories(path.parent_path());
+
+        // written next to the index and renamed over it, readers never see a partial file
+        // per process, shards started together may all rebuild the same index
+        std::string temporaryPath{fmt::format("{}.{}.tmp", indexPath, ::getpid())};
+        std::ofstream out{temporaryPath, std::ios::binary};
+        if(!out) return false;
+
+        std::string names;
+        for(size_t i{0}; i < header_.size(); i++){
+            if(i > 0) names += '\n';
+            names += header_[i];
+        }
+
+        _::IndexHeader header{};
+        std::memcpy(header.magic, _::IndexMagic, sizeof(header.magic));
+        header.key          = key;
+        header.fieldCount   = static_cast<uint32_t>(header_.size());
+        header.stationCount = static_cast<uint32_t>(stations_.size());
+        header.recordCount  = recordCount_;
+        header.namesBytes   = names.size();
+
+        const char padding[8]{};
+        auto pad{[&](size_t written){
+            out.write(padding, static_cast<std::streamsize>(_::align(written) - written));
+        }};
+
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        out.write(names.data(), static_cast<std::streamsize>(names.size()));
+        out.write(reinterpret_cast<const char *>(decimals_.data()), static_cast<std::streamsize>(decimals_.size()));
+        pad(sizeof(header) + names.size() + decimals_.size());
+        out.write(reinterpret_cast<const char *>(stations_.data()), static_cast<std::streamsize>(stations_.size() * sizeof(_::StationEntry)));
+        out.write(reinterpret_cast<const char *>(minutes_), static_cast<std::streamsize>(recordCount_ * sizeof(int32_t)));
+        pad(recordCount_ * sizeof(int32_t));
+        out.write(reinterpret_cast<const char *>(values_), static_cast<std::streamsize>(recordCount_ * header_.size() * sizeof(float)));
+        out.close();
+        if(!out) return false;
+
+        std::error_code error;
+        std::filesystem::rename(temporaryPath, indexPath, error);
+        return !error;
+    }
+
+    // maps the index at indexPath when it was built from this weather file with
+    // the current selection, otherwise parses the csv and rebuilds the index
+    inline Store load(const std::string &weatherCsvPath, const std::string &indexPath){
+        auto source{utilities::MappedFile::open(weatherCsvPath)};
+        if(!source){
+            fmt::println("[!!! could not open weather file {} !!!]", weatherCsvPath);
+            return {};
+        }
+
+        uint64_t key{_::indexKey(*source)};
+        source.reset();
+
+        if(constants::weather::PersistIndex){
+            if(auto index{utilities::MappedFile::open(indexPath)}){
+                Store store{Store::fromIndex(*index, key)};
+                if(store.recordCount() > 0){
+                    fmt::println(
+                        "mapped weather index {}: {} records for {} stations",
+                        indexPath, store.recordCount(), store.stationCount()
+                    );
+                    return store;
+                }
+                fmt::println("weather index {} is stale, rebuilding...", indexPath);
+            }
+        }
+
+        Store store{Store::fromCsv(weatherCsvPath)};
+        if(constants::weather::PersistIndex){
+            if(store.writeIndex(indexPath, key)){
+                fmt::println("saved weather index to {}", indexPath);
+            }else{
+                fmt::println("[!!! could not write weather index {} !!!]", indexPath);
+            }
+        }
+        return store;
+    }
+
+} // namespace weather
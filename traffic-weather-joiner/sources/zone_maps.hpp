@@ -0,0 +1,122 @@
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "constants.hpp"
+#include "csv_tokenizer.hpp"
+#include "time_columns.hpp"
+
+namespace zones{
+
+    // bounds of one column over a zone. numeric bounds cover the values that
+    // parse as numbers (NaN when none do), text bounds cover every value
+    struct ColumnZone{
+        bool present{false};    // some row of the zone has this column
+        double min{std::numeric_limits<double>::quiet_NaN()};
+        double max{std::numeric_limits<double>::quiet_NaN()};
+        std::string minText;
+        std::string maxText;
+
+        void add(std::string_view value){
+            if(!present){
+                present = true;
+                minText.assign(value);
+                maxText.assign(value);
+            }else if(value < minText){
+                minText.assign(value);
+            }else if(value > maxText){
+                maxText.assign(value);
+            }
+
+            double number{0.0};
+            auto [end, error]{std::from_chars(value.data(), value.data() + value.size(), number)};
+            if(error != std::errc{} || end != value.data() + value.size() || std::isnan(number)) return;
+            if(std::isnan(min) || number < min) min = number;
+            if(std::isnan(max) || number > max) max = number;
+        }
+
+        void include(const ColumnZone &other){
+            if(!other.present) return;
+            if(!present){
+                *this = other;
+                return;
+            }
+            if(other.minText < minText) minText = other.minText;
+            if(other.maxText > maxText) maxText = other.maxText;
+            if(!std::isnan(other.min) && (std::isnan(min) || other.min < min)) min = other.min;
+            if(!std::isnan(other.max) && (std::isnan(max) || other.max > max)) max = other.max;
+        }
+    };
+
+    // statistics of a run of up to RowsPerZone rows of a segment block. the
+    // minutes stay unbounded when the block has no time columns
+    struct ZoneMap{
+        uint64_t offset{0};     // first row, relative to the block start
+        uint64_t length{0};
+        uint64_t rowCount{0};
+        int32_t firstMinute{std::numeric_limits<int32_t>::max()};
+        int32_t lastMinute{std::numeric_limits<int32_t>::min()};
+        std::vector<ColumnZone> columns;
+
+        void include(const ZoneMap &other){
+            rowCount += other.rowCount;
+            firstMinute = std::min(firstMinute, other.firstMinute);
+            lastMinute = std::max(lastMinute, other.lastMinute);
+            if(columns.size() < other.columns.size()) columns.resize(other.columns.size());
+            for(size_t column{0}; column < other.columns.size(); column++) columns[column].include(other.columns[column]);
+        }
+    };
+
+    // zone maps of a csv block (header line first), one per RowsPerZone rows
+    inline std::vector<ZoneMap> build(std::string_view block){
+        std::vector<ZoneMap> zones;
+        if(constants::zone_maps::RowsPerZone == 0) return zones;
+
+        tokenizer::Reader csv;
+        csv.parse(block);
+        std::vector<std::string> header;
+        for(const auto &cell : csv.header()){
+            std::string value;
+            cell.read_value(value);
+            header.push_back(value);
+        }
+        auto timeColumns{units::TimeColumns::find(header)};
+
+        for(const auto &row : csv){
+            uint64_t rowOffset{static_cast<uint64_t>(row.text().data() - block.data())};
+            if(zones.empty() || zones.back().rowCount == constants::zone_maps::RowsPerZone){
+                if(!zones.empty()) zones.back().length = rowOffset - zones.back().offset;
+                zones.push_back({});
+                zones.back().offset = rowOffset;
+                zones.back().columns.resize(header.size());
+                if(!timeColumns){
+                    zones.back().firstMinute = std::numeric_limits<int32_t>::min();
+                    zones.back().lastMinute = std::numeric_limits<int32_t>::max();
+                }
+            }
+
+            ZoneMap &zone{zones.back()};
+            zone.rowCount++;
+            if(timeColumns){
+                int32_t minute{timeColumns->minuteOf(row, units::NoMinute)};
+                if(minute != units::NoMinute){
+                    zone.firstMinute = std::min(zone.firstMinute, minute);
+                    zone.lastMinute = std::max(zone.lastMinute, minute);
+                }
+            }
+            size_t columnCount{std::min(row.size(), header.size())};
+            for(size_t column{0}; column < columnCount; column++) zone.columns[column].add(row[column].view());
+        }
+        if(!zones.empty()) zones.back().length = block.size() - zones.back().offset;
+        return zones;
+    }
+
+} // namespace zones